@@ -0,0 +1,2669 @@
+/*
+ * ext2_disk.c
+ *
+ * Disk access shared by myfsck and myinject: the block cache and direct
+ * I/O, the copy-on-write overlay, repair transactions and the undo log,
+ * partition discovery, and the superblock and inode readers.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fs.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include "ext2_disk.h"
+
+#if defined(__FreeBSD__)
+#define lseek64 lseek
+#endif
+
+extern int64_t lseek64(int, int64_t, int);
+
+static int device;
+
+// Taken by read_sectors, write_sectors, txn_flush, io_willneed, Put_Inode
+// and the block buffer pool, the parts worker threads use or race with.
+// Everything else is main thread only.  Recursive, Put_Inode reads and
+// writes under it.
+static pthread_mutex_t io_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+struct partition* parArray;
+
+int    parArrayCounter = 0;
+
+// parArray holds the table entries as found, these are the absolute 64-bit
+// extents the I/O uses
+static struct {
+  int64_t start_sect;
+  int64_t nr_sects;
+} parExtent[100];
+
+static int64_t extend_base = 0;
+
+// Group descriptor table of one partition, see Get_Group_Desc_Table
+static struct {
+  int     parIndex;             // 0 if nothing loaded
+  __u32   groups;
+  int64_t start_sector;         // sectors the table was read from
+  int64_t num_sectors;
+  struct ext2_group_desc* desc;
+} gdt_cache;
+
+/* Forget the cached table if it lies in the given sectors, or always with num_sectors -1. */
+static void gdt_forget(int64_t start_sector, int64_t num_sectors) {
+  if(gdt_cache.parIndex != 0
+     && (num_sectors < 0 || (start_sector < gdt_cache.start_sector + gdt_cache.num_sectors
+                             && gdt_cache.start_sector < start_sector + num_sectors)))
+    gdt_cache.parIndex = 0;
+}
+
+int BLOCKSIZE = 1024;
+
+int BLOCK_SECTOR_RATIO = 2;
+
+/*
+ * Block cache and direct I/O
+ *
+ * All device reads go through a cache of CACHE_PAGE_SIZE pages (clock
+ * replacement, --cache-mb megabytes).  Misses are read page-aligned, a run
+ * of consecutive missing pages in one pread, so the same path works for a
+ * device opened with O_DIRECT (--direct), where the kernel page cache is
+ * bypassed and this cache is the only one.  Writes update the cached pages;
+ * in direct mode they are written back as whole pages.
+ */
+
+#define CACHE_PAGE_SIZE       4096
+#define CACHE_PAGE_SECTORS    (CACHE_PAGE_SIZE / SECTOR_SIZE_BYTES)
+#define CACHE_MISS_RUN        32          /* pages read by one pread at most */
+
+struct cache_page {
+  int64_t       page;           // device offset / CACHE_PAGE_SIZE, -1 if free
+  int           next;           // hash chain
+  unsigned char referenced;     // clock bit
+};
+
+int    direct_io = 0;
+
+int    cache_mb = CACHE_DEFAULT_MB;
+
+int    pipe_depth = PIPE_DEFAULT_DEPTH;
+
+static int64_t device_size = 0;
+
+static int    device_tail = -1;  // the device without O_DIRECT, for a partial last page
+
+static unsigned char* cache_data = NULL;
+
+static struct cache_page* cache_pages = NULL;
+
+static int    cache_capacity = 0;
+
+static int*   cache_hash = NULL;
+
+static int    cache_hash_mask = 0;
+
+static int    cache_hand = 0;
+
+static unsigned char* cache_bounce = NULL;
+
+static long   cache_hits = 0;
+
+static long   cache_misses = 0;
+
+static void* alloc_aligned(size_t size) {
+  void* p;
+  if(posix_memalign(&p, CACHE_PAGE_SIZE, size) != 0) {
+    perror("Could not allocate aligned memory");
+    exit(-1);
+  }
+  return p;
+}
+
+static int cache_bucket(int64_t page) {
+  return (int) ((page * 0x9E3779B97F4A7C15ULL) >> 40) & cache_hash_mask;
+}
+
+/*
+ * Copy-on-write overlay
+ *
+ * With --overlay FILE the image is opened read-only and every write lands
+ * in FILE instead: a header, a bitmap with one bit per CACHE_PAGE_SIZE
+ * page of the image, and a sparse data area where a written page is kept
+ * at the same offset it has in the image.  Reads take a page from the
+ * overlay when its bit is set and from the image otherwise.  Staging a
+ * repair costs only the pages it touches, and any number of overlays can
+ * share one base image.  --commit-overlay FILE copies the pages into the
+ * image.
+ */
+
+#define OVERLAY_MAGIC         0x4c52564f  /* "OVRL" */
+#define OVERLAY_VERSION       1
+#define OVERLAY_HEADER_SIZE   CACHE_PAGE_SIZE
+
+struct overlay_header {
+  __u32 magic;
+  __u32 version;
+  __u32 page_size;
+  __u32 reserved;
+  __u64 base_size;        // size of the image the overlay belongs to
+  __u64 bitmap_offset;
+  __u64 bitmap_bytes;
+  __u64 data_offset;      // page p of the image lives at data_offset + p * page_size
+};
+
+char*  overlay_path = NULL;
+
+static int    overlay_fd = -1;
+
+static struct overlay_header overlay;
+
+static unsigned char* overlay_bitmap = NULL;
+
+static int overlay_has_page(int64_t page) {
+  return overlay_fd != -1 && (overlay_bitmap[page / 8] & (1 << (page % 8)));
+}
+
+/*
+ * Open the overlay of an image of base_size bytes, creating it if needed.
+ */
+static void overlay_open(int64_t base_size) {
+  if ((overlay_fd = open(overlay_path, O_RDWR | O_CREAT, 0644)) == -1) {
+    perror("Could not open overlay file");
+    exit(-1);
+  }
+
+  if (pread(overlay_fd, &overlay, sizeof(overlay), 0) == sizeof(overlay)
+      && overlay.magic == OVERLAY_MAGIC) {
+    if (overlay.version != OVERLAY_VERSION || overlay.page_size != CACHE_PAGE_SIZE
+        || overlay.base_size != (__u64) base_size) {
+      fprintf(stderr, "%s is an overlay of a different image\n", overlay_path);
+      exit(-1);
+    }
+    overlay_bitmap = (unsigned char*) malloc(overlay.bitmap_bytes);
+    if (pread(overlay_fd, overlay_bitmap, overlay.bitmap_bytes, overlay.bitmap_offset)
+        != (ssize_t) overlay.bitmap_bytes) {
+      perror("Could not read overlay bitmap");
+      exit(-1);
+    }
+    return;
+  }
+
+  memset(&overlay, 0, sizeof(overlay));
+  overlay.magic = OVERLAY_MAGIC;
+  overlay.version = OVERLAY_VERSION;
+  overlay.page_size = CACHE_PAGE_SIZE;
+  overlay.base_size = base_size;
+  overlay.bitmap_offset = OVERLAY_HEADER_SIZE;
+  overlay.bitmap_bytes = (base_size / CACHE_PAGE_SIZE + 1 + 7) / 8;
+  overlay.data_offset = (OVERLAY_HEADER_SIZE + overlay.bitmap_bytes + CACHE_PAGE_SIZE - 1)
+                        / CACHE_PAGE_SIZE * CACHE_PAGE_SIZE;
+  overlay_bitmap = (unsigned char*) calloc(overlay.bitmap_bytes, 1);
+
+  if (ftruncate(overlay_fd, overlay.data_offset + base_size) != 0
+      || pwrite(overlay_fd, overlay_bitmap, overlay.bitmap_bytes, overlay.bitmap_offset)
+         != (ssize_t) overlay.bitmap_bytes
+      || pwrite(overlay_fd, &overlay, sizeof(overlay), 0) != sizeof(overlay)) {
+    perror("Could not create overlay file");
+    exit(-1);
+  }
+}
+
+/* Store one whole page in the overlay and mark it present. */
+static void overlay_write_page(int64_t page, const unsigned char* data) {
+  if (pwrite(overlay_fd, data, CACHE_PAGE_SIZE, overlay.data_offset + page * CACHE_PAGE_SIZE)
+      != CACHE_PAGE_SIZE) {
+    perror("Could not write overlay file");
+    exit(-1);
+  }
+  if (!overlay_has_page(page)) {
+    overlay_bitmap[page / 8] |= 1 << (page % 8);
+    if (pwrite(overlay_fd, overlay_bitmap + page / 8, 1, overlay.bitmap_offset + page / 8) != 1) {
+      perror("Could not write overlay bitmap");
+      exit(-1);
+    }
+  }
+}
+
+static void overlay_read_page(int64_t page, unsigned char* data) {
+  if (pread(overlay_fd, data, CACHE_PAGE_SIZE, overlay.data_offset + page * CACHE_PAGE_SIZE)
+      != CACHE_PAGE_SIZE) {
+    perror("Could not read overlay file");
+    exit(-1);
+  }
+}
+
+/*
+ * Open the device and set up the cache.  With direct set the device is
+ * opened with O_DIRECT; a file system that refuses it falls back to
+ * buffered I/O.
+ */
+void device_open(const char* diskname, int flags) {
+  int i;
+
+  gdt_forget(0, -1);
+
+  // The image stays untouched under an overlay
+  if (overlay_path != NULL)
+    flags = O_RDONLY;
+
+#ifdef O_DIRECT
+  if (direct_io) {
+    device = open(diskname, flags | O_DIRECT);
+    if (device == -1 && errno == EINVAL) {
+      fprintf(stderr, "%s does not support O_DIRECT, using buffered I/O\n", diskname);
+      direct_io = 0;
+    }
+  }
+  if (!direct_io)
+#endif
+    device = open(diskname, flags);
+
+  if (device == -1) {
+    perror("Could not open device file");
+    exit(-1);
+  }
+  device_size = lseek64(device, 0, SEEK_END);
+
+  // O_DIRECT only writes whole pages, a partial last page goes through here
+  if (device_tail != -1)
+    close(device_tail);
+  device_tail = -1;
+  if (direct_io && device_size % CACHE_PAGE_SIZE != 0 && (device_tail = open(diskname, flags)) == -1) {
+    perror("Could not open device file");
+    exit(-1);
+  }
+  if (overlay_path != NULL)
+    overlay_open(device_size);
+
+  cache_capacity = (int) ((int64_t) cache_mb * 1024 * 1024 / CACHE_PAGE_SIZE);
+  if (cache_capacity < CACHE_MISS_RUN)
+    cache_capacity = CACHE_MISS_RUN;
+  cache_data = (unsigned char*) alloc_aligned((size_t) cache_capacity * CACHE_PAGE_SIZE);
+  cache_bounce = (unsigned char*) alloc_aligned(CACHE_MISS_RUN * CACHE_PAGE_SIZE);
+  cache_pages = (struct cache_page*) malloc(sizeof(struct cache_page) * cache_capacity);
+  for (i = 0; i < cache_capacity; i++) {
+    cache_pages[i].page = -1;
+    cache_pages[i].referenced = 0;
+  }
+  for (cache_hash_mask = 1; cache_hash_mask < 2 * cache_capacity; cache_hash_mask <<= 1)
+    ;
+  cache_hash = (int*) malloc(sizeof(int) * cache_hash_mask);
+  memset(cache_hash, -1, sizeof(int) * cache_hash_mask);
+  cache_hash_mask--;
+}
+
+static int cache_lookup(int64_t page) {
+  int i = cache_hash[cache_bucket(page)];
+  for (; i != -1; i = cache_pages[i].next) {
+    if (cache_pages[i].page == page) {
+      cache_pages[i].referenced = 1;
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Detach a slot from its hash chain and mark it free. */
+static void cache_unlink(int slot) {
+  int* link = &cache_hash[cache_bucket(cache_pages[slot].page)];
+  while (*link != slot)
+    link = &cache_pages[*link].next;
+  *link = cache_pages[slot].next;
+  cache_pages[slot].page = -1;
+}
+
+/* Pick a slot with the clock hand and detach it from its hash chain. */
+static int cache_evict(void) {
+  while (cache_pages[cache_hand].page != -1 && cache_pages[cache_hand].referenced) {
+    cache_pages[cache_hand].referenced = 0;
+    cache_hand = (cache_hand + 1) % cache_capacity;
+  }
+
+  int slot = cache_hand;
+  cache_hand = (cache_hand + 1) % cache_capacity;
+
+  if (cache_pages[slot].page != -1)
+    cache_unlink(slot);
+  return slot;
+}
+
+static int cache_insert(int64_t page, const unsigned char* data) {
+  int slot = cache_evict();
+  int b = cache_bucket(page);
+  cache_pages[slot].page = page;
+  cache_pages[slot].referenced = 1;
+  cache_pages[slot].next = cache_hash[b];
+  cache_hash[b] = slot;
+  memcpy(cache_data + (size_t) slot * CACHE_PAGE_SIZE, data, CACHE_PAGE_SIZE);
+  return slot;
+}
+
+/*
+ * Read count pages starting at page into buf with one pread.  The part
+ * past the end of the device reads as zeros.
+ */
+static void cache_read_run(int64_t page, int count, unsigned char* buf) {
+  ssize_t ret;
+  int64_t offset = page * CACHE_PAGE_SIZE;
+  ssize_t bytes_to_read = (ssize_t) count * CACHE_PAGE_SIZE;
+
+  if (offset + bytes_to_read > device_size)
+    bytes_to_read = device_size > offset ? device_size - offset : 0;
+
+  ret = pread(device, buf, bytes_to_read, offset);
+  if (ret < 0 || ret < bytes_to_read) {
+    fprintf(stderr, "Read at position %"PRId64" length %zd failed: "
+            "returned %zd\n", offset, bytes_to_read, ret);
+    exit(-1);
+  }
+  memset(buf + ret, 0, (size_t) count * CACHE_PAGE_SIZE - ret);
+}
+
+/*
+ * Put the pages cache_read_run read into the cache, taking the overlay's
+ * copy of the ones it has.  Pages an asynchronous read brought in
+ * meanwhile are kept.
+ */
+static void cache_store_run(int64_t page, int count, unsigned char* buf) {
+  int i = 0;
+  for (; i < count; i++) {
+    if (cache_lookup(page + i) != -1)
+      continue;
+    if (overlay_has_page(page + i))
+      overlay_read_page(page + i, buf + (size_t) i * CACHE_PAGE_SIZE);
+    cache_insert(page + i, buf + (size_t) i * CACHE_PAGE_SIZE);
+    cache_misses++;
+  }
+}
+
+/* Read count pages starting at page into the cache. */
+static void cache_fill(int64_t page, int count) {
+  cache_read_run(page, count, cache_bounce);
+  cache_store_run(page, count, cache_bounce);
+}
+
+/* device_read_sectors: read a specified number of sectors into a buffer.
+ *
+ * inputs:
+ *   int64 start_sector: the starting sector number to read.
+ *                       sector numbering starts with 0.
+ *   int numsectors: the number of sectors to read.  must be >= 1.
+ *   int device [GLOBAL]: the disk from which to read.
+ *
+ * outputs:
+ *   void *into: the requested number of sectors are copied into here.
+ *
+ * modifies:
+ *   void *into
+ */
+static void device_read_sectors (int64_t start_sector, unsigned int num_sectors, void *into)
+{
+    int64_t sector_offset = start_sector * SECTOR_SIZE_BYTES;
+    int64_t end = sector_offset + (int64_t) SECTOR_SIZE_BYTES * num_sectors;
+    unsigned char *out = (unsigned char *) into;
+
+    if (start_sector < 0 || end > device_size) {
+        fprintf(stderr, "Read sector %"PRId64" length %d failed: "
+                "past the end of the device\n", start_sector, num_sectors);
+        exit(-1);
+    }
+
+    while (sector_offset < end) {
+        int64_t page = sector_offset / CACHE_PAGE_SIZE;
+        int slot = cache_lookup(page);
+
+        if (slot == -1) {
+            // gather the run of missing pages this request still needs
+            int64_t last = (end - 1) / CACHE_PAGE_SIZE;
+            int run = 1;
+            while (run < CACHE_MISS_RUN && page + run <= last && cache_lookup(page + run) == -1)
+                run++;
+            cache_fill(page, run);
+            slot = cache_lookup(page);
+        } else {
+            cache_hits++;
+        }
+
+        int64_t in_page = sector_offset - page * CACHE_PAGE_SIZE;
+        int64_t len = CACHE_PAGE_SIZE - in_page;
+        if (len > end - sector_offset)
+            len = end - sector_offset;
+        memcpy(out, cache_data + (size_t) slot * CACHE_PAGE_SIZE + in_page, len);
+        out += len;
+        sector_offset += len;
+    }
+}
+
+/* device_write_sectors: write a buffer into a specified number of sectors.
+ *
+ * inputs:
+ *   int64 start_sector: the starting sector number to write.
+ *                  sector numbering starts with 0.
+ *   int numsectors: the number of sectors to write.  must be >= 1.
+ *   void *from: the requested number of sectors are copied from here.
+ *
+ * outputs:
+ *   int device [GLOBAL]: the disk into which to write.
+ *
+ * modifies:
+ *   int device [GLOBAL]
+ */
+static void device_write_sectors (int64_t start_sector, unsigned int num_sectors, void *from)
+{
+    ssize_t ret;
+    int64_t sector_offset = start_sector * SECTOR_SIZE_BYTES;
+    int64_t end = sector_offset + (int64_t) SECTOR_SIZE_BYTES * num_sectors;
+    const unsigned char *in = (const unsigned char *) from;
+    ssize_t bytes_to_write = SECTOR_SIZE_BYTES * num_sectors;
+
+    if (!direct_io && overlay_fd == -1) {
+        if ((ret = pwrite(device, from, bytes_to_write, sector_offset)) != bytes_to_write) {
+            fprintf(stderr, "Write sector %"PRId64" length %d failed: "
+                    "returned %zd\n", start_sector, num_sectors, ret);
+            exit(-1);
+        }
+    }
+
+    // Keep the cache coherent; direct mode and the overlay write back whole
+    // cached pages
+    while (sector_offset < end) {
+        int64_t page = sector_offset / CACHE_PAGE_SIZE;
+        int64_t in_page = sector_offset - page * CACHE_PAGE_SIZE;
+        int64_t len = CACHE_PAGE_SIZE - in_page;
+        if (len > end - sector_offset)
+            len = end - sector_offset;
+
+        int slot = cache_lookup(page);
+        if (slot == -1 && (direct_io || overlay_fd != -1)) {
+            cache_fill(page, 1);
+            slot = cache_lookup(page);
+        }
+        if (slot != -1) {
+            unsigned char *data = cache_data + (size_t) slot * CACHE_PAGE_SIZE;
+            memcpy(data + in_page, in, len);
+
+            if (overlay_fd != -1) {
+                overlay_write_page(page, data);
+            } else if (direct_io) {
+                int64_t page_offset = page * CACHE_PAGE_SIZE;
+                ssize_t page_len = CACHE_PAGE_SIZE;
+                int fd = device;
+                if (page_offset + page_len > device_size) {
+                    page_len = device_size - page_offset;
+                    fd = device_tail;
+                }
+                if ((ret = pwrite(fd, data, page_len, page_offset)) != page_len) {
+                    fprintf(stderr, "Write at position %"PRId64" failed: "
+                            "returned %zd\n", page_offset, ret);
+                    exit(-1);
+                }
+            }
+        }
+        in += len;
+        sector_offset += len;
+    }
+}
+
+/* Make everything written so far durable. */
+static void device_sync(void) {
+  fsync(overlay_fd != -1 ? overlay_fd : device);
+  if (overlay_fd == -1 && device_tail != -1)
+    fsync(device_tail);
+}
+
+/*
+ * Merge an overlay into the opened image.
+ */
+void overlay_commit(const char* path) {
+  struct overlay_header hdr;
+  unsigned char* bitmap;
+  unsigned char* page_buf = (unsigned char*) alloc_aligned(CACHE_PAGE_SIZE);
+  int fd;
+  int64_t page, pages = 0;
+
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    perror("Could not open overlay file");
+    exit(-1);
+  }
+  if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != OVERLAY_MAGIC
+      || hdr.version != OVERLAY_VERSION || hdr.page_size != CACHE_PAGE_SIZE) {
+    fprintf(stderr, "%s is not an overlay file\n", path);
+    exit(-1);
+  }
+  if (hdr.base_size != (__u64) device_size) {
+    fprintf(stderr, "%s is an overlay of a different image\n", path);
+    exit(-1);
+  }
+
+  bitmap = (unsigned char*) malloc(hdr.bitmap_bytes);
+  if (pread(fd, bitmap, hdr.bitmap_bytes, hdr.bitmap_offset) != (ssize_t) hdr.bitmap_bytes) {
+    perror("Could not read overlay bitmap");
+    exit(-1);
+  }
+
+  for (page = 0; page * CACHE_PAGE_SIZE < device_size; page++) {
+    if (!(bitmap[page / 8] & (1 << (page % 8))))
+      continue;
+
+    if (pread(fd, page_buf, CACHE_PAGE_SIZE, hdr.data_offset + page * CACHE_PAGE_SIZE)
+        != CACHE_PAGE_SIZE) {
+      perror("Could not read overlay file");
+      exit(-1);
+    }
+    int64_t bytes = device_size - page * CACHE_PAGE_SIZE;
+    if (bytes > CACHE_PAGE_SIZE)
+      bytes = CACHE_PAGE_SIZE;
+    device_write_sectors(page * CACHE_PAGE_SECTORS, bytes / SECTOR_SIZE_BYTES, page_buf);
+    pages++;
+  }
+  device_sync();
+
+  printf("Committed %"PRId64" pages from %s\n", pages, path);
+  free(bitmap);
+  free(page_buf);
+  close(fd);
+}
+
+/*
+ * Stage further writes in another overlay of the same image.  Only the
+ * cached pages the old overlay held differ from the image, the rest of the
+ * cache stays valid.
+ */
+void overlay_switch(const char* path) {
+  int i;
+
+  txn_flush();
+  gdt_forget(0, -1);
+  for (i = 0; i < cache_capacity; i++) {
+    if (cache_pages[i].page != -1 && overlay_has_page(cache_pages[i].page))
+      cache_unlink(i);
+  }
+  close(overlay_fd);
+  free(overlay_bitmap);
+  overlay_path = (char*) path;
+  overlay_open(device_size);
+}
+
+
+/*
+ * Access hints
+ *
+ * The passes tell the kernel how they are about to use the partition: the
+ * tree walks are random, the inode loops and the bitmap sweep sequential.
+ * Regions a pass will visit next (the next group's inode table or bitmap)
+ * are read ahead explicitly with io_willneed.  In direct mode there is no
+ * page cache to advise, so io_willneed fills the block cache instead and
+ * the other hints do nothing.
+ */
+
+#define IO_PREFETCH_MAX_PAGES 1024        /* direct mode readahead window */
+
+static void io_advise(int64_t start_sector, int64_t num_sectors, int advice) {
+  if(direct_io || num_sectors <= 0)
+    return;
+  posix_fadvise(device, start_sector * SECTOR_SIZE_BYTES, num_sectors * SECTOR_SIZE_BYTES, advice);
+}
+
+/* Advise the access pattern for the whole partition. */
+void io_hint(int parIndex, int advice) {
+  io_advise(part_start(parIndex), part_sectors(parIndex), advice);
+}
+
+/* Start reading a region the pass is about to visit. */
+void io_willneed(int64_t start_sector, int64_t num_sectors) {
+  if(!direct_io) {
+    io_advise(start_sector, num_sectors, POSIX_FADV_WILLNEED);
+    return;
+  }
+
+  int64_t page = start_sector * SECTOR_SIZE_BYTES / CACHE_PAGE_SIZE;
+  int64_t last = ((start_sector + num_sectors) * SECTOR_SIZE_BYTES - 1) / CACHE_PAGE_SIZE;
+  int64_t limit = page + IO_PREFETCH_MAX_PAGES;
+  if(limit > page + cache_capacity / 4)
+    limit = page + cache_capacity / 4;
+  if(last >= limit)
+    last = limit - 1;
+  if(last * CACHE_PAGE_SIZE >= device_size)
+    last = (device_size - 1) / CACHE_PAGE_SIZE;
+
+  pthread_mutex_lock(&io_lock);
+  while(page <= last) {
+    if(cache_lookup(page) != -1) {
+      page++;
+      continue;
+    }
+    int run = 1;
+    while(run < CACHE_MISS_RUN && page + run <= last && cache_lookup(page + run) == -1)
+      run++;
+    cache_fill(page, run);
+    page += run;
+  }
+  pthread_mutex_unlock(&io_lock);
+}
+
+/* The pass is done with a region for good. */
+void io_dontneed(int64_t start_sector, int64_t num_sectors) {
+  io_advise(start_sector, num_sectors, POSIX_FADV_DONTNEED);
+}
+
+int64_t device_bytes(void) {
+  return device_size;
+}
+
+/*
+ * Sequential read of the image for whole-device scans.  It goes around
+ * the block cache and the overlay, so a pass over a multi-TB device evicts
+ * nothing.  The next len bytes are read ahead, and the ones just returned
+ * are dropped from the page cache.  buf must be CACHE_PAGE_SIZE aligned
+ * and len a multiple of it.  Returns the bytes read, which is fewer than
+ * len only at the end of the device.
+ */
+size_t device_stream(int64_t offset, void* buf, size_t len) {
+  size_t done = 0;
+
+  if (offset >= device_size)
+    return 0;
+  while (done < len) {
+    ssize_t ret = pread(device, (unsigned char*) buf + done, len - done, offset + done);
+    if (ret < 0) {
+      perror("Could not read device file");
+      exit(-1);
+    }
+    if (ret == 0)
+      break;
+    done += ret;
+    // O_DIRECT stops at the last full page
+    if (offset + (int64_t) done >= device_size || done % CACHE_PAGE_SIZE)
+      break;
+  }
+  if (offset + (int64_t) done > device_size)
+    done = device_size - offset;
+
+  io_advise((offset + len) / SECTOR_SIZE_BYTES, len / SECTOR_SIZE_BYTES, POSIX_FADV_WILLNEED);
+  io_advise(offset / SECTOR_SIZE_BYTES, len / SECTOR_SIZE_BYTES, POSIX_FADV_DONTNEED);
+  return done;
+}
+
+
+/*
+ * Repair transactions
+ *
+ * write_sectors does not touch the device.  Modified sectors are kept in a
+ * dirty table (and served back by read_sectors, so the passes see their own
+ * repairs) until txn_flush, which runs at the end of every pass.  A flush
+ * writes the dirty sectors sorted by sector number, coalesced into runs, and
+ * syncs the device once.
+ *
+ * With --undo-file FILE the original contents of every sector are appended
+ * to FILE (and synced) before the sector is overwritten for the first time.
+ * A --resume run appends to the file of the run it continues.  --undo FILE
+ * writes them back.
+ *
+ * Undo file layout: struct undo_header, then records of
+ *   struct undo_record, count * SECTOR_SIZE_BYTES bytes of original data
+ */
+
+#define UNDO_MAGIC            0x4f444e55  /* "UNDO" */
+#define UNDO_VERSION          1
+
+struct undo_header {
+  __u32 magic;
+  __u32 version;
+  __u32 sector_size;
+  __u32 reserved;
+};
+
+struct undo_record {
+  __u64 sector;           // first device sector of the run
+  __u32 count;            // sectors in the run
+  __u32 checksum;         // over the original data, detects a torn tail
+};
+
+struct dirty_sector {
+  int64_t       sector;
+  int           next;     // next entry in the same hash chain
+  unsigned char data[SECTOR_SIZE_BYTES];
+};
+
+#define TXN_HASH_SIZE         4096
+
+static struct dirty_sector* dirty = NULL;
+
+static int    dirty_count = 0;
+
+static int    dirty_capacity = 0;
+
+static int    dirty_hash[TXN_HASH_SIZE];
+
+long   txn_write_count = 0;  // sectors queued so far
+
+static int    undo_fd = -1;
+
+/* sectors already saved to the undo file, same chaining as the dirty table */
+static int64_t* undo_logged = NULL;
+
+static int*   undo_logged_next = NULL;
+
+static int    undo_logged_count = 0;
+
+static int    undo_logged_capacity = 0;
+
+static int    undo_logged_hash[TXN_HASH_SIZE];
+
+static int txn_hash(int64_t sector) {
+  return (int) ((sector * 0x9E3779B97F4A7C15ULL) >> 52) & (TXN_HASH_SIZE - 1);
+}
+
+void txn_init(void) {
+  memset(dirty_hash, -1, sizeof(dirty_hash));
+  memset(undo_logged_hash, -1, sizeof(undo_logged_hash));
+}
+
+static struct dirty_sector* txn_lookup(int64_t sector) {
+  int i = dirty_hash[txn_hash(sector)];
+  for(; i != -1; i = dirty[i].next) {
+    if(dirty[i].sector == sector)
+      return &dirty[i];
+  }
+  return NULL;
+}
+
+static void txn_put(int64_t sector, const unsigned char* data) {
+  struct dirty_sector* d = txn_lookup(sector);
+
+  if(d == NULL) {
+    if(dirty_count == dirty_capacity) {
+      dirty_capacity = dirty_capacity ? dirty_capacity * 2 : 64;
+      dirty = (struct dirty_sector*) realloc(dirty, sizeof(struct dirty_sector) * dirty_capacity);
+      if(dirty == NULL) {
+        perror("Could not grow the dirty sector table");
+        exit(-1);
+      }
+    }
+    int h = txn_hash(sector);
+    d = &dirty[dirty_count];
+    d->sector = sector;
+    d->next = dirty_hash[h];
+    dirty_hash[h] = dirty_count++;
+  }
+  memcpy(d->data, data, SECTOR_SIZE_BYTES);
+}
+
+static int undo_is_logged(int64_t sector) {
+  int i = undo_logged_hash[txn_hash(sector)];
+  for(; i != -1; i = undo_logged_next[i]) {
+    if(undo_logged[i] == sector)
+      return 1;
+  }
+  return 0;
+}
+
+static void undo_set_logged(int64_t sector) {
+  if(undo_logged_count == undo_logged_capacity) {
+    undo_logged_capacity = undo_logged_capacity ? undo_logged_capacity * 2 : 64;
+    undo_logged = (int64_t*) realloc(undo_logged, sizeof(int64_t) * undo_logged_capacity);
+    undo_logged_next = (int*) realloc(undo_logged_next, sizeof(int) * undo_logged_capacity);
+    if(undo_logged == NULL || undo_logged_next == NULL) {
+      perror("Could not grow the undo index");
+      exit(-1);
+    }
+  }
+  int h = txn_hash(sector);
+  undo_logged[undo_logged_count] = sector;
+  undo_logged_next[undo_logged_count] = undo_logged_hash[h];
+  undo_logged_hash[h] = undo_logged_count++;
+}
+
+static __u32 undo_checksum(const unsigned char* data, size_t len) {
+  __u32 sum = 0;
+  size_t i = 0;
+  for(; i < len; i++)
+    sum = sum * 31 + data[i];
+  return sum;
+}
+
+/*
+ * Records of an undo file being appended to: index the sectors they saved,
+ * so they are not saved again with repaired contents, and cut off a torn
+ * record at the tail.
+ */
+static void undo_index(const char* path) {
+  struct undo_record rec;
+  off_t end = sizeof(struct undo_header);
+
+  while(read(undo_fd, &rec, sizeof(rec)) == sizeof(rec)) {
+    size_t len = (size_t) rec.count * SECTOR_SIZE_BYTES;
+    unsigned char* buf = (unsigned char*) malloc(len);
+    if(buf == NULL || read(undo_fd, buf, len) != (ssize_t) len
+       || rec.checksum != undo_checksum(buf, len)) {
+      free(buf);
+      break;
+    }
+    __u32 i = 0;
+    for(; i < rec.count; i++) {
+      if(!undo_is_logged(rec.sector + i))
+        undo_set_logged(rec.sector + i);
+    }
+    end += sizeof(rec) + len;
+    free(buf);
+  }
+  if(ftruncate(undo_fd, end) != 0 || lseek(undo_fd, end, SEEK_SET) != end) {
+    perror(path);
+    exit(-1);
+  }
+}
+
+/*
+ * With append (a resumed run) an existing undo file is kept and added to:
+ * the repairs of the interrupted run stay undoable.  Otherwise, or if there
+ * is no file yet, it is created empty.
+ */
+void undo_open(const char* path, int append) {
+  struct undo_header hdr;
+
+  if(append && (undo_fd = open(path, O_RDWR)) != -1) {
+    if(read(undo_fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != UNDO_MAGIC
+       || hdr.version != UNDO_VERSION || hdr.sector_size != SECTOR_SIZE_BYTES) {
+      fprintf(stderr, "%s is not an undo file\n", path);
+      exit(-1);
+    }
+    undo_index(path);
+    return;
+  }
+  if(append && errno != ENOENT) {
+    perror("Could not open undo file");
+    exit(-1);
+  }
+
+  if ((undo_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+    perror("Could not open undo file");
+    exit(-1);
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = UNDO_MAGIC;
+  hdr.version = UNDO_VERSION;
+  hdr.sector_size = SECTOR_SIZE_BYTES;
+  if(write(undo_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    perror("Could not write undo file");
+    exit(-1);
+  }
+}
+
+/*
+ * Append the current device contents of the sectors in [start, start+count)
+ * that have not been saved yet, one record per run of such sectors.
+ */
+static void undo_save_run(int64_t start, int count) {
+  unsigned char* orig = (unsigned char*) malloc(SECTOR_SIZE_BYTES * count);
+  struct undo_record rec;
+  int i = 0;
+
+  device_read_sectors(start, count, orig);
+
+  while(i < count) {
+    if(undo_is_logged(start + i)) {
+      i++;
+      continue;
+    }
+
+    int j = i;
+    while(j < count && !undo_is_logged(start + j)) {
+      undo_set_logged(start + j);
+      j++;
+    }
+
+    rec.sector = start + i;
+    rec.count = j - i;
+    rec.checksum = undo_checksum(orig + i * SECTOR_SIZE_BYTES, rec.count * SECTOR_SIZE_BYTES);
+    if(write(undo_fd, &rec, sizeof(rec)) != sizeof(rec)
+       || write(undo_fd, orig + i * SECTOR_SIZE_BYTES, rec.count * SECTOR_SIZE_BYTES)
+          != rec.count * SECTOR_SIZE_BYTES) {
+      perror("Could not write undo file");
+      exit(-1);
+    }
+    i = j;
+  }
+  free(orig);
+}
+
+static int dirty_cmp(const void* a, const void* b) {
+  int64_t sa = ((const struct dirty_sector*) a)->sector;
+  int64_t sb = ((const struct dirty_sector*) b)->sector;
+  return sa < sb ? -1 : sa > sb;
+}
+
+/*
+ * Write all the dirty sectors back in sector order, one write per run of
+ * consecutive sectors and one fsync for the whole batch.  With an undo file
+ * the originals are saved and synced first.  Holds io_lock throughout, a
+ * block_pipe reader may be in read_sectors while a checkpoint commits.
+ */
+void txn_flush(void) {
+  pthread_mutex_lock(&io_lock);
+  if(dirty_count == 0) {
+    pthread_mutex_unlock(&io_lock);
+    return;
+  }
+
+  qsort(dirty, dirty_count, sizeof(struct dirty_sector), dirty_cmp);
+
+  unsigned char* run = (unsigned char*) malloc(SECTOR_SIZE_BYTES * dirty_count);
+  int pass = 0;
+  for(; pass < 2; pass++) {
+    if(pass == 0 && undo_fd == -1)
+      continue;
+
+    int i = 0;
+    while(i < dirty_count) {
+      int j = i;
+      while(j + 1 < dirty_count && dirty[j + 1].sector == dirty[j].sector + 1)
+        j++;
+
+      if(pass == 0) {
+        undo_save_run(dirty[i].sector, j - i + 1);
+      } else {
+        int k = i;
+        for(; k <= j; k++)
+          memcpy(run + (k - i) * SECTOR_SIZE_BYTES, dirty[k].data, SECTOR_SIZE_BYTES);
+        device_write_sectors(dirty[i].sector, j - i + 1, run);
+      }
+      i = j + 1;
+    }
+
+    if(pass == 0)
+      fsync(undo_fd);
+    else
+      device_sync();
+  }
+
+  free(run);
+  dirty_count = 0;
+  memset(dirty_hash, -1, sizeof(dirty_hash));
+  pthread_mutex_unlock(&io_lock);
+}
+
+void undo_close(void) {
+  if(undo_fd == -1)
+    return;
+  close(undo_fd);
+  undo_fd = -1;
+}
+
+/*
+ * Restore the opened image from an undo file written by --undo-file.
+ */
+void undo_restore(const char* undo_path) {
+  struct undo_header hdr;
+  struct undo_record rec;
+  int fd;
+  int restored = 0;
+
+  if ((fd = open(undo_path, O_RDONLY)) == -1) {
+    perror("Could not open undo file");
+    exit(-1);
+  }
+  if(read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != UNDO_MAGIC
+     || hdr.version != UNDO_VERSION || hdr.sector_size != SECTOR_SIZE_BYTES) {
+    fprintf(stderr, "%s is not an undo file\n", undo_path);
+    exit(-1);
+  }
+
+  while(read(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+    size_t len = (size_t) rec.count * SECTOR_SIZE_BYTES;
+    unsigned char* buf = (unsigned char*) malloc(len);
+    if(buf == NULL || read(fd, buf, len) != (ssize_t) len
+       || rec.checksum != undo_checksum(buf, len)) {
+      // torn record at the tail, its sectors were never overwritten
+      free(buf);
+      break;
+    }
+    device_write_sectors(rec.sector, rec.count, buf);
+    restored += rec.count;
+    free(buf);
+  }
+  device_sync();
+
+  printf("Restored %d sectors from %s\n", restored, undo_path);
+  close(fd);
+}
+
+
+/* read_sectors: read a specified number of sectors, including the repairs
+ *               that have not been flushed yet.
+ *
+ * inputs/outputs: as device_read_sectors.
+ */
+void read_sectors (int64_t start_sector, unsigned int num_sectors, void *into)
+{
+    pthread_mutex_lock(&io_lock);
+    device_read_sectors(start_sector, num_sectors, into);
+
+    if (dirty_count != 0) {
+        unsigned int i;
+        for (i = 0; i < num_sectors; i++) {
+            struct dirty_sector* d = txn_lookup(start_sector + i);
+            if (d != NULL)
+                memcpy((unsigned char*) into + i * SECTOR_SIZE_BYTES, d->data, SECTOR_SIZE_BYTES);
+        }
+    }
+    pthread_mutex_unlock(&io_lock);
+}
+
+/* write_sectors: queue a buffer to be written into a specified number of
+ *                sectors at the next txn_flush.
+ *
+ * inputs: as device_write_sectors.
+ */
+void write_sectors (int64_t start_sector, unsigned int num_sectors, void *from)
+{
+    unsigned int i;
+    pthread_mutex_lock(&io_lock);
+    gdt_forget(start_sector, num_sectors);
+    for (i = 0; i < num_sectors; i++)
+        txn_put(start_sector + i, (unsigned char*) from + i * SECTOR_SIZE_BYTES);
+    txn_write_count += num_sectors;
+    pthread_mutex_unlock(&io_lock);
+}
+
+/* Hits and misses of the block cache so far. */
+void io_stats(long* hits, long* misses) {
+  pthread_mutex_lock(&io_lock);
+  *hits = cache_hits;
+  *misses = cache_misses;
+  pthread_mutex_unlock(&io_lock);
+}
+
+
+/*
+ * Block pipelines
+ *
+ * A loop that reads a list of extents known in advance, in order (inode
+ * tables, bitmaps), hands the list to a pipeline.  A reader thread reads
+ * it ahead in batches of up to PIPE_BATCH_SECTORS into a ring of
+ * pipe_depth buffers while the loop parses what it read before, so the
+ * two overlap.  pipe_read takes its sectors from the ring when they are
+ * the next ones read ahead and drops the batches it passes over; anything
+ * else is read directly.  Batches are read through read_sectors, so they
+ * see repairs made until then: the loop may only write sectors it has
+ * already read.
+ */
+
+#define PIPE_BATCH_BYTES      (PIPE_BATCH_SECTORS * SECTOR_SIZE_BYTES)
+
+static double pipe_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* pipe_reader(void* arg) {
+  struct block_pipe* p = (struct block_pipe*) arg;
+  int e = 0;
+  int64_t off = 0;
+
+  while(e < p->extents) {
+    if(off >= p->extent[e].sectors) {
+      e++;
+      off = 0;
+      continue;
+    }
+    int64_t n = p->extent[e].sectors - off < PIPE_BATCH_SECTORS ? p->extent[e].sectors - off : PIPE_BATCH_SECTORS;
+
+    pthread_mutex_lock(&p->lock);
+    if(p->tail - p->head == p->depth && !p->stop) {
+      double start = pipe_clock();
+      while(p->tail - p->head == p->depth && !p->stop)
+        pthread_cond_wait(&p->room, &p->lock);
+      p->reader_wait += pipe_clock() - start;
+    }
+    int stop = p->stop;
+    int slot = p->tail % p->depth;
+    pthread_mutex_unlock(&p->lock);
+    if(stop)
+      break;
+
+    // The slot is past the ones pipe_read looks at until tail moves
+    read_sectors(p->extent[e].start + off, n, p->ring + (size_t) slot * PIPE_BATCH_BYTES);
+
+    pthread_mutex_lock(&p->lock);
+    p->batch_start[slot] = p->extent[e].start + off;
+    p->batch_sectors[slot] = n;
+    p->tail++;
+    p->batches++;
+    p->sectors += n;
+    pthread_cond_signal(&p->ready);
+    pthread_mutex_unlock(&p->lock);
+    off += n;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->done = 1;
+  pthread_cond_signal(&p->ready);
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+/*
+ * Start reading the extents ahead with depth batches in flight.  extent
+ * has to stay valid until pipe_close.
+ */
+void pipe_open(struct block_pipe* p, const struct pipe_extent* extent, int extents, int depth) {
+  memset(p, 0, sizeof(*p));
+  p->extent = extent;
+  p->extents = extents;
+  p->depth = depth > 0 ? depth : 1;
+  p->ring = (unsigned char*) alloc_aligned((size_t) p->depth * PIPE_BATCH_BYTES);
+  p->batch_start = (int64_t*) malloc(sizeof(int64_t) * p->depth);
+  p->batch_sectors = (int*) malloc(sizeof(int) * p->depth);
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->ready, NULL);
+  pthread_cond_init(&p->room, NULL);
+  if(pthread_create(&p->reader, NULL, pipe_reader, p) != 0) {
+    printf("Could not start a reader thread\n");
+    exit(-1);
+  }
+}
+
+void pipe_read(struct block_pipe* p, int64_t start_sector, unsigned int num_sectors, void* into) {
+  unsigned char* out = (unsigned char*) into;
+
+  pthread_mutex_lock(&p->lock);
+  while(num_sectors > 0) {
+    if(p->head == p->tail && !p->done) {
+      double start = pipe_clock();
+      while(p->head == p->tail && !p->done)
+        pthread_cond_wait(&p->ready, &p->lock);
+      p->parser_wait += pipe_clock() - start;
+    }
+    if(p->head == p->tail)
+      break;
+
+    int slot = p->head % p->depth;
+    int64_t first = p->batch_start[slot];
+    int64_t end = first + p->batch_sectors[slot];
+    if(end <= start_sector) {
+      p->head++;
+      pthread_cond_signal(&p->room);
+      continue;
+    }
+    if(first > start_sector)
+      break;
+
+    int64_t n = end - start_sector < num_sectors ? end - start_sector : num_sectors;
+    memcpy(out, p->ring + (size_t) slot * PIPE_BATCH_BYTES + (start_sector - first) * SECTOR_SIZE_BYTES,
+           n * SECTOR_SIZE_BYTES);
+    out += n * SECTOR_SIZE_BYTES;
+    start_sector += n;
+    num_sectors -= n;
+    if(start_sector == end) {
+      p->head++;
+      pthread_cond_signal(&p->room);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  if(num_sectors > 0)
+    read_sectors(start_sector, num_sectors, out);
+}
+
+void pipe_close(struct block_pipe* p) {
+  pthread_mutex_lock(&p->lock);
+  p->stop = 1;
+  pthread_cond_signal(&p->room);
+  pthread_mutex_unlock(&p->lock);
+  pthread_join(p->reader, NULL);
+
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->ready);
+  pthread_cond_destroy(&p->room);
+  free(p->ring);
+  free(p->batch_start);
+  free(p->batch_sectors);
+  p->ring = NULL;
+}
+
+
+/*
+ * Asynchronous reads
+ *
+ * A loop with many reads to wait for at once (the --async tree walks)
+ * submits them to an io_queue.  Its reader threads bring the pages of a
+ * request into the block cache, with the pread outside io_lock so several
+ * are in flight, and queue the request as completed for io_wait; the
+ * submitter then takes the data with read_sectors, normally from the
+ * cache.  A request whose pages are cached already is not queued at all.
+ * One thread submits and waits, the readers only fill the cache.
+ */
+
+/* Whether the pages of the sectors are all in the block cache. */
+static int cache_has(int64_t start_sector, unsigned int num_sectors) {
+  int64_t page = start_sector * SECTOR_SIZE_BYTES / CACHE_PAGE_SIZE;
+  int64_t last = ((start_sector + num_sectors) * SECTOR_SIZE_BYTES - 1) / CACHE_PAGE_SIZE;
+  int has = 1;
+
+  pthread_mutex_lock(&io_lock);
+  for(; page <= last && has; page++)
+    has = cache_lookup(page) != -1;
+  pthread_mutex_unlock(&io_lock);
+  return has;
+}
+
+/* Read the missing pages of the sectors into the cache, runs at a time. */
+static void cache_fetch(int64_t start_sector, unsigned int num_sectors, unsigned char* bounce) {
+  int64_t page = start_sector * SECTOR_SIZE_BYTES / CACHE_PAGE_SIZE;
+  int64_t last = ((start_sector + num_sectors) * SECTOR_SIZE_BYTES - 1) / CACHE_PAGE_SIZE;
+
+  if(last * CACHE_PAGE_SIZE >= device_size)
+    last = (device_size - 1) / CACHE_PAGE_SIZE;
+  while(page <= last) {
+    int run = 0;
+    pthread_mutex_lock(&io_lock);
+    while(run < CACHE_MISS_RUN && page + run <= last && cache_lookup(page + run) == -1)
+      run++;
+    pthread_mutex_unlock(&io_lock);
+    if(run == 0) {
+      page++;
+      continue;
+    }
+
+    cache_read_run(page, run, bounce);
+    pthread_mutex_lock(&io_lock);
+    cache_store_run(page, run, bounce);
+    pthread_mutex_unlock(&io_lock);
+    page += run;
+  }
+}
+
+static void* io_queue_reader(void* arg) {
+  struct io_queue* q = (struct io_queue*) arg;
+  unsigned char* bounce = (unsigned char*) alloc_aligned(CACHE_MISS_RUN * CACHE_PAGE_SIZE);
+
+  pthread_mutex_lock(&q->lock);
+  while(1) {
+    while(q->queued == NULL && !q->stop)
+      pthread_cond_wait(&q->submitted, &q->lock);
+    if(q->queued == NULL)
+      break;
+    struct io_request* r = q->queued;
+    q->queued = r->next;
+    pthread_mutex_unlock(&q->lock);
+
+    cache_fetch(r->start, r->sectors, bounce);
+
+    pthread_mutex_lock(&q->lock);
+    r->next = q->done;
+    q->done = r;
+    pthread_cond_signal(&q->completed);
+  }
+  pthread_mutex_unlock(&q->lock);
+  free(bounce);
+  return NULL;
+}
+
+void io_queue_open(struct io_queue* q, int threads) {
+  int t;
+
+  memset(q, 0, sizeof(*q));
+  q->threads = threads < 1 ? 1 : threads > IO_QUEUE_THREADS ? IO_QUEUE_THREADS : threads;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->submitted, NULL);
+  pthread_cond_init(&q->completed, NULL);
+  for(t = 0; t < q->threads; t++) {
+    if(pthread_create(&q->thread[t], NULL, io_queue_reader, q) != 0) {
+      printf("Could not start a reader thread\n");
+      exit(-1);
+    }
+  }
+}
+
+/*
+ * Start reading r->sectors sectors at r->start.  Returns 0 if they are
+ * cached already, then r is not queued; otherwise io_wait returns r once
+ * they have been read.  r has to stay valid until then.
+ */
+int io_submit(struct io_queue* q, struct io_request* r) {
+  if(cache_has(r->start, r->sectors)) {
+    q->cached++;
+    return 0;
+  }
+
+  pthread_mutex_lock(&q->lock);
+  r->next = NULL;
+  if(q->queued == NULL)
+    q->queued = r;
+  else
+    q->queued_last->next = r;
+  q->queued_last = r;
+  q->requests++;
+  if(++q->outstanding > q->most)
+    q->most = q->outstanding;
+  pthread_cond_signal(&q->submitted);
+  pthread_mutex_unlock(&q->lock);
+  return 1;
+}
+
+/* Wait for a submitted request to complete, NULL if none is outstanding. */
+struct io_request* io_wait(struct io_queue* q) {
+  struct io_request* r = NULL;
+
+  pthread_mutex_lock(&q->lock);
+  if(q->outstanding > 0) {
+    while(q->done == NULL)
+      pthread_cond_wait(&q->completed, &q->lock);
+    r = q->done;
+    q->done = r->next;
+    q->outstanding--;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return r;
+}
+
+void io_queue_close(struct io_queue* q) {
+  int t;
+
+  pthread_mutex_lock(&q->lock);
+  q->stop = 1;
+  pthread_cond_broadcast(&q->submitted);
+  pthread_mutex_unlock(&q->lock);
+  for(t = 0; t < q->threads; t++)
+    pthread_join(q->thread[t], NULL);
+
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->submitted);
+  pthread_cond_destroy(&q->completed);
+}
+
+
+/*
+ * Block buffers and pass arena
+ *
+ * Block-sized scratch buffers come from a pool of EXT2_MAX_BLOCK_SIZE
+ * buffers aligned to BLOCK_BUF_ALIGN, so they are usable for direct I/O and
+ * for any block size.  The pool only grows to the deepest recursion seen and
+ * buffers are recycled, so there is no allocation on the hot path.
+ *
+ * The per-pass mark arrays live in one arena sized once per partition for
+ * the largest pass (pass 2 may run pass 1 nested inside it).  Passes take a mark with
+ * arena_mark and give everything back with arena_release.
+ *
+ * The arena, like every other array indexed by block or inode number, is
+ * sparse: address space is reserved without backing and a page only takes
+ * memory once something nonzero is stored in it.  Clearing and releasing
+ * hand the pages back instead of writing zeros, and sparse_copy skips zero
+ * pages, so a mark costs memory for the blocks in use, not for the device.
+ *
+ * With --max-memory MB, reservations of SCRATCH_MIN_BYTES or more that
+ * would take the anonymous ones past half the budget are mapped from an
+ * unlinked scratch file in --scratch-dir instead (TMPDIR or /var/tmp by
+ * default), each at its own offset.  The kernel then writes their pages
+ * back and drops them under memory pressure instead of failing, the page
+ * cache being the chunk cache, and the group loops hand back the part of
+ * a mark they are done with early with sparse_done.  Clearing punches
+ * holes in the file.
+ */
+
+#define BLOCK_BUF_ALIGN       4096
+#define SPARSE_PAGE           4096
+#define SCRATCH_MIN_BYTES     (1 << 20)
+#define SCRATCH_MAX_REGIONS   64
+
+int    max_memory_mb = 0;
+
+char*  scratch_dir = NULL;
+
+static size_t sparse_anonymous = 0;     // bytes reserved without the scratch file
+
+static int    scratch_fd = -1;
+
+static int64_t scratch_end = 0;         // file offset after the last region
+
+static struct {
+  unsigned char* base;                  // NULL if the slot is free
+  size_t  size;
+  int64_t offset;
+} scratch_region[SCRATCH_MAX_REGIONS];
+
+static unsigned char** block_pool = NULL;
+
+static int    block_pool_free = 0;
+
+static int    block_pool_capacity = 0;
+
+static int    block_pool_allocated = 0;
+
+static struct {
+  unsigned char* base;
+  size_t capacity;
+  size_t used;
+} pass_arena;
+
+unsigned char* get_block_buf(void) {
+  pthread_mutex_lock(&io_lock);
+  if(block_pool_free > 0) {
+    unsigned char* buf = block_pool[--block_pool_free];
+    pthread_mutex_unlock(&io_lock);
+    return buf;
+  }
+  block_pool_allocated++;
+  pthread_mutex_unlock(&io_lock);
+
+  void* buf;
+  if(posix_memalign(&buf, BLOCK_BUF_ALIGN, EXT2_MAX_BLOCK_SIZE) != 0) {
+    perror("Could not allocate a block buffer");
+    exit(-1);
+  }
+  return (unsigned char*) buf;
+}
+
+void put_block_buf(unsigned char* buf) {
+  pthread_mutex_lock(&io_lock);
+  if(block_pool_free == block_pool_capacity) {
+    block_pool_capacity = block_pool_capacity ? block_pool_capacity * 2 : 16;
+    block_pool = (unsigned char**) realloc(block_pool, sizeof(unsigned char*) * block_pool_capacity);
+    if(block_pool == NULL) {
+      perror("Could not grow the block buffer pool");
+      exit(-1);
+    }
+  }
+  block_pool[block_pool_free++] = buf;
+  pthread_mutex_unlock(&io_lock);
+}
+
+/* The scratch region holding p, -1 for anonymous memory. */
+static int scratch_find(const void* p) {
+  int r = 0;
+  if(scratch_fd == -1)
+    return -1;
+  for(; r < SCRATCH_MAX_REGIONS; r++) {
+    if(scratch_region[r].base != NULL && (const unsigned char*) p >= scratch_region[r].base
+       && (const unsigned char*) p < scratch_region[r].base + scratch_region[r].size)
+      return r;
+  }
+  return -1;
+}
+
+static void scratch_open(void) {
+  const char* dir = scratch_dir;
+  char path[PATH_MAX];
+
+  if(dir == NULL)
+    dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/var/tmp";
+#ifdef O_TMPFILE
+  scratch_fd = open(dir, O_TMPFILE | O_RDWR, 0600);
+#endif
+  if(scratch_fd == -1) {
+    snprintf(path, sizeof(path), "%s/myfsck-scratch-XXXXXX", dir);
+    scratch_fd = mkstemp(path);
+    if(scratch_fd != -1)
+      unlink(path);
+  }
+  if(scratch_fd == -1) {
+    perror("Could not create a scratch file");
+    exit(-1);
+  }
+}
+
+/* Deallocate len bytes of the scratch file at offset, returns 0 if it cannot. */
+static int scratch_punch(int64_t offset, int64_t len) {
+  return len <= 0 || fallocate(scratch_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0;
+}
+
+/* sparse_alloc in the scratch file. */
+static void* scratch_alloc(size_t size) {
+  int r = 0;
+
+  if(scratch_fd == -1)
+    scratch_open();
+  for(; r < SCRATCH_MAX_REGIONS && scratch_region[r].base != NULL; r++)
+    ;
+  if(r == SCRATCH_MAX_REGIONS) {
+    fprintf(stderr, "Too many scratch regions\n");
+    exit(-1);
+  }
+
+  size = (size + SPARSE_PAGE - 1) & ~(size_t) (SPARSE_PAGE - 1);
+  if(ftruncate(scratch_fd, scratch_end + size) != 0) {
+    perror("Could not grow the scratch file");
+    exit(-1);
+  }
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, scratch_fd, scratch_end);
+  if(p == MAP_FAILED) {
+    perror("Could not map the scratch file");
+    exit(-1);
+  }
+  scratch_region[r].base = (unsigned char*) p;
+  scratch_region[r].size = size;
+  scratch_region[r].offset = scratch_end;
+  scratch_end += size;
+  return p;
+}
+
+/*
+ * Reserve size bytes of zeroed, page aligned memory that is only backed
+ * where it gets written.
+ */
+void* sparse_alloc(size_t size) {
+  if(max_memory_mb > 0 && size >= SCRATCH_MIN_BYTES
+     && sparse_anonymous + size > (size_t) max_memory_mb * 1024 * 1024 / 2)
+    return scratch_alloc(size);
+
+  void* p = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(p == MAP_FAILED) {
+    perror("Could not reserve sparse memory");
+    exit(-1);
+  }
+  sparse_anonymous += size;
+  return p;
+}
+
+void sparse_free(void* p, size_t size) {
+  if(p == NULL)
+    return;
+  int r = scratch_find(p);
+  if(r == -1) {
+    sparse_anonymous -= size;
+    munmap(p, size ? size : 1);
+    return;
+  }
+
+  munmap(p, size);
+  scratch_punch(scratch_region[r].offset, scratch_region[r].size);
+  scratch_region[r].base = NULL;
+  for(r = 0; r < SCRATCH_MAX_REGIONS && scratch_region[r].base == NULL; r++)
+    ;
+  // With no region left the file starts over
+  if(r == SCRATCH_MAX_REGIONS) {
+    scratch_end = 0;
+    if(ftruncate(scratch_fd, 0) != 0)
+      perror("Could not truncate the scratch file");
+  }
+}
+
+/*
+ * Zero size bytes of sparse memory: the partial pages at the ends are
+ * cleared, the whole pages in between are dropped.
+ */
+void sparse_zero(void* p, size_t size) {
+  unsigned char* start = (unsigned char*) p;
+  unsigned char* end = start + size;
+  unsigned char* first = (unsigned char*) (((uintptr_t) start + SPARSE_PAGE - 1) & ~(uintptr_t) (SPARSE_PAGE - 1));
+  unsigned char* last = (unsigned char*) ((uintptr_t) end & ~(uintptr_t) (SPARSE_PAGE - 1));
+
+  if(first >= last) {
+    memset(start, 0, size);
+    return;
+  }
+  memset(start, 0, first - start);
+  int r = scratch_find(p);
+  if(r == -1)
+    madvise(first, last - first, MADV_DONTNEED);
+  else if(!scratch_punch(scratch_region[r].offset + (first - scratch_region[r].base), last - first))
+    memset(first, 0, last - first);
+  memset(last, 0, end - last);
+}
+
+/*
+ * The caller is done with the whole pages in size bytes of sparse memory
+ * for a while.  Pages in the scratch file are written back and leave
+ * memory, they read back from the file when touched again.  Anonymous
+ * memory is left alone.
+ */
+void sparse_done(void* p, size_t size) {
+  unsigned char* start = (unsigned char*) p;
+  unsigned char* first = (unsigned char*) (((uintptr_t) start + SPARSE_PAGE - 1) & ~(uintptr_t) (SPARSE_PAGE - 1));
+  unsigned char* last = (unsigned char*) ((uintptr_t) (start + size) & ~(uintptr_t) (SPARSE_PAGE - 1));
+
+  if(scratch_find(p) == -1 || first >= last)
+    return;
+#ifdef MADV_PAGEOUT
+  madvise(first, last - first, MADV_PAGEOUT);
+#endif
+  // Pages just faulted in may not be reclaimable yet, they leave the
+  // mapping anyway and the page cache writes them back
+  madvise(first, last - first, MADV_DONTNEED);
+}
+
+/* Copy into zeroed sparse memory, leaving the pages that would be zero alone. */
+void sparse_copy(void* dst, const void* src, size_t size) {
+  static const unsigned char zero[SPARSE_PAGE];
+  size_t off = 0;
+  for(; off < size; off += SPARSE_PAGE) {
+    size_t len = size - off < SPARSE_PAGE ? size - off : SPARSE_PAGE;
+    if(memcmp((const unsigned char*) src + off, zero, len))
+      memcpy((unsigned char*) dst + off, (const unsigned char*) src + off, len);
+  }
+}
+
+/*
+ * Make sure the arena can hold size bytes of pass state, reusing the
+ * previous partition's reservation when it is large enough.
+ */
+void arena_prepare(size_t size) {
+  arena_release(0);
+  if(pass_arena.capacity >= size)
+    return;
+
+  sparse_free(pass_arena.base, pass_arena.capacity);
+  pass_arena.base = (unsigned char*) sparse_alloc(size);
+  pass_arena.capacity = size;
+}
+
+void* arena_alloc(size_t size) {
+  size_t offset = (pass_arena.used + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  if(offset + size > pass_arena.capacity) {
+    fprintf(stderr, "Pass arena exhausted: %zu of %zu bytes requested\n",
+            offset + size, pass_arena.capacity);
+    exit(-1);
+  }
+  pass_arena.used = offset + size;
+  return pass_arena.base + offset;
+}
+
+size_t arena_mark(void) {
+  return pass_arena.used;
+}
+
+void arena_release(size_t mark) {
+  if(pass_arena.used > mark)
+    sparse_zero(pass_arena.base + mark, pass_arena.used - mark);
+  pass_arena.used = mark;
+}
+
+void arena_destroy(void) {
+  sparse_free(pass_arena.base, pass_arena.capacity);
+  memset(&pass_arena, 0, sizeof(pass_arena));
+  while(block_pool_free > 0)
+    free(block_pool[--block_pool_free]);
+  free(block_pool);
+  block_pool = NULL;
+  block_pool_capacity = 0;
+}
+
+
+int GetOnePartition (int64_t the_sector, char* buf, int64_t offset) {
+//
+  memcpy(parArray+parArrayCounter, buf+offset, PARTITION_SIZE_BYTES);
+  parExtent[parArrayCounter].start_sect = parArray[parArrayCounter].start_sect;
+  parExtent[parArrayCounter].nr_sects = parArray[parArrayCounter].nr_sects;
+
+
+  if (parArray[parArrayCounter].sys_ind == DOS_EXTENDED_PARTITION) {
+    // If this partition is an extended one but still the primary partition, 
+    // the counter keeps on increment    
+    if(parArrayCounter <= 3) {
+      extend_base = parExtent[parArrayCounter].start_sect;
+      parArrayCounter++;  
+    } else {
+      parExtent[parArrayCounter].start_sect += extend_base;
+      parArray[parArrayCounter].start_sect = parExtent[parArrayCounter].start_sect;
+    }
+    return 1;
+  } else {
+    parExtent[parArrayCounter].start_sect += the_sector;
+    parArray[parArrayCounter].start_sect = parExtent[parArrayCounter].start_sect;
+    if(parArray[parArrayCounter].sys_ind != 0x00 || parArrayCounter <= 3 )
+      parArrayCounter++;
+    return 0;
+  }
+}
+
+
+// Assume each sector only has one partition that could be extended
+void GetAllPartitons (char* diskname) {
+  unsigned char buf[SECTOR_SIZE_BYTES]; // A buffer with 512 bytes
+  int64_t       the_sector = 0;         // Read the first sector to get the four primary partitions  
+  int64_t       offset;
+  int           extendIndex = 0;
+  parArray = (struct partition*)malloc(100 * PARTITION_SIZE_BYTES);
+  device_open(diskname, O_RDWR);
+
+  // printf("Dumping sector %d:\n", the_sector);
+  read_sectors(the_sector, 1, buf);
+
+
+  /*
+   * Get the four primary partitions
+   */  
+  offset = 446;
+  int primary_co = 4;
+  while (primary_co != 0) {
+    int stat = GetOnePartition(the_sector, buf, offset);
+    // printf("!!!!!!!!!%d\n",stat);
+    if(stat) {
+      // printf("extended partition\n");
+      extendIndex = parArrayCounter - 1;
+    }
+    offset += PARTITION_SIZE_BYTES;
+    primary_co --;
+  }
+
+  /*
+   * Get the extended partitions if existed
+   */ 
+  while(extendIndex != 0) {
+    int logical_co = 2;
+    // get the sector to go from extendIndex
+    the_sector = parExtent[extendIndex].start_sect;
+
+    // reset extendIndex to 0
+    extendIndex = 0;
+
+    // read the target sector
+    read_sectors(the_sector, 1, buf);
+
+    // start from 446 offset
+    offset = 446;
+    while(logical_co != 0) {
+      int stat = GetOnePartition(the_sector, buf, offset);
+      if(stat) {
+        // printf("extended partition\n");
+        extendIndex = parArrayCounter;
+      }
+      offset += PARTITION_SIZE_BYTES;
+      logical_co --;
+    }
+  }  
+}
+
+
+/*
+ * Use a byte range of the image as partition 1 instead of discovering the
+ * partitions from the MBR/EBR chain.  With --raw the range is the whole
+ * file, i.e. the image is a bare partition; with --offset/--length it is a
+ * partition inside a disk image, checked in place without extracting it.
+ * A length of 0 means up to the end of the file.
+ */
+void GetRawPartition (char* diskname, int64_t offset, int64_t length) {
+  parArray = (struct partition*)malloc(100 * PARTITION_SIZE_BYTES);
+  memset(parArray, 0, 100 * PARTITION_SIZE_BYTES);
+  device_open(diskname, O_RDWR);
+
+  if(length == 0)
+    length = device_size - offset;
+
+  if(offset < 0 || length <= 0 || offset + length > device_size
+     || offset % SECTOR_SIZE_BYTES || length % SECTOR_SIZE_BYTES) {
+    fprintf(stderr, "Invalid partition range %"PRId64"+%"PRId64": must be sector aligned "
+            "and inside the %"PRId64" byte image\n", offset, length, device_size);
+    exit(-1);
+  }
+
+  // The table entry is 32-bit, only parExtent holds ranges past 2 TB
+  parArray[0].sys_ind = LINUX_EXT2_PARTITION;
+  parArray[0].start_sect = offset / SECTOR_SIZE_BYTES;
+  parArray[0].nr_sects = length / SECTOR_SIZE_BYTES;
+  parExtent[0].start_sect = offset / SECTOR_SIZE_BYTES;
+  parExtent[0].nr_sects = length / SECTOR_SIZE_BYTES;
+  parArrayCounter = 1;
+}
+
+
+/*
+ * First sector and size in sectors of a partition, and the absolute sector
+ * of one of its blocks.  Everything that turns a block number into a disk
+ * address goes through block_sector, in 64 bits.
+ */
+int64_t part_start(int parIndex) {
+  return parExtent[parIndex-1].start_sect;
+}
+
+int64_t part_sectors(int parIndex) {
+  return parExtent[parIndex-1].nr_sects;
+}
+
+int64_t block_sector(int parIndex, __u32 block) {
+  return parExtent[parIndex-1].start_sect + (int64_t) block * BLOCK_SECTOR_RATIO;
+}
+
+
+/*
+ * Copy a partition out of the image into its own file.  A reflink clone is
+ * tried first (free on btrfs/xfs when the partition is block aligned), then
+ * copy_file_range over the data regions only, then plain reads and writes
+ * that skip zero blocks.  Holes stay holes, so the copy is sparse.
+ */
+#define EXPORT_CHUNK          (1 << 20)
+
+/*
+ * Copy the pages staged in the overlay over an exported byte range of the
+ * image, so that the export has the repairs too.
+ */
+static void export_overlay_pages(int out, int64_t offset, int64_t length) {
+  unsigned char* page_buf;
+  int64_t page = offset / CACHE_PAGE_SIZE;
+  int64_t last = (offset + length - 1) / CACHE_PAGE_SIZE;
+
+  if (overlay_fd == -1)
+    return;
+
+  page_buf = (unsigned char*) malloc(CACHE_PAGE_SIZE);
+  for (; page <= last; page++) {
+    if (!overlay_has_page(page))
+      continue;
+    overlay_read_page(page, page_buf);
+
+    // the first and last page may stick out of the partition
+    int64_t from = page * CACHE_PAGE_SIZE;
+    int64_t to = from + CACHE_PAGE_SIZE;
+    if (from < offset)
+      from = offset;
+    if (to > offset + length)
+      to = offset + length;
+    if (pwrite(out, page_buf + (from - page * CACHE_PAGE_SIZE), to - from, from - offset)
+        != to - from) {
+      perror("Could not write export file");
+      exit(-1);
+    }
+  }
+  free(page_buf);
+}
+
+void ExportPartition (int parIndex, const char* path) {
+  int64_t offset = part_start(parIndex) * SECTOR_SIZE_BYTES;
+  int64_t length = part_sectors(parIndex) * SECTOR_SIZE_BYTES;
+  int out;
+
+  if ((out = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+    perror("Could not open export file");
+    exit(-1);
+  }
+
+  struct file_clone_range clone;
+  clone.src_fd = device;
+  clone.src_offset = offset;
+  clone.src_length = length;
+  clone.dest_offset = 0;
+  if (ioctl(out, FICLONERANGE, &clone) == 0) {
+    export_overlay_pages(out, offset, length);
+    fsync(out);
+    close(out);
+    printf("partition: %d, cloned to %s\n", parIndex, path);
+    return;
+  }
+
+  if (ftruncate(out, length) != 0) {
+    perror("Could not size export file");
+    exit(-1);
+  }
+
+  int use_copy_range = 1;
+  unsigned char* buf = NULL;
+  int64_t pos = 0;
+  while (pos < length) {
+    // skip the holes of the source
+    int64_t data = lseek64(device, offset + pos, SEEK_DATA);
+    int64_t hole;
+    if (data < 0 && errno != ENXIO) {
+      // no hole support in the source, copy the rest densely
+      data = offset + pos;
+      hole = offset + length;
+    } else {
+      if (data < 0 || data >= offset + length)
+        break;
+      hole = lseek64(device, data, SEEK_HOLE);
+      if (hole < 0 || hole > offset + length)
+        hole = offset + length;
+    }
+    pos = data - offset;
+
+    while (pos < hole - offset) {
+      size_t len = hole - offset - pos;
+      ssize_t ret;
+
+      if (use_copy_range) {
+        loff_t in_off = offset + pos, out_off = pos;
+        ret = copy_file_range(device, &in_off, out, &out_off, len, 0);
+        if (ret > 0) {
+          pos += ret;
+          continue;
+        }
+        // cross-device or not supported, fall back to copying by hand
+        use_copy_range = 0;
+      }
+
+      if (buf == NULL)
+        buf = (unsigned char*) malloc(EXPORT_CHUNK);
+      if (len > EXPORT_CHUNK)
+        len = EXPORT_CHUNK;
+      if ((ret = pread(device, buf, len, offset + pos)) <= 0) {
+        perror("Could not read partition");
+        exit(-1);
+      }
+
+      // leave all-zero blocks as holes
+      ssize_t done = 0;
+      while (done < ret) {
+        ssize_t n = ret - done < CACHE_PAGE_SIZE ? ret - done : CACHE_PAGE_SIZE;
+        ssize_t k = 0;
+        while (k < n && buf[done + k] == 0)
+          k++;
+        if (k != n && pwrite(out, buf + done, n, pos + done) != n) {
+          perror("Could not write export file");
+          exit(-1);
+        }
+        done += n;
+      }
+      pos += ret;
+    }
+  }
+
+  free(buf);
+  export_overlay_pages(out, offset, length);
+  fsync(out);
+  close(out);
+  printf("partition: %d, copied to %s\n", parIndex, path);
+}
+
+
+struct ext2_super_block get_superblock(int parIndex) {
+ // Find superblock of this partition to get inode_per_group and block_per_group
+  unsigned char buf_superblock[SUPERBLOCK_SIZE];
+
+  // Offset 2 sectors;
+  int64_t superblock_start_sector = part_start(parIndex) + SUPERBLOCK_OFFSET/SECTOR_SIZE_BYTES;
+  read_sectors(superblock_start_sector, 2, buf_superblock);
+
+  struct ext2_super_block* super_block = (struct ext2_super_block*)buf_superblock;
+  // super_block = malloc(sizeof(struct ext2_super_block));
+  // memcpy(super_block, buf_superblock, sizeof(struct ext2_super_block));
+
+  // Set the block size everytime read superblock, as block size varies.
+  // Worker threads read the superblock too, only a new size is stored.
+  if(BLOCKSIZE != 1024 << super_block->s_log_block_size) {
+    BLOCKSIZE = 1024 << (super_block->s_log_block_size);
+
+    // Set the block size and sector size ratio
+    BLOCK_SECTOR_RATIO = BLOCKSIZE / SECTOR_SIZE_BYTES;
+  }
+
+  return *super_block;
+}
+
+int Get_Inode_Counts(int parIndex) {
+  struct ext2_super_block super_block = get_superblock(parIndex);
+
+  return super_block.s_inodes_count;
+}
+
+__u32 Get_Block_Counts(int parIndex) {
+  struct ext2_super_block super_block = get_superblock(parIndex);
+
+  return super_block.s_blocks_count;  
+}
+/*
+ * Get the magic number of a partition
+ */
+void Get_Magicnumber(int parIndex) {
+  
+  struct ext2_super_block super_block = get_superblock(parIndex);
+
+  printf("Magic number of partiton %d: 0x%02x\n", parIndex, super_block.s_magic);
+
+  // printf("inode number: %d\n", super_block->s_inodes_count);
+  // printf("block number: %d\n", super_block->s_blocks_count);
+
+  // printf("first block : %d\n", super_block->s_first_data_block);
+  // printf("inodes per group: %d\n", super_block->s_inodes_per_group);
+  // printf("blocks per group: %d\n", super_block->s_blocks_per_group);
+  // // printf("!!belong to group: 0x%02x\n", super_block->s_block_group_nr);
+
+  // // log1024 - 10 = 0
+  // printf("block size : %d\n", super_block->s_log_block_size);
+
+  
+}
+
+
+/*
+ * Group layout
+ *
+ * Every group starts with a copy of the superblock, the descriptor table
+ * and the reserved descriptor blocks kept for online resizing, unless
+ * sparse_super is set: then only groups 0 and 1 and the powers of 3, 5
+ * and 7 do.  These take the block size from the superblock given, not
+ * from BLOCKSIZE.
+ */
+static int is_power_of(__u32 n, __u32 base) {
+  while(n > 1 && n % base == 0)
+    n /= base;
+  return n == 1;
+}
+
+/* Groups in the file system, from the block count. */
+__u32 group_count(const struct ext2_super_block* super) {
+  if(super->s_blocks_per_group == 0 || super->s_blocks_count <= super->s_first_data_block)
+    return 0;
+  return (super->s_blocks_count - super->s_first_data_block + super->s_blocks_per_group - 1)
+         / super->s_blocks_per_group;
+}
+
+int group_has_super(const struct ext2_super_block* super, __u32 group) {
+  if(group <= 1 || !(super->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+    return 1;
+  return is_power_of(group, 3) || is_power_of(group, 5) || is_power_of(group, 7);
+}
+
+/* Blocks of one copy of the descriptor table. */
+__u32 group_gdt_blocks(const struct ext2_super_block* super) {
+  __u32 block_size = 1024 << super->s_log_block_size;
+  return ((int64_t) group_count(super) * BLOCK_GROUP_DESC + block_size - 1) / block_size;
+}
+
+/* Superblock and descriptor blocks at the start of group, 0 if it has no copy. */
+__u32 group_meta_blocks(const struct ext2_super_block* super, __u32 group) {
+  if(!group_has_super(super, group))
+    return 0;
+  __u32 reserved = super->s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INO ? SB_RESERVED_GDT_BLOCKS(super) : 0;
+  return 1 + group_gdt_blocks(super) + reserved;
+}
+
+__u32 group_first_block(const struct ext2_super_block* super, __u32 group) {
+  return super->s_first_data_block + group * super->s_blocks_per_group;
+}
+
+/*
+ * The group descriptor table of a partition, all of its blocks, loaded
+ * with one read the first time it is asked for and kept until another
+ * partition is asked for or the table is written.  The descriptors are
+ * stored back to back on disk, so the table is used as read.
+ *
+ * The number of groups follows from the block count; it has to agree with
+ * the one that follows from the inode count, or the smaller one is used.
+ * Stores the number of groups in *groups unless groups is NULL.
+ */
+const struct ext2_group_desc* Get_Group_Desc_Table(int parIndex, __u32* groups) {
+  if(gdt_cache.parIndex != parIndex) {
+    struct ext2_super_block super = get_superblock(parIndex);
+    __u32 by_blocks = group_count(&super);
+    __u32 by_inodes = super.s_inodes_per_group == 0 ? 0 : super.s_inodes_count / super.s_inodes_per_group;
+
+    if(by_blocks != by_inodes) {
+      printf("partition: %d, group count is %u by blocks but %u by inodes\n", parIndex, by_blocks, by_inodes);
+      if(by_inodes < by_blocks)
+        by_blocks = by_inodes;
+    }
+
+    // The table starts in the block after the superblock
+    __u32 table_blocks = ((int64_t) by_blocks * BLOCK_GROUP_DESC + BLOCKSIZE - 1) / BLOCKSIZE;
+
+    free(gdt_cache.desc);
+    gdt_cache.desc = (struct ext2_group_desc*) malloc((size_t) (table_blocks ? table_blocks : 1) * BLOCKSIZE);
+    if(gdt_cache.desc == NULL) {
+      perror("Could not allocate the group descriptor table");
+      exit(-1);
+    }
+    gdt_cache.groups = by_blocks;
+    gdt_cache.start_sector = block_sector(parIndex, super.s_first_data_block + 1);
+    gdt_cache.num_sectors = (int64_t) table_blocks * BLOCK_SECTOR_RATIO;
+    if(table_blocks > 0)
+      read_sectors(gdt_cache.start_sector, gdt_cache.num_sectors, gdt_cache.desc);
+    gdt_cache.parIndex = parIndex;
+
+    __u32 g = 0;
+    for(; g < gdt_cache.groups; g++) {
+      struct ext2_group_desc* desc = &gdt_cache.desc[g];
+      if(desc->bg_block_bitmap >= super.s_blocks_count || desc->bg_inode_bitmap >= super.s_blocks_count
+         || desc->bg_inode_table >= super.s_blocks_count)
+        printf("partition: %d, group: %u, group descriptor points past the end\n", parIndex, g);
+    }
+  }
+
+  if(groups != NULL)
+    *groups = gdt_cache.groups;
+  return gdt_cache.desc;
+}
+
+/*
+ * The group descriptor of group, zeroed when there is no such group.
+ */
+struct ext2_group_desc Get_Group_Desc(int group, int parIndex) {
+  __u32 groups;
+  const struct ext2_group_desc* table = Get_Group_Desc_Table(parIndex, &groups);
+  struct ext2_group_desc group_desc;
+
+  if(group < 0 || (__u32) group >= groups) {
+    memset(&group_desc, 0, sizeof(group_desc));
+    return group_desc;
+  }
+  return table[group];
+}
+
+
+struct inode_location Get_Inode_Location(int inodeIndex, int parIndex) {
+
+  struct ext2_super_block super_block = get_superblock(parIndex);
+  
+  int inodes_per_group = super_block.s_inodes_per_group;
+
+  // Get which block group this inode belongs to
+  int block_group = (inodeIndex - 1) / inodes_per_group;
+  int local_inode_index = (inodeIndex - 1) % inodes_per_group;
+
+  struct ext2_group_desc group_desc = Get_Group_Desc(block_group, parIndex);
+
+  // Find the start sector of inode table
+  int64_t inodetable_start_sector = block_sector(parIndex, group_desc.bg_inode_table);
+
+  struct inode_location location;
+
+  // Find the sector of the target inode based on inode table start sector
+  location.sect_num = inodetable_start_sector + local_inode_index*INODE_SIZE / SECTOR_SIZE_BYTES;
+
+  // Calculate the offset within the sector
+  location.offset_within_sect = local_inode_index*INODE_SIZE % SECTOR_SIZE_BYTES;
+
+  return location;
+}
+
+
+struct ext2_inode Get_Inode(int inodeIndex, int parIndex) {
+
+  struct inode_location location = Get_Inode_Location(inodeIndex, parIndex);
+
+  // Read the whole target sector
+  unsigned char inode_buf[SECTOR_SIZE_BYTES];
+
+  read_sectors(location.sect_num, 1, inode_buf);
+
+  struct ext2_inode* inode = (struct ext2_inode*)(inode_buf + location.offset_within_sect);
+
+  return *inode;
+
+}
+
+
+void Put_Inode(int inodeIndex, int parIndex, struct ext2_inode* inode) {
+
+  struct inode_location location = Get_Inode_Location(inodeIndex, parIndex);
+
+  unsigned char inode_buf[SECTOR_SIZE_BYTES];
+
+  // Other inodes of the sector may be written at the same time
+  pthread_mutex_lock(&io_lock);
+  read_sectors(location.sect_num, 1, inode_buf);
+  memcpy(inode_buf + location.offset_within_sect, inode, sizeof(struct ext2_inode));
+  write_sectors(location.sect_num, 1, inode_buf);
+  pthread_mutex_unlock(&io_lock);
+
+}
+
+
+/*
+ * Read ahead the inode table of a group, the inode loops call this one
+ * group before they get there.
+ */
+void prefetch_inode_table(int parIndex, int group) {
+  struct ext2_super_block super_block = get_superblock(parIndex);
+
+  if(group < 0 || group >= super_block.s_inodes_count / super_block.s_inodes_per_group)
+    return;
+
+  struct ext2_group_desc group_desc = Get_Group_Desc(group, parIndex);
+
+  io_willneed(block_sector(parIndex, group_desc.bg_inode_table),
+              (int64_t) super_block.s_inodes_per_group * INODE_SIZE / SECTOR_SIZE_BYTES);
+}
+
+
+struct ext2_inode Get_Root_Inode(int parIndex) {
+
+    struct ext2_inode root_inode = Get_Inode(ROOT_INODE, parIndex);
+
+    return root_inode;
+
+}
+
+int Get_Inode_Type(__u16 i_mode) {
+  __u16 mask = 0xF000;
+  i_mode = mask & i_mode;
+  if(i_mode == 0xC000)
+    return 6;
+  if(i_mode == 0xA000)
+    return 7;
+  if(i_mode == 0x8000)
+    return 1;
+  if(i_mode == 0x6000)
+    return 4;
+  if(i_mode == 0x4000)
+    return 2;
+  if(i_mode == 0x2000)
+    return 3;
+  if(i_mode == 0x1000)
+    return 5;
+}
+
+
+/*
+ * Directory block streams
+ *
+ * A directory is read one block at a time, in logical order through the
+ * direct, indirect, doubly and triply indirect pointers, so a directory of
+ * any size is scanned with one data block and at most three pointer blocks
+ * in memory.  Whenever the stream enters a new window of
+ * DIR_READAHEAD_BLOCKS pointers (direct or in a pointer block), the blocks
+ * they refer to are read ahead, coalesced into runs: data blocks at the
+ * last level, the next pointer blocks above it.  The stream ends at the
+ * first null pointer, as directories have no holes.
+ */
+
+#define DIR_READAHEAD_BLOCKS  64
+
+static void dir_readahead(int parIndex, const __u32* ptrs, int count) {
+  int i = 0;
+
+  // a lone block is read right away anyway
+  if(count < 2 || ptrs[1] == 0)
+    return;
+
+  while(i < count && ptrs[i] != 0) {
+    int run = 1;
+    while(i + run < count && ptrs[i + run] == ptrs[i] + run)
+      run++;
+    io_willneed(block_sector(parIndex, ptrs[i]),
+                (int64_t) run * BLOCK_SECTOR_RATIO);
+    i += run;
+  }
+}
+
+/* Pointer block at depth level of the current lookup, loaded on demand. */
+static __u32* dir_stream_load(struct dir_stream* stream, int level, __u32 block) {
+  if(stream->ptr[level] == NULL)
+    stream->ptr[level] = get_block_buf();
+  if(stream->ptr_block[level] != block) {
+    read_sectors(block_sector(stream->parIndex, block),
+                 BLOCK_SECTOR_RATIO, stream->ptr[level]);
+    stream->ptr_block[level] = block;
+  }
+  return (__u32*) stream->ptr[level];
+}
+
+/* Physical block of logical directory block index, 0 past the end. */
+static __u32 dir_stream_map(struct dir_stream* stream, uint64_t index) {
+  uint64_t per_block = BLOCKSIZE / sizeof(__u32);
+  uint64_t span = 1;
+  __u32 block;
+  int depth;
+
+  if(index < EXT2_NDIR_BLOCKS) {
+    if(index % DIR_READAHEAD_BLOCKS == 0)
+      dir_readahead(stream->parIndex, stream->i_block + index, EXT2_NDIR_BLOCKS - index);
+    return stream->i_block[index];
+  }
+
+  index -= EXT2_NDIR_BLOCKS;
+  for(depth = 1; depth <= 3; depth++) {
+    span *= per_block;
+    if(index < span)
+      break;
+    index -= span;
+  }
+  if(depth > 3)
+    return 0;
+
+  block = stream->i_block[EXT2_IND_BLOCK + depth - 1];
+  int level = 0;
+  for(; level < depth && block != 0; level++) {
+    span /= per_block;
+    __u32* ptrs = dir_stream_load(stream, level, block);
+    int slot = (int) (index / span % per_block);
+    if(slot % DIR_READAHEAD_BLOCKS == 0 && index % span == 0)
+      dir_readahead(stream->parIndex, ptrs + slot, per_block - slot < DIR_READAHEAD_BLOCKS
+                    ? per_block - slot : DIR_READAHEAD_BLOCKS);
+    block = ptrs[slot];
+  }
+  return block;
+}
+
+void dir_stream_open(struct dir_stream* stream, __u32 i_block[], int parIndex) {
+  memset(stream, 0, sizeof(*stream));
+  memcpy(stream->i_block, i_block, sizeof(stream->i_block));
+  stream->parIndex = parIndex;
+  stream->data = get_block_buf();
+}
+
+/*
+ * Read the next directory block into stream->data.  Returns 0 at the end
+ * of the directory.
+ */
+int dir_stream_next(struct dir_stream* stream) {
+  __u32 block = dir_stream_map(stream, stream->next);
+
+  if(block == 0)
+    return 0;
+
+  read_sectors(block_sector(stream->parIndex, block),
+               BLOCK_SECTOR_RATIO, stream->data);
+  stream->block = block;
+  stream->index = stream->next++;
+  return 1;
+}
+
+/* Write stream->data back to the block it was read from. */
+void dir_stream_write(struct dir_stream* stream) {
+  write_sectors(block_sector(stream->parIndex, stream->block),
+                BLOCK_SECTOR_RATIO, stream->data);
+}
+
+void dir_stream_close(struct dir_stream* stream) {
+  int level = 0;
+  for(; level < 3; level++) {
+    if(stream->ptr[level] != NULL)
+      put_block_buf(stream->ptr[level]);
+  }
+  put_block_buf(stream->data);
+}
+
+/*
+ * Read logical block index of the directory into stream->data, the next
+ * dir_stream_next continues after it.  Returns 0 past the end.
+ */
+int dir_stream_read(struct dir_stream* stream, __u32 index) {
+  stream->next = index;
+  return dir_stream_next(stream);
+}
+
+
+/*
+ * Hashed directories
+ *
+ * A dir_index directory keeps a tree of (hash, block) pairs in the blocks
+ * the linear format sees as empty: block 0 holds '.', a '..' spanning the
+ * rest of the block, a dx_root_info and the root entries, interior nodes
+ * are a single empty entry covering the block followed by their entries.
+ * Entry i sends names hashing to [hash i, hash i+1) to logical block i;
+ * entry 0 has no hash of its own, its slot holds the dx_countlimit.  The
+ * low bit of a hash marks a leaf that continues the previous hash.
+ *
+ * The hashes below follow the on-disk format defined by the kernel.
+ */
+
+#define DX_HASH_DELTA         0x9E3779B9
+
+static void dx_tea_transform(__u32 buf[4], const __u32 in[]) {
+  __u32 sum = 0;
+  __u32 b0 = buf[0], b1 = buf[1];
+  __u32 a = in[0], b = in[1], c = in[2], d = in[3];
+  int n = 16;
+
+  do {
+    sum += DX_HASH_DELTA;
+    b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+    b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+  } while(--n);
+
+  buf[0] += b0;
+  buf[1] += b1;
+}
+
+#define DX_F(x, y, z)         ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z)         (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z)         ((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s) \
+  (a += f(b, c, d) + (x), a = (a << (s)) | (a >> (32 - (s))))
+#define DX_K1                 0
+#define DX_K2                 013240474631UL
+#define DX_K3                 015666365641UL
+
+static void dx_half_md4_transform(__u32 buf[4], const __u32 in[]) {
+  __u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+  DX_ROUND(DX_F, a, b, c, d, in[0] + DX_K1,  3);
+  DX_ROUND(DX_F, d, a, b, c, in[1] + DX_K1,  7);
+  DX_ROUND(DX_F, c, d, a, b, in[2] + DX_K1, 11);
+  DX_ROUND(DX_F, b, c, d, a, in[3] + DX_K1, 19);
+  DX_ROUND(DX_F, a, b, c, d, in[4] + DX_K1,  3);
+  DX_ROUND(DX_F, d, a, b, c, in[5] + DX_K1,  7);
+  DX_ROUND(DX_F, c, d, a, b, in[6] + DX_K1, 11);
+  DX_ROUND(DX_F, b, c, d, a, in[7] + DX_K1, 19);
+
+  DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2,  3);
+  DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2,  5);
+  DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2,  9);
+  DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+  DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2,  3);
+  DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2,  5);
+  DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2,  9);
+  DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+  DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3,  3);
+  DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3,  9);
+  DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+  DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+  DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3,  3);
+  DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3,  9);
+  DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+  DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
+
+static __u32 dx_legacy_hash(const char* name, int len, int unsigned_chars) {
+  __u32 hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+  int i = 0;
+
+  for(; i < len; i++) {
+    int c = unsigned_chars ? (int) (unsigned char) name[i] : (int) (signed char) name[i];
+    hash = hash1 + (hash0 ^ (c * 7152373));
+    if(hash & 0x80000000)
+      hash -= 0x7fffffff;
+    hash1 = hash0;
+    hash0 = hash;
+  }
+  return hash0 << 1;
+}
+
+/* Pack up to num words of the name, padded with its length. */
+static void dx_str2hashbuf(const char* msg, int len, __u32* buf, int num, int unsigned_chars) {
+  __u32 pad, val;
+  int i;
+
+  pad = (__u32) len | ((__u32) len << 8);
+  pad |= pad << 16;
+
+  val = pad;
+  if(len > num * 4)
+    len = num * 4;
+  for(i = 0; i < len; i++) {
+    int c = unsigned_chars ? (int) (unsigned char) msg[i] : (int) (signed char) msg[i];
+    val = c + (val << 8);
+    if((i % 4) == 3) {
+      *buf++ = val;
+      val = pad;
+      num--;
+    }
+  }
+  if(--num >= 0)
+    *buf++ = val;
+  while(--num >= 0)
+    *buf++ = pad;
+}
+
+__u32 ext2_dirhash(const char* name, int len, int version, const __u32* seed) {
+  __u32 buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+  __u32 in[8];
+  __u32 hash = 0;
+  int unsigned_chars = version >= DX_HASH_LEGACY_UNSIGNED;
+
+  if(seed != NULL && (seed[0] | seed[1] | seed[2] | seed[3]))
+    memcpy(buf, seed, sizeof(buf));
+
+  switch(unsigned_chars ? version - DX_HASH_LEGACY_UNSIGNED : version) {
+    case DX_HASH_LEGACY:
+      hash = dx_legacy_hash(name, len, unsigned_chars);
+      break;
+    case DX_HASH_HALF_MD4:
+      for(; len > 0; len -= 32, name += 32) {
+        dx_str2hashbuf(name, len, in, 8, unsigned_chars);
+        dx_half_md4_transform(buf, in);
+      }
+      hash = buf[1];
+      break;
+    case DX_HASH_TEA:
+      for(; len > 0; len -= 16, name += 16) {
+        dx_str2hashbuf(name, len, in, 4, unsigned_chars);
+        dx_tea_transform(buf, in);
+      }
+      hash = buf[0];
+      break;
+  }
+  return hash & ~1;
+}
+
+/*
+ * Hash version a directory root asks for, switched to the unsigned
+ * variant when the file system was created with unsigned char hashing.
+ */
+int dx_hash_version(struct ext2_super_block* super, int root_version) {
+  if(root_version <= DX_HASH_TEA && (SB_FLAGS(super) & EXT2_FLAGS_UNSIGNED_HASH))
+    return root_version + DX_HASH_LEGACY_UNSIGNED;
+  return root_version;
+}
+
+/* Whether a directory is to be used through its index. */
+int dir_is_indexed(struct ext2_inode* dir_inode, int parIndex) {
+  struct ext2_super_block super = get_superblock(parIndex);
+  return (dir_inode->i_flags & EXT2_INDEX_FL) && (super.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX);
+}
+
+/* Inode of the entry called name in one directory block, 0 if none. */
+static int dir_block_find(const unsigned char* block, const char* name, int name_len) {
+  int len = 0;
+  while(len + 8 <= BLOCKSIZE) {
+    const struct ext2_dir_entry_2* dir = (const struct ext2_dir_entry_2*) (block + len);
+    if(dir->rec_len < 8)
+      break;
+    if(dir->inode != 0 && dir->name_len == name_len && memcmp(dir->name, name, name_len) == 0)
+      return dir->inode;
+    len += dir->rec_len;
+  }
+  return 0;
+}
+
+/*
+ * Hash name the way the index whose root block is root does.  Returns 0
+ * without hashing when the root names a hash version we do not know.
+ */
+int dx_root_hash(const unsigned char* root, struct ext2_super_block* super, const char* name, int len,
+                 __u32* hash) {
+  const struct dx_root_info* info = (const struct dx_root_info*) (root + DX_ROOT_INFO_OFFSET);
+
+  if(info->hash_version > DX_HASH_TEA)
+    return 0;
+  *hash = ext2_dirhash(name, len, dx_hash_version(super, info->hash_version), SB_HASH_SEED(super));
+  return 1;
+}
+
+/*
+ * Logical leaf block of an indexed directory that holds hash, found with a
+ * binary search on every level.  *next_hash is set to the hash of the entry
+ * after it on the last level, 0 when there is none.  Returns -1 when the
+ * index is malformed: every count and limit is checked against the room
+ * the block has for entries, as htree_check does.
+ */
+int dx_find_leaf(struct dir_stream* stream, __u32 hash, __u32* next_hash) {
+  unsigned char* node = get_block_buf();
+  struct dx_root_info* info;
+  struct dx_entry* entries;
+  int level = 0, levels, leaf = -1;
+  int entries_offset;
+
+  *next_hash = 0;
+  if(!dir_stream_read(stream, 0))
+    goto out;
+  memcpy(node, stream->data, BLOCKSIZE);
+  info = (struct dx_root_info*) (node + DX_ROOT_INFO_OFFSET);
+  if(info->reserved_zero != 0 || info->info_length != sizeof(struct dx_root_info)
+     || info->hash_version > DX_HASH_TEA || info->indirect_levels >= DX_MAX_LEVELS)
+    goto out;
+  levels = info->indirect_levels;
+  entries_offset = DX_ROOT_INFO_OFFSET + info->info_length;
+  entries = (struct dx_entry*) (node + entries_offset);
+
+  for(;; level++) {
+    struct dx_countlimit* countlimit = (struct dx_countlimit*) entries;
+    int count = countlimit->count;
+    if(countlimit->limit != (BLOCKSIZE - entries_offset) / sizeof(struct dx_entry)
+       || count == 0 || count > countlimit->limit)
+      goto out;
+
+    // the last entry whose hash is not above hash, entry 0 covers from 0
+    int lo = 1, hi = count - 1;
+    while(lo <= hi) {
+      int mid = (lo + hi) / 2;
+      if(entries[mid].hash > hash)
+        hi = mid - 1;
+      else
+        lo = mid + 1;
+    }
+    __u32 block = entries[lo - 1].block & DX_BLOCK_MASK;
+    if(lo < count)
+      *next_hash = entries[lo].hash;
+
+    if(level == levels) {
+      leaf = block;
+      break;
+    }
+    if(!dir_stream_read(stream, block))
+      goto out;
+    memcpy(node, stream->data, BLOCKSIZE);
+    entries_offset = DX_NODE_ENTRIES_OFFSET;
+    entries = (struct dx_entry*) (node + entries_offset);
+  }
+
+out:
+  put_block_buf(node);
+  return leaf;
+}
+
+/*
+ * Find name in a directory, through its index when it is hashed.  Returns
+ * the inode of the entry, 0 if there is none.
+ */
+int dir_lookup(struct ext2_inode* dir_inode, const char* name, int parIndex) {
+  struct ext2_super_block super = get_superblock(parIndex);
+  struct dir_stream stream;
+  int name_len = strlen(name);
+  int found = -1;
+
+  dir_stream_open(&stream, dir_inode->i_block, parIndex);
+
+  __u32 hash;
+  if(dir_is_indexed(dir_inode, parIndex) && dir_stream_read(&stream, 0)
+     && dx_root_hash(stream.data, &super, name, name_len, &hash)) {
+    __u32 next_hash;
+    int leaf = dx_find_leaf(&stream, hash, &next_hash);
+
+    if(leaf != -1 && dir_stream_read(&stream, leaf)) {
+      found = dir_block_find(stream.data, name, name_len);
+      // a hash collision can spill into the following leaf
+      if(found == 0 && (next_hash & 1) && (next_hash & ~1) == hash)
+        found = -1;
+    }
+  }
+
+  if(found == -1) {
+    found = 0;
+    stream.next = 0;
+    while(found == 0 && dir_stream_next(&stream))
+      found = dir_block_find(stream.data, name, name_len);
+  }
+
+  dir_stream_close(&stream);
+  return found;
+}
@@ -0,0 +1,255 @@
+/*
+ * ext2_disk.h
+ *
+ * Disk access shared by myfsck and myinject.  Partitions are numbered from
+ * 1 in the order they were found; all sector numbers are absolute on the
+ * image.  read_sectors, write_sectors, io_willneed, Put_Inode and the
+ * block buffers may be used from several threads, the rest from the main
+ * thread only.  txn_flush is main thread only but may run while worker or
+ * pipeline reader threads are reading.  An io_queue or block_pipe belongs
+ * to the thread that opened it.
+ */
+#ifndef EXT2_DISK_H
+#define EXT2_DISK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/types.h>
+#include "genhd.h"
+#include "ext2_fs.h"
+
+#define SECTOR_SIZE_BYTES     512
+#define PARTITION_SIZE_BYTES  16
+#define PARTITION_SIZE        1024
+#define SUPERBLOCK_OFFSET     1024
+#define SUPERBLOCK_SIZE       1024
+#define ROOT_INODE            2
+#define RESIZE_INODE          7
+#define BLOCK_GROUP_DESC      32
+#define INODE_SIZE            128
+
+#define CACHE_DEFAULT_MB      16
+#define PIPE_DEFAULT_DEPTH    4
+#define PIPE_BATCH_SECTORS    512         /* sectors read by one pipeline batch at most */
+#define IO_QUEUE_THREADS      16          /* reader threads of an io_queue at most */
+#define ARENA_ALIGN           64          /* alignment of arena_alloc() */
+
+#define EXT2_INDEX_FL         EXT2_BTREE_FL        /* hashed (htree) directory */
+
+/* Superblock fields newer than ext2_fs.h, which still has them in s_reserved */
+#define SB_HASH_SEED(sb)      (&(sb)->s_reserved[7])
+#define SB_FLAGS(sb)          ((sb)->s_reserved[36])
+#define SB_RESERVED_GDT_BLOCKS(sb) ((sb)->s_padding1)
+
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
+/* Directory hash versions */
+#define DX_HASH_LEGACY        0
+#define DX_HASH_HALF_MD4      1
+#define DX_HASH_TEA           2
+#define DX_HASH_LEGACY_UNSIGNED 3
+#define DX_HASH_HALF_MD4_UNSIGNED 4
+#define DX_HASH_TEA_UNSIGNED  5
+
+#define DX_ROOT_INFO_OFFSET   24          /* after the '.' and '..' entries */
+#define DX_NODE_ENTRIES_OFFSET 8          /* after the empty entry */
+#define DX_MAX_LEVELS         2
+#define DX_BLOCK_MASK         0x00ffffff
+
+struct dx_root_info {
+  __u32 reserved_zero;
+  __u8  hash_version;
+  __u8  info_length;
+  __u8  indirect_levels;
+  __u8  unused_flags;
+};
+
+struct dx_countlimit {
+  __u16 limit;
+  __u16 count;
+};
+
+struct dx_entry {
+  __u32 hash;
+  __u32 block;
+};
+
+struct inode_location {
+  int64_t      sect_num;
+  unsigned int offset_within_sect;
+};
+
+struct pipe_extent {
+  int64_t start;                // sector
+  int64_t sectors;
+};
+
+struct block_pipe {
+  const struct pipe_extent* extent;
+  int     extents;
+  int     depth;                // batches in the ring
+  unsigned char* ring;
+  int64_t* batch_start;         // per ring slot
+  int*    batch_sectors;
+  long    head;                 // batches taken from the ring
+  long    tail;                 // batches read into it
+  int     done;                 // reader finished
+  int     stop;
+  pthread_t reader;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_cond_t room;
+  long    batches;              // statistics
+  int64_t sectors;
+  double  reader_wait;          // seconds the reader waited for a free slot
+  double  parser_wait;          // seconds pipe_read waited for a batch
+};
+
+struct io_request {
+  int64_t start;                // sector
+  unsigned int sectors;
+  void*   owner;                // the submitter's
+  struct io_request* next;
+};
+
+struct io_queue {
+  int     threads;
+  pthread_t thread[IO_QUEUE_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t submitted;
+  pthread_cond_t completed;
+  struct io_request* queued;    // oldest first
+  struct io_request* queued_last;
+  struct io_request* done;      // completed, not returned by io_wait yet
+  long    outstanding;          // submitted, not returned by io_wait yet
+  int     stop;
+  long    requests;             // statistics
+  long    cached;               // submissions the cache already held
+  long    most;                 // outstanding at most
+};
+
+struct dir_stream {
+  int   parIndex;
+  __u32 i_block[EXT2_N_BLOCKS];
+  __u32 next;                   // logical block read by the next dir_stream_next
+  __u32 index;                  // logical block in data
+  __u32 block;                  // physical block in data
+  unsigned char* data;
+  unsigned char* ptr[3];        // pointer blocks by depth below i_block
+  __u32 ptr_block[3];           // physical block held by ptr[], 0 if none
+};
+
+extern struct partition* parArray;
+
+extern int    parArrayCounter;
+
+extern int    BLOCKSIZE;
+
+extern int    BLOCK_SECTOR_RATIO;
+
+extern int    direct_io;            // --direct
+
+extern int    cache_mb;             // --cache-mb
+
+extern int    pipe_depth;           // --queue-depth
+
+extern int    max_memory_mb;        // --max-memory
+
+extern char*  scratch_dir;          // --scratch-dir
+
+extern char*  overlay_path;         // --overlay
+
+extern long   txn_write_count;      // sectors queued so far
+
+/* device, cache and overlay */
+void device_open(const char* diskname, int flags);
+void overlay_commit(const char* path);
+void overlay_switch(const char* path);
+
+/* access hints */
+void io_hint(int parIndex, int advice);
+void io_willneed(int64_t start_sector, int64_t num_sectors);
+void io_dontneed(int64_t start_sector, int64_t num_sectors);
+int64_t device_bytes(void);
+void io_stats(long* hits, long* misses);
+size_t device_stream(int64_t offset, void* buf, size_t len);
+
+/* repair transactions */
+void txn_init(void);
+void txn_flush(void);
+void undo_open(const char* path, int append);
+void undo_close(void);
+void undo_restore(const char* undo_path);
+void read_sectors (int64_t start_sector, unsigned int num_sectors, void *into);
+void write_sectors (int64_t start_sector, unsigned int num_sectors, void *from);
+
+/* block pipelines */
+void pipe_open(struct block_pipe* p, const struct pipe_extent* extent, int extents, int depth);
+void pipe_read(struct block_pipe* p, int64_t start_sector, unsigned int num_sectors, void* into);
+void pipe_close(struct block_pipe* p);
+
+/* asynchronous reads */
+void io_queue_open(struct io_queue* q, int threads);
+int io_submit(struct io_queue* q, struct io_request* r);
+struct io_request* io_wait(struct io_queue* q);
+void io_queue_close(struct io_queue* q);
+
+/* block buffers and pass arena */
+unsigned char* get_block_buf(void);
+void put_block_buf(unsigned char* buf);
+void arena_prepare(size_t size);
+void* arena_alloc(size_t size);
+size_t arena_mark(void);
+void arena_release(size_t mark);
+void arena_destroy(void);
+void* sparse_alloc(size_t size);
+void sparse_free(void* p, size_t size);
+void sparse_zero(void* p, size_t size);
+void sparse_copy(void* dst, const void* src, size_t size);
+void sparse_done(void* p, size_t size);
+
+/* partitions */
+void GetAllPartitons (char* diskname);
+void GetRawPartition (char* diskname, int64_t offset, int64_t length);
+void ExportPartition (int parIndex, const char* path);
+int64_t part_start(int parIndex);
+int64_t part_sectors(int parIndex);
+int64_t block_sector(int parIndex, __u32 block);
+
+/* superblock and inodes */
+struct ext2_super_block get_superblock(int parIndex);
+int Get_Inode_Counts(int parIndex);
+__u32 Get_Block_Counts(int parIndex);
+void Get_Magicnumber(int parIndex);
+__u32 group_count(const struct ext2_super_block* super);
+int group_has_super(const struct ext2_super_block* super, __u32 group);
+__u32 group_gdt_blocks(const struct ext2_super_block* super);
+__u32 group_meta_blocks(const struct ext2_super_block* super, __u32 group);
+__u32 group_first_block(const struct ext2_super_block* super, __u32 group);
+const struct ext2_group_desc* Get_Group_Desc_Table(int parIndex, __u32* groups);
+struct ext2_group_desc Get_Group_Desc(int group, int parIndex);
+struct inode_location Get_Inode_Location(int inodeIndex, int parIndex);
+struct ext2_inode Get_Inode(int inodeIndex, int parIndex);
+void Put_Inode(int inodeIndex, int parIndex, struct ext2_inode* inode);
+void prefetch_inode_table(int parIndex, int group);
+struct ext2_inode Get_Root_Inode(int parIndex);
+int Get_Inode_Type(__u16 i_mode);
+
+/* directory block streams */
+void dir_stream_open(struct dir_stream* stream, __u32 i_block[], int parIndex);
+int dir_stream_next(struct dir_stream* stream);
+void dir_stream_write(struct dir_stream* stream);
+int dir_stream_read(struct dir_stream* stream, __u32 index);
+void dir_stream_close(struct dir_stream* stream);
+
+/* hashed directories */
+__u32 ext2_dirhash(const char* name, int len, int version, const __u32* seed);
+int dx_hash_version(struct ext2_super_block* super, int root_version);
+int dir_is_indexed(struct ext2_inode* dir_inode, int parIndex);
+int dx_root_hash(const unsigned char* root, struct ext2_super_block* super, const char* name, int len,
+                 __u32* hash);
+int dx_find_leaf(struct dir_stream* stream, __u32 hash, __u32* next_hash);
+int dir_lookup(struct ext2_inode* dir_inode, const char* name, int parIndex);
+
+#endif
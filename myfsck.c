@@ -1,28 +1,44 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <errno.h>
+#include <stddef.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <inttypes.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <linux/types.h>
-#include "genhd.h"
-#include "ext2_fs.h"
-
-#if defined(__FreeBSD__)
-#define lseek64 lseek
-#endif
-
-#define SECTOR_SIZE_BYTES     512
-#define PARTITION_SIZE_BYTES  16
-#define PARTITION_SIZE        1024
-#define SUPERBLOCK_OFFSET     1024
-#define SUPERBLOCK_SIZE       1024
-#define ROOT_INODE            2
-#define BLOCK_GROUP_DESC      32
-#define INODE_SIZE            128
+#include <pthread.h>
+#include <sched.h>
+#include "ext2_disk.h"
+
+/* getopt codes of the long-only options */
+#define OPT_CHECKPOINT        256
+#define OPT_RESUME            257
+#define OPT_UNDO_FILE         258
+#define OPT_UNDO              259
+#define OPT_STATE             260
+#define OPT_DIRECT            261
+#define OPT_CACHE_MB          262
+#define OPT_RAW               263
+#define OPT_OFFSET            264
+#define OPT_LENGTH            265
+#define OPT_EXPORT            266
+#define OPT_OVERLAY           267
+#define OPT_COMMIT_OVERLAY    268
+#define OPT_SCAN              269
+#define OPT_REPORT            270
+#define OPT_REPORT_FORMAT     271
+#define OPT_THREADS           272
+#define OPT_QUEUE_DEPTH       273
+#define OPT_STATS             274
+#define OPT_ASYNC             275
+#define OPT_MAX_MEMORY        276
+#define OPT_SCRATCH_DIR       277
+#define OPT_FRAG_REPORT       278
 
 
 void pass1(int parIndex);
@@ -33,500 +49,2092 @@ void pass3(int parIndex);
 
 void pass4(int parIndex);
 
-extern int64_t lseek64(int, int64_t, int);
-
-static int device;
-
-static struct partition* parArray;
-
-static int    parArrayCounter = 0;
-
-static int    extend_base = 0;
-
 static char*  self_reference = ".";
 
 static char*  parent_reference = "..";
 
 static char*  lost_found = "lost+found";
 
-int BLOCKSIZE = 1024;
+static int    lost_found_index = 0;
 
-int BLOCK_SECTOR_RATIO = 2;
+static int    worker_threads = 1;       // --threads
 
-struct inode_location {
-  unsigned int sect_num;
-  unsigned int offset_within_sect;
-};
+static int    show_stats = 0;           // --stats
 
+static int    async_walks = 0;          // --async
 
-/* read_sectors: read a specified number of sectors into a buffer.
- *
- * inputs:
- *   int64 start_sector: the starting sector number to read.
- *                       sector numbering starts with 0.
- *   int numsectors: the number of sectors to read.  must be >= 1.
- *   int device [GLOBAL]: the disk from which to read.
+
+/*
+ * Report stream
  *
- * outputs:
- *   void *into: the requested number of sectors are copied into here.
+ * Every problem found is a typed record: the partition and pass, the kind,
+ * the inode, block or group it is about and the value before and after the
+ * repair.  Records are counted for the summary printed after each
+ * partition.  With --report they also go to a file as NDJSON or as raw
+ * binary records instead of to stdout.
  *
- * modifies:
- *   void *into
+ * Each thread appends to a buffer of its own.  A full buffer is queued for
+ * the writer thread, which formats and writes it while the passes go on.
+ * A thread that reports has to call report_thread_flush() before it ends.
  */
-void read_sectors (int64_t start_sector, unsigned int num_sectors, void *into)
-{
-    ssize_t ret;
-    int64_t lret;
-    int64_t sector_offset;
-    ssize_t bytes_to_read;
 
+#define REPORT_BUFFER_RECORDS 4096
+#define REPORT_QUEUE_DEPTH    8           /* full buffers queued before reporters wait */
+#define REPORT_WRITE_BUFFER   (256 << 10)
+#define REPORT_MAGIC          "MYFSCKR1"
+
+/* report_stream.format */
+#define REPORT_NDJSON         0
+#define REPORT_BINARY         1
+
+enum report_kind {
+  REPORT_SUPER_RESTORED,        // object: group of the backup used
+  REPORT_NO_SUPERBLOCK,
+  REPORT_BACKUP_SUPER,          // object: group
+  REPORT_BACKUP_GDT,            // object: group
+  REPORT_HTREE_CLEARED,         // object: inode
+  REPORT_SELF_REFERENCE,        // object: inode, old/new: '.' entry
+  REPORT_PARENT_REFERENCE,      // object: inode, old/new: '..' entry
+  REPORT_LOST_FOUND_INDEX,      // object: lost+found inode
+  REPORT_UNREFERENCED,          // object: inode, old/new: link count
+  REPORT_RECONNECTED,           // object: inode
+  REPORT_RECONNECT_FAILED,      // object: inode
+  REPORT_LINK_COUNT,            // object: inode, old/new: link count
+  REPORT_BLOCK_BITMAP,          // object: block, old/new: bitmap bit
+  REPORT_KINDS
+};
 
-    sector_offset = start_sector * SECTOR_SIZE_BYTES;
+static const char* report_kind_names[REPORT_KINDS] = {
+  "superblock_restored", "no_superblock", "backup_superblock", "backup_group_desc", "htree_cleared",
+  "self_reference", "parent_reference", "lost_found_index", "unreferenced", "reconnected",
+  "reconnect_failed", "link_count", "block_bitmap"
+};
 
-    if ((lret = lseek64(device, sector_offset, SEEK_SET)) != sector_offset) {
-        fprintf(stderr, "Seek to position %"PRId64" failed: "
-                "returned %"PRId64"\n", sector_offset, lret);
-        exit(-1);
-    }
+/* On disk as is in the binary format, after a report_header. */
+struct report_record {
+  __u64 object;
+  __s64 old_value;
+  __s64 new_value;
+  __u16 partition;
+  __u8  pass;
+  __u8  kind;
+  __u32 reserved;
+};
 
-    bytes_to_read = SECTOR_SIZE_BYTES * num_sectors;
+struct report_header {
+  char  magic[8];
+  __u32 record_size;
+  __u32 reserved;
+};
 
-    if ((ret = read(device, into, bytes_to_read)) != bytes_to_read) {
-        fprintf(stderr, "Read sector %"PRId64" length %d failed: "
-                "returned %"PRId64"\n", start_sector, num_sectors, ret);
-        exit(-1);
+struct report_buffer {
+  struct report_buffer* next;
+  int n;
+  struct report_record rec[REPORT_BUFFER_RECORDS];
+};
+
+static __thread struct report_buffer* report_local;
+
+static struct {
+  int      fd;                  // -1 without --report
+  int      format;
+  int      partition;           // set by report_begin_pass, before any worker runs
+  int      pass;
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t queued;        // the writer has work
+  pthread_cond_t room;          // a reporter may queue
+  struct report_buffer* head;
+  struct report_buffer* tail;
+  struct report_buffer* spare;
+  int      depth;
+  int      closing;
+  __u64    counts[REPORT_KINDS];
+} report_stream = { -1 };
+
+static void report_write(const void* buf, size_t len) {
+  const char* p = (const char*) buf;
+  while(len > 0) {
+    ssize_t n = write(report_stream.fd, p, len);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0) {
+      perror("Could not write report file");
+      exit(-1);
     }
+    p += n;
+    len -= n;
+  }
 }
 
-/* write_sectors: write a buffer into a specified number of sectors.
- *
- * inputs:
- *   int64 start_sector: the starting sector number to write.
- *                  sector numbering starts with 0.
- *   int numsectors: the number of sectors to write.  must be >= 1.
- *   void *from: the requested number of sectors are copied from here.
- *
- * outputs:
- *   int device [GLOBAL]: the disk into which to write.
- *
- * modifies:
- *   int device [GLOBAL]
- */
-void write_sectors (int64_t start_sector, unsigned int num_sectors, void *from)
-{
-    ssize_t ret;
-    int64_t lret;
-    int64_t sector_offset;
-    ssize_t bytes_to_write;
-
-
-    sector_offset = start_sector * SECTOR_SIZE_BYTES;
+static void report_format(struct report_buffer* b, char* out) {
+  if(report_stream.format == REPORT_BINARY) {
+    report_write(b->rec, sizeof(struct report_record) * b->n);
+    return;
+  }
 
-    if ((lret = lseek64(device, sector_offset, SEEK_SET)) != sector_offset) {
-        fprintf(stderr, "Seek to position %"PRId64" failed: "
-                "returned %"PRId64"\n", sector_offset, lret);
-        exit(-1);
+  size_t len = 0;
+  int i = 0;
+  for(; i < b->n; i++) {
+    struct report_record* r = &b->rec[i];
+    len += sprintf(out + len, "{\"partition\":%u,\"pass\":%u,\"kind\":\"%s\",\"object\":%llu,"
+                   "\"old\":%lld,\"new\":%lld}\n", r->partition, r->pass, report_kind_names[r->kind],
+                   (unsigned long long) r->object, (long long) r->old_value, (long long) r->new_value);
+    if(len > REPORT_WRITE_BUFFER - 256) {
+      report_write(out, len);
+      len = 0;
     }
+  }
+  report_write(out, len);
+}
 
-    bytes_to_write = SECTOR_SIZE_BYTES * num_sectors;
+static void* report_writer(void* arg) {
+  char* out = (char*) malloc(REPORT_WRITE_BUFFER);
 
-    if ((ret = write(device, from, bytes_to_write)) != bytes_to_write) {
-        fprintf(stderr, "Write sector %"PRId64" length %d failed: "
-                "returned %"PRId64"\n", start_sector, num_sectors, ret);
-        exit(-1);
-    }
+  pthread_mutex_lock(&report_stream.lock);
+  while(1) {
+    while(report_stream.head == NULL && !report_stream.closing)
+      pthread_cond_wait(&report_stream.queued, &report_stream.lock);
+    struct report_buffer* b = report_stream.head;
+    if(b == NULL)
+      break;
+    report_stream.head = b->next;
+    if(report_stream.head == NULL)
+      report_stream.tail = NULL;
+    pthread_mutex_unlock(&report_stream.lock);
+
+    report_format(b, out);
+
+    pthread_mutex_lock(&report_stream.lock);
+    b->n = 0;
+    b->next = report_stream.spare;
+    report_stream.spare = b;
+    report_stream.depth--;
+    pthread_cond_broadcast(&report_stream.room);
+  }
+  pthread_mutex_unlock(&report_stream.lock);
+  free(out);
+  return NULL;
 }
 
+void report_open(const char* path, int format) {
+  report_stream.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(report_stream.fd < 0) {
+    perror("Could not open report file");
+    exit(-1);
+  }
+  report_stream.format = format;
+  if(format == REPORT_BINARY) {
+    struct report_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, REPORT_MAGIC, sizeof(hdr.magic));
+    hdr.record_size = sizeof(struct report_record);
+    report_write(&hdr, sizeof(hdr));
+  }
 
+  pthread_mutex_init(&report_stream.lock, NULL);
+  pthread_cond_init(&report_stream.queued, NULL);
+  pthread_cond_init(&report_stream.room, NULL);
+  if(pthread_create(&report_stream.writer, NULL, report_writer, NULL) != 0) {
+    printf("Could not start the report writer\n");
+    exit(-1);
+  }
+}
 
-int GetOnePartition (int the_sector, char* buf, int64_t offset) {
-//
-  memcpy(parArray+parArrayCounter, buf+offset, PARTITION_SIZE_BYTES);
-
+/* Queue this thread's buffer for the writer. */
+void report_thread_flush(void) {
+  struct report_buffer* b = report_local;
+  if(b == NULL || b->n == 0)
+    return;
 
-  if (parArray[parArrayCounter].sys_ind == DOS_EXTENDED_PARTITION) {
-    // If this partition is an extended one but still the primary partition, 
-    // the counter keeps on increment    
-    if(parArrayCounter <= 3) {
-      extend_base = parArray[parArrayCounter].start_sect;
-      parArrayCounter++;  
-    } else {
-      parArray[parArrayCounter].start_sect = parArray[parArrayCounter].start_sect + extend_base;
-    }
-    return 1;
-  } else {
-    parArray[parArrayCounter].start_sect = parArray[parArrayCounter].start_sect + the_sector;
-    if(parArray[parArrayCounter].sys_ind != 0x00 || parArrayCounter <= 3 )
-      parArrayCounter++;
-    return 0;
-  }
+  pthread_mutex_lock(&report_stream.lock);
+  while(report_stream.depth >= REPORT_QUEUE_DEPTH)
+    pthread_cond_wait(&report_stream.room, &report_stream.lock);
+  b->next = NULL;
+  if(report_stream.tail != NULL)
+    report_stream.tail->next = b;
+  else
+    report_stream.head = b;
+  report_stream.tail = b;
+  report_stream.depth++;
+
+  report_local = report_stream.spare;
+  if(report_local != NULL)
+    report_stream.spare = report_local->next;
+  pthread_cond_signal(&report_stream.queued);
+  pthread_mutex_unlock(&report_stream.lock);
+
+  if(report_local == NULL)
+    report_local = (struct report_buffer*) malloc(sizeof(struct report_buffer));
+  report_local->n = 0;
 }
 
+void report_close(void) {
+  if(report_stream.fd < 0)
+    return;
 
-// Assume each sector only has one partition that could be extended
-void GetAllPartitons (char* diskname) {
-  unsigned char buf[SECTOR_SIZE_BYTES]; // A buffer with 512 bytes
-  int           the_sector = 0;         // Read the first sector to get the four primary partitions  
-  int64_t       offset;
-  int           extendIndex = 0;
-  parArray = (struct partition*)malloc(100 * PARTITION_SIZE_BYTES);
-  if ((device = open(diskname, O_RDWR)) == -1) {
-    perror("Could not open device file");
-    exit(-1);
+  report_thread_flush();
+  pthread_mutex_lock(&report_stream.lock);
+  report_stream.closing = 1;
+  pthread_cond_signal(&report_stream.queued);
+  pthread_mutex_unlock(&report_stream.lock);
+  pthread_join(report_stream.writer, NULL);
+
+  if(fsync(report_stream.fd) != 0 && errno != EINVAL)
+    perror("Could not sync report file");
+  close(report_stream.fd);
+  report_stream.fd = -1;
+
+  free(report_local);
+  report_local = NULL;
+  while(report_stream.spare != NULL) {
+    struct report_buffer* b = report_stream.spare;
+    report_stream.spare = b->next;
+    free(b);
   }
+}
 
-  // printf("Dumping sector %d:\n", the_sector);
-  read_sectors(the_sector, 1, buf);
+void report_begin_pass(int parIndex, int pass) {
+  report_stream.partition = parIndex;
+  report_stream.pass = pass;
+}
 
+/*
+ * Record a problem.  Returns 1 if the caller should print its own line,
+ * that is when there is no report file.
+ */
+static int report(enum report_kind kind, __u64 object, __s64 old_value, __s64 new_value) {
+  __atomic_fetch_add(&report_stream.counts[kind], 1, __ATOMIC_RELAXED);
+  if(report_stream.fd < 0)
+    return 1;
 
-  /*
-   * Get the four primary partitions
-   */  
-  offset = 446;
-  int primary_co = 4;
-  while (primary_co != 0) {
-    int stat = GetOnePartition(the_sector, buf, offset);
-    // printf("!!!!!!!!!%d\n",stat);
-    if(stat) {
-      // printf("extended partition\n");
-      extendIndex = parArrayCounter - 1;
-    }
-    offset += PARTITION_SIZE_BYTES;
-    primary_co --;
-  }
-
-  /*
-   * Get the extended partitions if existed
-   */ 
-  while(extendIndex != 0) {
-    int logical_co = 2;
-    // get the sector to go from extendIndex
-    the_sector = parArray[extendIndex].start_sect;
-
-    // reset extendIndex to 0
-    extendIndex = 0;
-
-    // read the target sector
-    read_sectors(the_sector, 1, buf);
-
-    // start from 446 offset
-    offset = 446;
-    while(logical_co != 0) {
-      int stat = GetOnePartition(the_sector, buf, offset);
-      if(stat) {
-        // printf("extended partition\n");
-        extendIndex = parArrayCounter;
-      }
-      offset += PARTITION_SIZE_BYTES;
-      logical_co --;
+  if(report_local == NULL) {
+    report_local = (struct report_buffer*) malloc(sizeof(struct report_buffer));
+    report_local->n = 0;
+  }
+  struct report_record* r = &report_local->rec[report_local->n];
+  r->object = object;
+  r->old_value = old_value;
+  r->new_value = new_value;
+  r->partition = report_stream.partition;
+  r->pass = report_stream.pass;
+  r->kind = kind;
+  r->reserved = 0;
+  if(++report_local->n == REPORT_BUFFER_RECORDS)
+    report_thread_flush();
+  return 0;
+}
+
+/* Summary of the partition's records, printed when they went to the file. */
+void report_summary(int parIndex) {
+  int printed = 0;
+  int kind = 0;
+  for(; kind < REPORT_KINDS; kind++) {
+    if(report_stream.fd >= 0 && report_stream.counts[kind] != 0) {
+      if(!printed)
+        printf("partition: %d, report:", parIndex);
+      printf("%s %llu %s", printed ? "," : "", (unsigned long long) report_stream.counts[kind],
+             report_kind_names[kind]);
+      printed = 1;
     }
-  }  
+    report_stream.counts[kind] = 0;
+  }
+  if(printed)
+    printf("\n");
+  else if(report_stream.fd >= 0)
+    printf("partition: %d, report: no problems\n", parIndex);
 }
 
+/* With --stats, what a pipeline read and who waited for whom. */
+static void pipe_stats(int parIndex, const char* what, struct block_pipe* p) {
+  if(!show_stats)
+    return;
+  printf("partition: %d, %s: queue depth %d, %ld batches, %.1f MB, reader waited %.3f s, parser waited %.3f s\n",
+         parIndex, what, p->depth, p->batches, p->sectors * (double) SECTOR_SIZE_BYTES / (1 << 20),
+         p->reader_wait, p->parser_wait);
+}
 
-struct ext2_super_block get_superblock(int parIndex) {
- // Find superblock of this partition to get inode_per_group and block_per_group
-  unsigned char buf_superblock[SUPERBLOCK_SIZE];
+/*
+ * Block maps
+ *
+ * Pass 4 collects the blocks in use in a block_map rather than an int per
+ * block.  The map is cut into regions of BMAP_REGION_BITS, each of which
+ * is empty, full, a sorted list of runs of set bits, or, once it has more
+ * than BMAP_MAX_RUNS runs, a dense bitset.  Files mostly sit in long runs,
+ * so a map costs a few bytes per run, and the claims and the bitmap
+ * compare work a run at a time.  Regions are locked in stripes, several
+ * walkers may set bits at once.
+ */
 
-  // Offset 2 sectors;
-  int superblock_start_sector = parArray[parIndex-1].start_sect + SUPERBLOCK_OFFSET/SECTOR_SIZE_BYTES;
-  read_sectors(superblock_start_sector, 2, buf_superblock);
+#define BMAP_REGION_BITS      32768
+#define BMAP_MAX_RUNS         128         /* runs a region keeps before it turns dense */
+#define BMAP_LOCKS            64
 
-  struct ext2_super_block* super_block = (struct ext2_super_block*)buf_superblock;
-  // super_block = malloc(sizeof(struct ext2_super_block));
-  // memcpy(super_block, buf_superblock, sizeof(struct ext2_super_block));
+/* bmap_region.kind */
+#define BMAP_EMPTY            0
+#define BMAP_RUNS             1
+#define BMAP_DENSE            2
+#define BMAP_FULL             3
 
-  // Set the block size everytime read superblock, as block size varies.
-  BLOCKSIZE = 1024 << (super_block->s_log_block_size);
+struct bmap_run {
+  __u16 start;                  // in the region
+  __u16 len;
+};
 
-  // Set the block size and sector size ratio
-  BLOCK_SECTOR_RATIO = BLOCKSIZE / SECTOR_SIZE_BYTES;
+struct bmap_region {
+  unsigned char kind;
+  int    runs;
+  int    size;                  // runs run[] has room for
+  struct bmap_run* run;
+  unsigned char* bits;          // BMAP_DENSE
+};
 
-  return *super_block;
-}
+struct block_map {
+  __u64  bits;
+  size_t regions;
+  struct bmap_region* region;
+  pthread_mutex_t lock[BMAP_LOCKS];
+};
 
-int Get_Inode_Counts(int parIndex) {
-  struct ext2_super_block super_block = get_superblock(parIndex);
+void bmap_open(struct block_map* map, __u64 bits) {
+  int l = 0;
+  map->bits = bits;
+  map->regions = bits / BMAP_REGION_BITS + 1;
+  map->region = (struct bmap_region*) calloc(map->regions, sizeof(struct bmap_region));
+  if(map->region == NULL) {
+    perror("Could not allocate a block map");
+    exit(-1);
+  }
+  for(; l < BMAP_LOCKS; l++)
+    pthread_mutex_init(&map->lock[l], NULL);
+}
 
-  return super_block.s_inodes_count;
+static void bmap_region_clear(struct bmap_region* r) {
+  free(r->run);
+  free(r->bits);
+  memset(r, 0, sizeof(*r));
 }
 
-int Get_Block_Counts(int parIndex) {
-  struct ext2_super_block super_block = get_superblock(parIndex);
+void bmap_close(struct block_map* map) {
+  size_t i = 0;
+  int l = 0;
+  for(; i < map->regions; i++)
+    bmap_region_clear(&map->region[i]);
+  free(map->region);
+  for(; l < BMAP_LOCKS; l++)
+    pthread_mutex_destroy(&map->lock[l]);
+}
 
-  return super_block.s_blocks_count;  
+/* Set bits [off, off + n) of a byte array. */
+static void bits_set(unsigned char* bits, size_t off, size_t n) {
+  while(n > 0 && off % 8) {
+    bits[off / 8] |= 1 << (off % 8);
+    off++;
+    n--;
+  }
+  memset(bits + off / 8, 0xff, n / 8);
+  off += n / 8 * 8;
+  n %= 8;
+  while(n > 0) {
+    bits[off / 8] |= 1 << (off % 8);
+    off++;
+    n--;
+  }
 }
-/*
- * Get the magic number of a partition
- */
-void Get_Magicnumber(int parIndex) {
-  
-  struct ext2_super_block super_block = get_superblock(parIndex);
 
-  printf("Magic number of partiton %d: 0x%02x\n", parIndex, super_block.s_magic);
+static void bmap_make_dense(struct bmap_region* r) {
+  int i = 0;
+  r->bits = (unsigned char*) calloc(BMAP_REGION_BITS / 8, 1);
+  if(r->bits == NULL) {
+    perror("Could not allocate a block map");
+    exit(-1);
+  }
+  for(; i < r->runs; i++)
+    bits_set(r->bits, r->run[i].start, r->run[i].len);
+  free(r->run);
+  r->run = NULL;
+  r->runs = r->size = 0;
+  r->kind = BMAP_DENSE;
+}
 
-  // printf("inode number: %d\n", super_block->s_inodes_count);
-  // printf("block number: %d\n", super_block->s_blocks_count);
+/* Add [lo, hi) to a region's runs, merging the runs it touches. */
+static void bmap_region_add(struct bmap_region* r, int lo, int hi) {
+  int a = 0;
+  int b = r->runs;
 
-  // printf("first block : %d\n", super_block->s_first_data_block);
-  // printf("inodes per group: %d\n", super_block->s_inodes_per_group);
-  // printf("blocks per group: %d\n", super_block->s_blocks_per_group);
-  // // printf("!!belong to group: 0x%02x\n", super_block->s_block_group_nr);
+  // Runs before a end before lo, runs from b on start after hi
+  while(a < b) {
+    int m = (a + b) / 2;
+    if(r->run[m].start + r->run[m].len < lo)
+      a = m + 1;
+    else
+      b = m;
+  }
+  b = a;
+  while(b < r->runs && r->run[b].start <= hi)
+    b++;
+
+  if(a < b) {
+    if(r->run[a].start < lo)
+      lo = r->run[a].start;
+    if(r->run[b - 1].start + r->run[b - 1].len > hi)
+      hi = r->run[b - 1].start + r->run[b - 1].len;
+    memmove(&r->run[a + 1], &r->run[b], sizeof(struct bmap_run) * (r->runs - b));
+    r->runs -= b - a - 1;
+  } else {
+    if(r->runs == r->size) {
+      r->size = r->size ? r->size * 2 : 4;
+      r->run = (struct bmap_run*) realloc(r->run, sizeof(struct bmap_run) * r->size);
+      if(r->run == NULL) {
+        perror("Could not grow a block map");
+        exit(-1);
+      }
+    }
+    memmove(&r->run[a + 1], &r->run[a], sizeof(struct bmap_run) * (r->runs - a));
+    r->runs++;
+  }
+  r->run[a].start = lo;
+  r->run[a].len = hi - lo;
+
+  if(r->runs == 1 && lo == 0 && hi == BMAP_REGION_BITS) {
+    bmap_region_clear(r);
+    r->kind = BMAP_FULL;
+  } else if(r->runs > BMAP_MAX_RUNS) {
+    bmap_make_dense(r);
+  }
+}
 
-  // // log1024 - 10 = 0
-  // printf("block size : %d\n", super_block->s_log_block_size);
+/* Set bits [first, first + count), the part past the end of the map is ignored. */
+void bmap_set_range(struct block_map* map, __u64 first, __u64 count) {
+  if(first >= map->bits)
+    return;
+  if(count > map->bits - first)
+    count = map->bits - first;
+
+  while(count > 0) {
+    size_t i = first / BMAP_REGION_BITS;
+    int lo = first % BMAP_REGION_BITS;
+    int hi = count < (__u64) (BMAP_REGION_BITS - lo) ? lo + (int) count : BMAP_REGION_BITS;
+    struct bmap_region* r = &map->region[i];
+
+    pthread_mutex_lock(&map->lock[i % BMAP_LOCKS]);
+    if(r->kind == BMAP_EMPTY && lo == 0 && hi == BMAP_REGION_BITS) {
+      r->kind = BMAP_FULL;
+    } else if(r->kind == BMAP_EMPTY || r->kind == BMAP_RUNS) {
+      r->kind = BMAP_RUNS;
+      bmap_region_add(r, lo, hi);
+    } else if(r->kind == BMAP_DENSE) {
+      bits_set(r->bits, lo, hi - lo);
+    }
+    pthread_mutex_unlock(&map->lock[i % BMAP_LOCKS]);
 
-  
+    first += hi - lo;
+    count -= hi - lo;
+  }
 }
 
+int bmap_test(struct block_map* map, __u64 bit) {
+  if(bit >= map->bits)
+    return 0;
+  struct bmap_region* r = &map->region[bit / BMAP_REGION_BITS];
+  int off = bit % BMAP_REGION_BITS;
+  int a = 0;
+  int b = r->runs;
 
-struct ext2_inode Get_Inode(int inodeIndex, int parIndex) {
+  switch(r->kind) {
+  case BMAP_FULL:
+    return 1;
+  case BMAP_DENSE:
+    return (r->bits[off / 8] >> (off % 8)) & 1;
+  case BMAP_RUNS:
+    while(a < b) {
+      int m = (a + b) / 2;
+      if(r->run[m].start + r->run[m].len <= off)
+        a = m + 1;
+      else
+        b = m;
+    }
+    return a < r->runs && r->run[a].start <= off;
+  }
+  return 0;
+}
 
-  struct ext2_super_block super_block = get_superblock(parIndex);
-  
-  int inodes_per_group = super_block.s_inodes_per_group;
+/* Bits [first, first + nbits) of the map into out, bit 0 of out[0] first. */
+void bmap_fill(struct block_map* map, __u64 first, int nbits, unsigned char* out) {
+  __u64 end = first + nbits < map->bits ? first + nbits : map->bits;
+  __u64 at = first;
+
+  memset(out, 0, (nbits + 7) / 8);
+  while(at < end) {
+    struct bmap_region* r = &map->region[at / BMAP_REGION_BITS];
+    __u64 base = at - at % BMAP_REGION_BITS;
+    int lo = at - base;
+    int hi = end - base < BMAP_REGION_BITS ? (int) (end - base) : BMAP_REGION_BITS;
+    int i = 0;
+
+    if(r->kind == BMAP_FULL) {
+      bits_set(out, at - first, hi - lo);
+    } else if(r->kind == BMAP_RUNS) {
+      for(; i < r->runs; i++) {
+        int s = r->run[i].start > lo ? r->run[i].start : lo;
+        int e = r->run[i].start + r->run[i].len < hi ? r->run[i].start + r->run[i].len : hi;
+        if(s < e)
+          bits_set(out, base + s - first, e - s);
+      }
+    } else if(r->kind == BMAP_DENSE) {
+      for(i = lo; i < hi; i++) {
+        if((r->bits[i / 8] >> (i % 8)) & 1)
+          out[(base + i - first) / 8] |= 1 << ((base + i - first) % 8);
+      }
+    }
+    at = base + hi;
+  }
+}
 
-  // Get which block group this inode belongs to
-  int block_group = (inodeIndex - 1) / inodes_per_group;
-  int local_inode_index = (inodeIndex - 1) % inodes_per_group;
+/* Set the bits of the nonzero entries of an int per block array. */
+void bmap_load(struct block_map* map, const int* mark, size_t count) {
+  size_t i = 0;
+  while(i < count) {
+    if(mark[i] == 0) {
+      i++;
+      continue;
+    }
+    size_t run = 1;
+    while(i + run < count && mark[i + run] != 0)
+      run++;
+    bmap_set_range(map, i, run);
+    i += run;
+  }
+}
 
-  int64_t blockgroup_offset;
+/* Store the map into a zeroed int per block array, 1 for the set bits. */
+void bmap_store(struct block_map* map, int* mark, size_t count) {
+  size_t i = 0;
+  for(; i < map->regions; i++) {
+    struct bmap_region* r = &map->region[i];
+    __u64 base = (__u64) i * BMAP_REGION_BITS;
+    int j = 0;
+    for(; r->kind != BMAP_EMPTY && j < BMAP_REGION_BITS && base + j < count; j++) {
+      if(r->kind == BMAP_FULL || bmap_test(map, base + j))
+        mark[base + j] = 1;
+    }
+  }
+}
 
-  if(BLOCKSIZE == 1024)
-    blockgroup_offset = SUPERBLOCK_OFFSET + SUPERBLOCK_SIZE;
+/* With --stats, what shape the map took. */
+static void bmap_stats(int parIndex, struct block_map* map) {
+  long kinds[4] = {0, 0, 0, 0};
+  long runs = 0;
+  size_t i = 0;
 
-  else
-    // The first group descriptor locates in the next block following superblock
-    blockgroup_offset = BLOCKSIZE;
+  if(!show_stats)
+    return;
+  for(; i < map->regions; i++) {
+    kinds[map->region[i].kind]++;
+    runs += map->region[i].runs;
+  }
+  printf("partition: %d, block map: %ld empty, %ld run (%ld runs), %ld dense, %ld full regions\n",
+         parIndex, kinds[BMAP_EMPTY], kinds[BMAP_RUNS], runs, kinds[BMAP_DENSE], kinds[BMAP_FULL]);
+}
 
-  unsigned char blockgroup_buf[BLOCKSIZE];
+/*
+ * Fragmentation report
+ *
+ * With --frag-report pass 4 measures, in the walk that claims the blocks
+ * and the sweep over the block bitmaps it does anyway, how fragmented the
+ * files and the free space are.  A file's extents are the runs of
+ * consecutive blocks in the order its block list is walked, pointer
+ * blocks included, so a file whose indirect block sits between its data
+ * blocks is still one extent.  Every walker keeps the file it is on in a
+ * frag_track and stores it in an array by inode when the file is done; the
+ * summary is made from that array after the walk, so it comes out the same
+ * whatever walked the tree.  Free extents are the runs of clear bits of
+ * each group's block bitmap after the repair, a run crossing into the next
+ * group counts in both.
+ *
+ * The summary, the size classes and the most fragmented files go to
+ * stdout, a line per file and per group to the --frag-report file.  The
+ * report needs the full walk and every bitmap, so --state does not let
+ * pass 4 skip anything while it is on.
+ */
 
-  // find the start sector for first block group descriptor
-  int blockgroup_start_sector = parArray[parIndex-1].start_sect + blockgroup_offset/SECTOR_SIZE_BYTES;
-                              
-  // Read one block to get all the block group descriptor                            
-  read_sectors(blockgroup_start_sector, BLOCK_SECTOR_RATIO, blockgroup_buf);  
+#define FRAG_BUCKETS          32          /* power of two size classes */
+#define FRAG_TOP              10          /* most fragmented files printed */
 
-  // Find the corresponding group descriptor according to the block_group
-  struct ext2_group_desc* group_desc = (struct ext2_group_desc*)(blockgroup_buf + block_group * BLOCK_GROUP_DESC);
+struct frag_track {
+  __u32 next;                   // the block that would continue the extent
+  __u32 extents;
+  __u32 blocks;
+};
 
-  // Find the start sector of inode table
-  int inodetable_start_sector = parArray[parIndex-1].start_sect + group_desc->bg_inode_table * BLOCK_SECTOR_RATIO;
+struct frag_file {
+  __u32 extents;
+  __u32 blocks;
+};
 
-  // Find the sector of the target inode based on inode table start sector
-  int sect_num = inodetable_start_sector + local_inode_index*INODE_SIZE / SECTOR_SIZE_BYTES;
+struct frag_group {
+  __u64 free;
+  __u64 extents;
+  __u64 largest;
+  __u64 sizes[FRAG_BUCKETS];
+};
 
-  // Calculate the offset within the sector
-  int offset_within_sect = local_inode_index*INODE_SIZE % SECTOR_SIZE_BYTES;
+static __thread struct frag_track frag_local;
 
-  // Read the whole target sector
-  unsigned char inode_buf[SECTOR_SIZE_BYTES];
+static struct {
+  FILE*  out;                   // NULL without --frag-report
+  struct frag_file* file;       // per inode while pass 4 measures
+  size_t count;
+  struct frag_group* group;
+  int    groups;
+  int    walked;                // the files were walked in this run
+} frag;
 
-  read_sectors(sect_num, 1, inode_buf);
+static const char* path_note(int inodeIndex);
 
-  struct ext2_inode* inode = (struct ext2_inode*)(inode_buf + offset_within_sect);
+void frag_open(const char* path) {
+  frag.out = fopen(path, "w");
+  if(frag.out == NULL) {
+    perror("Could not open the fragmentation report");
+    exit(-1);
+  }
+}
 
-  return *inode;
+void frag_close(void) {
+  if(frag.out != NULL && fclose(frag.out) != 0) {
+    perror("Could not write the fragmentation report");
+    exit(-1);
+  }
+  frag.out = NULL;
+}
 
+static void frag_begin(int inodes_count, int groups) {
+  frag.count = (size_t) inodes_count + 1;
+  frag.file = (struct frag_file*) sparse_alloc(sizeof(struct frag_file) * frag.count);
+  frag.group = (struct frag_group*) calloc(groups, sizeof(struct frag_group));
+  if(frag.group == NULL) {
+    perror("Could not allocate the fragmentation report");
+    exit(-1);
+  }
+  frag.groups = groups;
+  frag.walked = 0;
 }
 
+static int frag_bucket(__u64 n) {
+  int b = 63 - __builtin_clzll(n);
+  return b < FRAG_BUCKETS ? b : FRAG_BUCKETS - 1;
+}
 
-struct ext2_inode Get_Root_Inode(int parIndex) {
+static void frag_note(struct frag_track* t, __u32 first, __u32 count) {
+  if(t->extents == 0 || first != t->next)
+    t->extents++;
+  t->next = first + count;
+  t->blocks += count;
+}
 
-    struct ext2_inode root_inode = Get_Inode(ROOT_INODE, parIndex);
+/* Claim blocks of the file being walked, counting its extents if asked. */
+static void file_claim(struct block_map* map, __u32 first, __u32 count) {
+  bmap_set_range(map, first, count);
+  if(frag.file != NULL)
+    frag_note(&frag_local, first, count);
+}
 
-    return root_inode;
+/* The walk of the inode's blocks is over, keep what t counted and reset it. */
+static void frag_file_done(struct frag_track* t, __u32 inodeIndex) {
+  if(frag.file != NULL && inodeIndex < frag.count) {
+    frag.file[inodeIndex].extents = t->extents;
+    frag.file[inodeIndex].blocks = t->blocks;
+  }
+  memset(t, 0, sizeof(*t));
+}
 
+/* A free extent of run blocks ended, count it into the group. */
+static void frag_free_run(struct frag_group* g, __u64* run) {
+  if(*run == 0)
+    return;
+  g->free += *run;
+  g->extents++;
+  g->sizes[frag_bucket(*run)]++;
+  if(*run > g->largest)
+    g->largest = *run;
+  *run = 0;
 }
 
-void read_directory_recursive(__u32 i_block[], int curInode, int preInode, int parIndex, int* mark) {
+/* Count the free extents in the first nbits of the group's (repaired) bitmap. */
+static void frag_free_group(int group, const unsigned char* bitmap, int nbits) {
+  struct frag_group* g = &frag.group[group];
+  __u64 run = 0;
+  int bit = 0;
+
+  while(bit < nbits) {
+    unsigned char byte = bitmap[bit / 8];
+    // A byte all free or all in use at once
+    if(bit % 8 == 0 && bit + 8 <= nbits && (byte == 0 || byte == 0xff)) {
+      if(byte == 0)
+        run += 8;
+      else
+        frag_free_run(g, &run);
+      bit += 8;
+    } else {
+      if((byte >> (bit % 8)) & 1)
+        frag_free_run(g, &run);
+      else
+        run++;
+      bit++;
+    }
+  }
+  frag_free_run(g, &run);
+}
 
-  struct        ext2_dir_entry_2* dir;
-  unsigned char buf_dir[BLOCKSIZE];
+/* " 1: n, 2-3: n, ..." for the non-empty size classes, and the newline. */
+static void frag_print_sizes(FILE* f, const __u64* sizes) {
+  const char* sep = " ";
+  int b = 0;
+  for(; b < FRAG_BUCKETS; b++) {
+    if(sizes[b] == 0)
+      continue;
+    if(b == 0)
+      fprintf(f, "%s1: %llu", sep, (unsigned long long) sizes[b]);
+    else
+      fprintf(f, "%s%llu-%llu: %llu", sep, 1ULL << b, (2ULL << b) - 1, (unsigned long long) sizes[b]);
+    sep = ", ";
+  }
+  fprintf(f, "\n");
+}
 
-  // Set this inode to be 1
-  mark[curInode] = 1;
+/* Print the report of the partition and give the arrays back. */
+static void frag_end(int parIndex) {
+  __u64 sizes[FRAG_BUCKETS];
+  __u32 top[FRAG_TOP];
+  int tops = 0;
+  __u64 files = 0, fragmented = 0, extents = 0;
+  size_t i = 1;
+
+  memset(sizes, 0, sizeof(sizes));
+  for(; frag.walked && i < frag.count; i++) {
+    struct frag_file* f = &frag.file[i];
+    if(f->blocks == 0)
+      continue;
+    files++;
+    extents += f->extents;
+    fragmented += f->extents > 1;
+    sizes[frag_bucket(f->extents)]++;
+    fprintf(frag.out, "partition: %d, inode: %zu, extents: %u, blocks: %u%s\n", parIndex, i, f->extents,
+            f->blocks, path_note(i));
+
+    // Most extents first, the lower inode first among equals
+    if(f->extents < 2 || (tops == FRAG_TOP && f->extents <= frag.file[top[tops - 1]].extents))
+      continue;
+    int at = tops < FRAG_TOP ? tops++ : FRAG_TOP - 1;
+    for(; at > 0 && frag.file[top[at - 1]].extents < f->extents; at--)
+      top[at] = top[at - 1];
+    top[at] = i;
+  }
 
-  int i = 0;
-  for(; i < EXT2_N_BLOCKS-3; i++) {
-    if(i_block[i] != 0) {
-      read_sectors(parArray[parIndex-1].start_sect + i_block[i]* BLOCK_SECTOR_RATIO, BLOCK_SECTOR_RATIO, buf_dir);
-      int len = 0;
-      
-      if(i == 0) {
-        // The first entry should be '.'
-        dir = (struct ext2_dir_entry_2*) (buf_dir+len);
-        if(dir->inode != curInode || strcmp(dir->name, self_reference)) {
-          printf("partition: %d, inode: %d, wrong self_reference: %d\n",parIndex, curInode, dir->inode);
-          dir->inode = curInode;
-          write_sectors(parArray[parIndex-1].start_sect + i_block[i]* BLOCK_SECTOR_RATIO, BLOCK_SECTOR_RATIO, buf_dir);
-        }
-        len += dir->rec_len;
-
-        // The second entry should be '..'
-        dir = (struct ext2_dir_entry_2*) (buf_dir+len);
-        if(dir->inode != preInode || strcmp(dir->name, parent_reference)) {
-          printf("partition: %d, inode: %d, prev inode: %d, wrong parent_reference: %d\n",parIndex, curInode, preInode, dir->inode);
-          dir->inode = preInode;
-          write_sectors(parArray[parIndex-1].start_sect + i_block[i]* BLOCK_SECTOR_RATIO, BLOCK_SECTOR_RATIO, buf_dir);
-        }
-        len += dir->rec_len; 
-      }     
+  if(!frag.walked)
+    printf("partition: %d, fragmentation: files walked before the checkpoint, not measured\n", parIndex);
+  else if(files > 0) {
+    printf("partition: %d, fragmentation: %llu files, %llu fragmented, %.2f extents per file\n", parIndex,
+           (unsigned long long) files, (unsigned long long) fragmented, (double) extents / files);
+    printf("partition: %d, extents per file:", parIndex);
+    frag_print_sizes(stdout, sizes);
+    for(i = 0; i < (size_t) tops; i++)
+      printf("partition: %d, fragmented: inode %u, %u extents, %u blocks%s\n", parIndex, top[i],
+             frag.file[top[i]].extents, frag.file[top[i]].blocks, path_note(top[i]));
+  }
 
-      while(len < BLOCKSIZE) {        
-        dir = (struct ext2_dir_entry_2*) (buf_dir+len);
-        if(dir->inode != 0 && mark[dir->inode] != 1 && dir->file_type == 2) {
-          struct ext2_inode nextInode = Get_Inode(dir->inode, parIndex);      
-          read_directory_recursive(nextInode.i_block, dir->inode, curInode, parIndex, mark);
-        }
-        len += dir->rec_len;  
-      }
-    } else {      
-      return;            
-    }
+  __u64 free_blocks = 0, free_extents = 0, largest = 0;
+  int g = 0;
+  memset(sizes, 0, sizeof(sizes));
+  for(; g < frag.groups; g++) {
+    struct frag_group* gr = &frag.group[g];
+    fprintf(frag.out, "partition: %d, group: %d, free: %llu blocks in %llu extents, largest: %llu, sizes:",
+            parIndex, g, (unsigned long long) gr->free, (unsigned long long) gr->extents,
+            (unsigned long long) gr->largest);
+    frag_print_sizes(frag.out, gr->sizes);
+    free_blocks += gr->free;
+    free_extents += gr->extents;
+    if(gr->largest > largest)
+      largest = gr->largest;
+    int b = 0;
+    for(; b < FRAG_BUCKETS; b++)
+      sizes[b] += gr->sizes[b];
   }
+  printf("partition: %d, free space: %llu blocks in %llu extents, largest %llu\n", parIndex,
+         (unsigned long long) free_blocks, (unsigned long long) free_extents, (unsigned long long) largest);
+  printf("partition: %d, free extent sizes:", parIndex);
+  frag_print_sizes(stdout, sizes);
+
+  sparse_free(frag.file, sizeof(struct frag_file) * frag.count);
+  free(frag.group);
+  frag.file = NULL;
+  frag.group = NULL;
+}
 
+/*
+ * Block size kernels
+ *
+ * The loops that run over a whole block (directory entries, indirect
+ * pointers, a block bitmap, a block of the inode table) are written once as
+ * always_inline functions of the block size and instantiated for 1K, 2K
+ * and 4K blocks, where the size is a constant and the compiler knows the
+ * trip counts.  select_kernels() picks the set once per partition; other
+ * sizes use the instance that takes the size at run time.
+ */
 
-}
+#define KERNEL                static inline __attribute__((always_inline))
+#define DIR_MAX_ENTRIES       (EXT2_MAX_BLOCK_SIZE / 8)   /* smallest entry is 8 bytes */
 
-void read_inode_recursive(__u32 i_block[], int parIndex, int* mark) {
-  
-  struct        ext2_dir_entry_2* dir;
-  unsigned char buf_dir[BLOCKSIZE];
-  // mark increament one  
-  
+/* link_scan flags */
+#define LINK_UNREFERENCED     1           /* in use, no directory entry */
+#define LINK_COUNT_OFF        2           /* in use, i_links_count wrong */
 
-  int i = 0;
-  for(; i < EXT2_N_BLOCKS-3; i++) {
-    if(i_block[i] != 0) {
-      read_sectors(parArray[parIndex-1].start_sect + i_block[i]* BLOCK_SECTOR_RATIO, BLOCK_SECTOR_RATIO, buf_dir);
-      int len = 0;
-      
-      if(i == 0) {
-        // The first entry should be '.'
-        dir = (struct ext2_dir_entry_2*) (buf_dir+len);
-        mark[dir->inode]++;
-        len += dir->rec_len;
+struct block_kernels {
+  int  (*dir_parse)(const unsigned char* block, __u16* offsets);
+  int  (*ind_mark)(const __u32* ptrs, struct block_map* map);
+  int  (*bitmap_diff)(unsigned char* bitmap, struct block_map* map, int nbits, __u32 first_index);
+  void (*link_scan)(const unsigned char* table, const int* mark, int n, unsigned char* flags);
+};
 
-        // The second entry should be '..'
-        dir = (struct ext2_dir_entry_2*) (buf_dir+len);
-        mark[dir->inode]++;
-        len += dir->rec_len; 
-      }     
-
-      while(len < BLOCKSIZE) {        
-        dir = (struct ext2_dir_entry_2*) (buf_dir+len);
-        if(dir->file_type == 2) {
-          if(mark[dir->inode] == 0) {            
-            // Recursion
-            mark[dir->inode]++;        
-            struct ext2_inode nextInode = Get_Inode(dir->inode, parIndex);      
-            read_inode_recursive(nextInode.i_block, parIndex, mark);
-          } else
-            mark[dir->inode]++;
-        } else {
-          mark[dir->inode]++;
-        }
+static const struct block_kernels* kernels;
 
-        len += dir->rec_len;        
-      }
-    } else {      
-      return;            
-    }
+/*
+ * Offsets of the entries of a directory block, up to the first one whose
+ * rec_len does not fit.
+ */
+KERNEL int dir_parse_bs(const unsigned char* block, __u16* offsets, const int bs) {
+  int n = 0;
+  int len = 0;
+  while(len <= bs - 8) {
+    __u16 rec_len = ((const struct ext2_dir_entry_2*) (block + len))->rec_len;
+    if(rec_len < 8 || len + rec_len > bs)
+      break;
+    offsets[n++] = len;
+    len += rec_len;
   }
-
+  return n;
 }
-// int Traverse_i_block_indirect(int blockIndex, int parIndex, int* mark, int block_count) {
-int Traverse_i_block_indirect(int blockIndex, int parIndex, int* mark) {
-  // block_count--;
-  mark[blockIndex] = 1;
-  unsigned char buf_dir[BLOCKSIZE];
-  read_sectors(parArray[parIndex-1].start_sect + blockIndex * BLOCK_SECTOR_RATIO, BLOCK_SECTOR_RATIO, buf_dir);
-  int* ptr = (int*) buf_dir;
+
+/* Claim the blocks of an indirect block a run at a time, returns 1 at a null pointer. */
+KERNEL int ind_mark_bs(const __u32* ptrs, struct block_map* map, const int bs) {
   int i = 0;
-  int total = BLOCKSIZE / sizeof(int);
-  while(i != total) {
-    if(ptr[i] != 0) {
-      mark[ptr[i]] = 1;      
-    }
-    else
-      return 1;    
-    i++;
+  while(i < bs / (int) sizeof(__u32)) {
+    if(ptrs[i] == 0)
+      return 1;
+    int run = 1;
+    while(i + run < bs / (int) sizeof(__u32) && ptrs[i + run] == ptrs[i] + run)
+      run++;
+    file_claim(map, ptrs[i], run);
+    i += run;
   }
-
   return 0;
 }
-// int Traverse_i_block_doubly_indirect(int blockIndex, int parIndex, int* mark, int block_count) {
-int Traverse_i_block_doubly_indirect(int blockIndex, int parIndex, int* mark) {  
-  mark[blockIndex] = 1;
-  unsigned char buf_dir[BLOCKSIZE];
-  read_sectors(parArray[parIndex-1].start_sect + blockIndex * BLOCK_SECTOR_RATIO, BLOCK_SECTOR_RATIO, buf_dir);
-  int* ptr = (int*) buf_dir;
-  int i = 0;
-  int total = BLOCKSIZE / sizeof(int);
-  while(i != total) {
-    if(ptr[i] != 0) {
-      if(Traverse_i_block_indirect(ptr[i], parIndex, mark))
-        return 1;
+
+static void bitmap_fix_byte(unsigned char* bitmap, int byte, unsigned char want, int bits, __u32 first_index) {
+  int off = 0;
+  for(; off < bits; off++) {
+    if(((bitmap[byte] ^ want) >> off) & 1) {
+      if(report(REPORT_BLOCK_BITMAP, first_index + byte * 8 + off, (bitmap[byte] >> off) & 1, (want >> off) & 1))
+        printf("the orginal:%d, index: %u, mark: %d \n", bitmap[byte] & (1 << off),
+               first_index + byte * 8 + off, (want >> off) & 1);
+      bitmap[byte] ^= 1 << off;
     }
-    else {
-      return 1;
-    }    
-    i++;
   }
-  return 0;  
-
 }
 
-int Traverse_i_block_triply_indirect(int blockIndex, int parIndex, int* mark) {
-// int Traverse_i_block_triply_indirect(int blockIndex, int parIndex, int* mark, int block_count) {
-  
-  mark[blockIndex] = 1;
-  unsigned char buf_dir[BLOCKSIZE];
-  read_sectors(parArray[parIndex-1].start_sect + blockIndex * BLOCK_SECTOR_RATIO, BLOCK_SECTOR_RATIO, buf_dir);
-  int* ptr = (int*) buf_dir;
-  int i = 0;
-  int total = BLOCKSIZE / sizeof(int);
-  while(i != total) {
-    if(ptr[i] != 0) {
-      if(Traverse_i_block_doubly_indirect(ptr[i], parIndex, mark))
-        return 1;
+/*
+ * Make the first nbits of a block bitmap agree with the map from block
+ * first_index on.  The map's bits are filled in run by run and compared
+ * whole; only differing bytes are looked at bit by bit.  Returns 1 if the
+ * bitmap changed.
+ */
+KERNEL int bitmap_diff_bs(unsigned char* bitmap, struct block_map* map, int nbits, __u32 first_index, const int bs) {
+  unsigned char want[EXT2_MAX_BLOCK_SIZE];
+  int changed = 0;
+  int byte = 0;
+
+  if(nbits >= bs * 8) {
+    bmap_fill(map, first_index, bs * 8, want);
+    if(!memcmp(want, bitmap, bs))
+      return 0;
+    for(; byte < bs; byte++) {
+      if(want[byte] != bitmap[byte]) {
+        bitmap_fix_byte(bitmap, byte, want[byte], 8, first_index);
+        changed = 1;
+      }
     }
-    else {
-      return 1;
-    }    
-    i++;
+    return changed;
   }
-  return 0; 
 
+  bmap_fill(map, first_index, nbits, want);
+  for(; byte * 8 < nbits; byte++) {
+    int bits = nbits - byte * 8 < 8 ? nbits - byte * 8 : 8;
+    unsigned char keep = bits == 8 ? 0 : (unsigned char) (0xff << bits);
+    unsigned char w = want[byte] | (bitmap[byte] & keep);
+    if(w != bitmap[byte]) {
+      bitmap_fix_byte(bitmap, byte, w, bits, first_index);
+      changed = 1;
+    }
+  }
+  return changed;
 }
 
-// void Traverse_i_block(__u32 i_block[], int parIndex, int* mark, int block_count) {
-void Traverse_i_block(__u32 i_block[], int parIndex, int* mark) {
-
+/*
+ * Compare n inodes of an inode table block against their link marks and
+ * set LINK_* flags for the ones passes 2 and 3 have to look at.
+ */
+KERNEL void link_scan_bs(const unsigned char* table, const int* mark, int n, unsigned char* flags, const int bs) {
   int i = 0;
-  for(; i < EXT2_N_BLOCKS-3 ; i++) {
-    if(i_block[i] != 0) {
-      mark[i_block[i]] = 1;      
+  if(n == bs / INODE_SIZE) {
+    for(; i < bs / INODE_SIZE; i++) {
+      int links = ((const struct ext2_inode*) (table + i * INODE_SIZE))->i_links_count;
+      flags[i] = (links != 0 && mark[i] == 0) * LINK_UNREFERENCED
+               | (links != 0 && mark[i] != 0 && mark[i] != links) * LINK_COUNT_OFF;
     }
-    else
-      return;
+    return;
   }
+  for(; i < n; i++) {
+    int links = ((const struct ext2_inode*) (table + i * INODE_SIZE))->i_links_count;
+    flags[i] = (links != 0 && mark[i] == 0) * LINK_UNREFERENCED
+             | (links != 0 && mark[i] != 0 && mark[i] != links) * LINK_COUNT_OFF;
+  }
+}
 
+#define BLOCK_KERNELS(suffix, bs)                                                        \
+  static int dir_parse_##suffix(const unsigned char* block, __u16* offsets) {           \
+    return dir_parse_bs(block, offsets, bs);                                            \
+  }                                                                                     \
+  static int ind_mark_##suffix(const __u32* ptrs, struct block_map* map) {              \
+    return ind_mark_bs(ptrs, map, bs);                                                  \
+  }                                                                                     \
+  static int bitmap_diff_##suffix(unsigned char* bitmap, struct block_map* map,         \
+                                  int nbits, __u32 first_index) {                       \
+    return bitmap_diff_bs(bitmap, map, nbits, first_index, bs);                         \
+  }                                                                                     \
+  static void link_scan_##suffix(const unsigned char* table, const int* mark, int n,    \
+                                 unsigned char* flags) {                                \
+    link_scan_bs(table, mark, n, flags, bs);                                            \
+  }                                                                                     \
+  static const struct block_kernels kernels_##suffix = {                                \
+    dir_parse_##suffix, ind_mark_##suffix, bitmap_diff_##suffix, link_scan_##suffix     \
+  };
+
+BLOCK_KERNELS(1k, 1024)
+BLOCK_KERNELS(2k, 2048)
+BLOCK_KERNELS(4k, 4096)
+BLOCK_KERNELS(any, BLOCKSIZE)
+
+void select_kernels(int block_size) {
+  if(block_size == 1024)
+    kernels = &kernels_1k;
+  else if(block_size == 2048)
+    kernels = &kernels_2k;
+  else if(block_size == 4096)
+    kernels = &kernels_4k;
+  else
+    kernels = &kernels_any;
+}
 
 
-  // The 12th Block
-  if(i_block[12] != 0) {  
-    // printf("first:%d\n",i_block[12]);      
-    if(Traverse_i_block_indirect(i_block[12], parIndex, mark))
-      return;    
+/*
+ * Inode path index
+ *
+ * The directory walks record, for every inode they meet, the directory it
+ * was found in and its name: the first entry wins, later hard links are
+ * ignored.  Names are appended to one arena and each inode keeps the
+ * offset of its record, so an inode costs four bytes of a sparse array
+ * plus its name.  Paths are put together only for the inodes a report
+ * names, from memory, without reading the disk.  Records are added under
+ * a lock, the walks may run on several threads.
+ */
+
+#define PATH_ARENA_START      (64 << 10)
+#define PATH_MAX_DEPTH        256
+#define PATH_MAX_LEN          4096
+
+struct path_record {
+  __u32 parent;
+  __u8  name_len;
+  char  name[];
+};
+
+static struct {
+  __u32* offset;                // per inode, record offset + 1, 0 if not seen
+  size_t count;
+  char*  names;
+  size_t used;
+  size_t size;
+  pthread_mutex_t lock;
+} path_index = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void path_index_open(int inodes_count) {
+  path_index.count = (size_t) inodes_count + 1;
+  path_index.offset = (__u32*) sparse_alloc(sizeof(__u32) * path_index.count);
+  path_index.names = NULL;
+  path_index.used = 0;
+  path_index.size = 0;
+}
+
+void path_index_close(void) {
+  if(path_index.offset != NULL)
+    sparse_free(path_index.offset, sizeof(__u32) * path_index.count);
+  free(path_index.names);
+  path_index.offset = NULL;
+  path_index.count = 0;
+  path_index.names = NULL;
+  path_index.used = 0;
+  path_index.size = 0;
+}
+
+static void path_record(__u32 inodeIndex, __u32 parent, const char* name, int name_len) {
+  if(path_index.offset == NULL || inodeIndex == 0 || inodeIndex >= path_index.count
+     || __atomic_load_n(&path_index.offset[inodeIndex], __ATOMIC_RELAXED) != 0)
+    return;
+  if(name_len == 0 || (name_len <= 2 && name[0] == '.' && (name_len == 1 || name[1] == '.')))
+    return;
+
+  pthread_mutex_lock(&path_index.lock);
+  if(path_index.offset[inodeIndex] != 0) {
+    pthread_mutex_unlock(&path_index.lock);
+    return;
+  }
+  size_t need = (sizeof(struct path_record) + name_len + 3) & ~(size_t) 3;
+  if(path_index.used + need > path_index.size) {
+    size_t size = path_index.size ? path_index.size * 2 : PATH_ARENA_START;
+    char* names = size > UINT32_MAX ? NULL : (char*) realloc(path_index.names, size);
+    // Offsets are 32 bits, stop recording rather than wrap
+    if(names == NULL) {
+      pthread_mutex_unlock(&path_index.lock);
+      return;
+    }
+    path_index.names = names;
+    path_index.size = size;
+  }
+
+  struct path_record* rec = (struct path_record*) (path_index.names + path_index.used);
+  rec->parent = parent;
+  rec->name_len = name_len;
+  memcpy(rec->name, name, name_len);
+  __atomic_store_n(&path_index.offset[inodeIndex], path_index.used + 1, __ATOMIC_RELAXED);
+  path_index.used += need;
+  pthread_mutex_unlock(&path_index.lock);
+}
+
+/*
+ * ", path: /a/b" for a report about the inode, "" if the walks did not
+ * see it.  A path whose upper part is unknown starts with "?/".  Returns a
+ * buffer of the calling thread.
+ */
+static const char* path_note(int inodeIndex) {
+  static __thread char buf[PATH_MAX_LEN + 16];
+  struct path_record* chain[PATH_MAX_DEPTH];
+  int depth = 0;
+  __u32 ino = inodeIndex;
+
+  if(path_index.offset == NULL || ino == 0 || ino >= path_index.count)
+    return "";
+  if(ino == ROOT_INODE)
+    return ", path: /";
+
+  while(ino != ROOT_INODE && depth < PATH_MAX_DEPTH && ino < path_index.count && path_index.offset[ino] != 0) {
+    chain[depth] = (struct path_record*) (path_index.names + path_index.offset[ino] - 1);
+    ino = chain[depth++]->parent;
+  }
+  if(depth == 0)
+    return "";
+
+  int len = sprintf(buf, ", path: %s", ino == ROOT_INODE ? "" : "?");
+  while(depth-- > 0) {
+    if(len + 1 + chain[depth]->name_len >= (int) sizeof(buf))
+      break;
+    buf[len++] = '/';
+    memcpy(buf + len, chain[depth]->name, chain[depth]->name_len);
+    len += chain[depth]->name_len;
+  }
+  buf[len] = 0;
+  return buf;
+}
+
+
+/*
+ * Check one index node of a hashed directory and everything below it.
+ * Names in the leaves under entry i must hash into [hash i, hash i+1), or
+ * up to hash i+1 inclusive when the next leaf continues a collision.
+ * Returns what is wrong, NULL if nothing.
+ */
+static const char* htree_check_node(struct dir_stream* stream, struct dx_entry* entries, int limit,
+                                    __u32 lo, __u32 hi, int hi_inclusive, int levels_left,
+                                    int version, __u32* seed, unsigned char* seen, __u32 blocks) {
+  struct dx_countlimit* countlimit = (struct dx_countlimit*) entries;
+  int count = countlimit->count;
+  const char* problem = NULL;
+
+  if(countlimit->limit != limit || count == 0 || count > limit)
+    return "bad entry count";
+
+  int i = 0;
+  for(; i < count && problem == NULL; i++) {
+    __u32 child_lo = i == 0 ? lo : entries[i].hash & ~1;
+    __u32 child_hi = hi;
+    int inclusive = hi_inclusive;
+    __u32 block = entries[i].block & DX_BLOCK_MASK;
+
+    if(i > 0 && (child_lo < lo || child_lo > hi || (i > 1 && entries[i].hash < entries[i-1].hash)))
+      return "hashes out of order";
+    if(i + 1 < count) {
+      child_hi = entries[i+1].hash & ~1;
+      inclusive = entries[i+1].hash & 1;
+    }
+    if(block == 0 || block >= blocks)
+      return "block out of range";
+    if(seen[block])
+      return "block referenced twice";
+    seen[block] = 1;
+
+    if(!dir_stream_read(stream, block))
+      return "block out of range";
+
+    if(levels_left > 0) {
+      struct ext2_dir_entry_2* fake = (struct ext2_dir_entry_2*) stream->data;
+      if(fake->inode != 0 || fake->rec_len != BLOCKSIZE)
+        return "bad index node";
+      unsigned char* node = get_block_buf();
+      memcpy(node, stream->data, BLOCKSIZE);
+      problem = htree_check_node(stream, (struct dx_entry*) (node + DX_NODE_ENTRIES_OFFSET),
+                                 (BLOCKSIZE - DX_NODE_ENTRIES_OFFSET) / sizeof(struct dx_entry),
+                                 child_lo, child_hi, inclusive, levels_left - 1, version, seed, seen, blocks);
+      put_block_buf(node);
+      continue;
+    }
+
+    int len = 0;
+    while(len < BLOCKSIZE) {
+      struct ext2_dir_entry_2* dir = (struct ext2_dir_entry_2*) (stream->data + len);
+      if(dir->rec_len < 8 || len + dir->rec_len > BLOCKSIZE)
+        return "bad leaf entry";
+      if(dir->inode != 0) {
+        __u32 hash = ext2_dirhash(dir->name, dir->name_len, version, seed);
+        if(hash < child_lo || hash > child_hi || (hash == child_hi && !inclusive))
+          return "name outside its hash range";
+      }
+      len += dir->rec_len;
+    }
+  }
+  return problem;
+}
+
+/*
+ * Validate the index of a hashed directory: the root and node headers, the
+ * hash order, every block referenced once and every name in the hash range
+ * of its leaf.  A bad index is dropped by clearing EXT2_INDEX_FL, the
+ * blocks still form a valid linear directory.
+ */
+void htree_check(int inodeIndex, int parIndex) {
+  struct ext2_inode inode = Get_Inode(inodeIndex, parIndex);
+
+  if(!dir_is_indexed(&inode, parIndex))
+    return;
+
+  struct ext2_super_block super = get_superblock(parIndex);
+  struct dir_stream stream;
+  const char* problem = NULL;
+  __u32 blocks = inode.i_size / BLOCKSIZE;
+  unsigned char* seen = (unsigned char*) calloc(blocks + 1, 1);
+  unsigned char* root = get_block_buf();
+
+  dir_stream_open(&stream, inode.i_block, parIndex);
+  if(!dir_stream_read(&stream, 0)) {
+    problem = "no root block";
+  } else {
+    memcpy(root, stream.data, BLOCKSIZE);
+    struct dx_root_info* info = (struct dx_root_info*) (root + DX_ROOT_INFO_OFFSET);
+    int entries_offset = DX_ROOT_INFO_OFFSET + sizeof(struct dx_root_info);
+
+    if(info->reserved_zero != 0 || info->info_length != sizeof(struct dx_root_info))
+      problem = "bad root info";
+    else if(info->hash_version > DX_HASH_TEA)
+      problem = "unknown hash version";
+    else if(info->indirect_levels >= DX_MAX_LEVELS)
+      problem = "too many levels";
+    else {
+      seen[0] = 1;
+      problem = htree_check_node(&stream, (struct dx_entry*) (root + entries_offset),
+                                 (BLOCKSIZE - entries_offset) / sizeof(struct dx_entry),
+                                 0, 0xffffffff, 1, info->indirect_levels,
+                                 dx_hash_version(&super, info->hash_version), SB_HASH_SEED(&super),
+                                 seen, blocks);
+    }
+  }
+
+  // Names in blocks the index does not reach are invisible to lookups
+  __u32 block = 1;
+  for(; problem == NULL && block < blocks; block++) {
+    if(seen[block] || !dir_stream_read(&stream, block))
+      continue;
+    int len = 0;
+    while(len < BLOCKSIZE && problem == NULL) {
+      struct ext2_dir_entry_2* dir = (struct ext2_dir_entry_2*) (stream.data + len);
+      if(dir->inode != 0)
+        problem = "unreferenced block in use";
+      if(dir->rec_len < 8)
+        break;
+      len += dir->rec_len;
+    }
+  }
+
+  if(problem != NULL) {
+    if(report(REPORT_HTREE_CLEARED, inodeIndex, inode.i_flags, inode.i_flags & ~EXT2_INDEX_FL))
+      printf("partition: %d, inode: %d, bad htree index: %s, index cleared%s\n", parIndex, inodeIndex, problem,
+             path_note(inodeIndex));
+    inode.i_flags &= ~EXT2_INDEX_FL;
+    Put_Inode(inodeIndex, parIndex, &inode);
+  }
+
+  dir_stream_close(&stream);
+  put_block_buf(root);
+  free(seen);
+}
+
+
+/*
+ * Directory tree walker
+ *
+ * With --threads above 1 the directory walks run as tasks on a pool of
+ * workers, one task per directory.  A worker keeps the tasks it creates in
+ * a deque of its own and runs the newest next, depth first in its own
+ * subtree; a worker out of tasks steals the oldest task of another, the
+ * biggest subtree that one has queued.  Inodes are claimed in an atomic
+ * bitset before they are queued, so none is visited twice, and the walk
+ * ends when no task is queued or running.
+ */
+
+#define WALK_MAX_THREADS      64
+#define WALK_DEQUE_START      256
+
+struct walk_task {
+  __u32 inode;
+  __u32 parent;
+};
+
+struct walk_worker {
+  pthread_t thread;
+  int    index;
+  pthread_mutex_t lock;
+  struct walk_task* task;       // ring of size tasks
+  size_t size;
+  size_t head;                  // oldest, where thieves take
+  size_t tail;                  // one past the newest, where the owner works
+};
+
+static struct {
+  int    parIndex;
+  void   (*visit)(struct walk_worker* w, struct walk_task task);
+  void*  arg;                   // for visit
+  __u64* visited;               // one bit per inode
+  size_t inodes;
+  size_t pending;               // tasks queued or running
+  int    workers;
+  struct walk_worker worker[WALK_MAX_THREADS];
+} walk;
+
+/* Claim an inode for the walk, returns 1 if nobody had. */
+static int walk_claim(__u32 inodeIndex) {
+  if(inodeIndex == 0 || inodeIndex >= walk.inodes)
+    return 0;
+  __u64 bit = (__u64) 1 << (inodeIndex % 64);
+  return !(__atomic_fetch_or(&walk.visited[inodeIndex / 64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+static void walk_push(struct walk_worker* w, __u32 inodeIndex, __u32 parent) {
+  __atomic_fetch_add(&walk.pending, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&w->lock);
+  if(w->tail - w->head == w->size) {
+    size_t size = w->size ? w->size * 2 : WALK_DEQUE_START;
+    struct walk_task* task = (struct walk_task*) malloc(sizeof(struct walk_task) * size);
+    if(task == NULL) {
+      perror("Could not grow a walk deque");
+      exit(-1);
+    }
+    size_t i = 0;
+    for(; w->head + i < w->tail; i++)
+      task[i] = w->task[(w->head + i) & (w->size - 1)];
+    free(w->task);
+    w->task = task;
+    w->size = size;
+    w->tail -= w->head;
+    w->head = 0;
+  }
+  w->task[w->tail & (w->size - 1)].inode = inodeIndex;
+  w->task[w->tail & (w->size - 1)].parent = parent;
+  w->tail++;
+  pthread_mutex_unlock(&w->lock);
+}
+
+static int walk_pop(struct walk_worker* w, struct walk_task* task) {
+  int found = 0;
+  pthread_mutex_lock(&w->lock);
+  if(w->tail != w->head) {
+    *task = w->task[--w->tail & (w->size - 1)];
+    found = 1;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return found;
+}
+
+static int walk_steal(struct walk_worker* w, struct walk_task* task) {
+  int i = 1;
+  for(; i < walk.workers; i++) {
+    struct walk_worker* victim = &walk.worker[(w->index + i) % walk.workers];
+    int found = 0;
+    pthread_mutex_lock(&victim->lock);
+    if(victim->tail != victim->head) {
+      *task = victim->task[victim->head++ & (victim->size - 1)];
+      found = 1;
+    }
+    pthread_mutex_unlock(&victim->lock);
+    if(found)
+      return 1;
+  }
+  return 0;
+}
+
+static void* walk_main(void* arg) {
+  struct walk_worker* w = (struct walk_worker*) arg;
+  struct walk_task task;
+
+  while(1) {
+    if(walk_pop(w, &task) || walk_steal(w, &task)) {
+      walk.visit(w, task);
+      __atomic_fetch_sub(&walk.pending, 1, __ATOMIC_SEQ_CST);
+    } else if(__atomic_load_n(&walk.pending, __ATOMIC_SEQ_CST) == 0) {
+      break;
+    } else {
+      sched_yield();
+    }
+  }
+  report_thread_flush();
+  return NULL;
+}
+
+/*
+ * Walk the tree under the root directory with visit, which claims and
+ * pushes the directories it finds.  arg is left in walk.arg for it.
+ */
+void walk_tree(int parIndex, int inodes_count, void (*visit)(struct walk_worker*, struct walk_task), void* arg) {
+  int t;
+
+  walk.parIndex = parIndex;
+  walk.visit = visit;
+  walk.arg = arg;
+  walk.inodes = (size_t) inodes_count + 1;
+  walk.visited = (__u64*) sparse_alloc(sizeof(__u64) * (walk.inodes / 64 + 1));
+  walk.pending = 0;
+  walk.workers = worker_threads < WALK_MAX_THREADS ? worker_threads : WALK_MAX_THREADS;
+  for(t = 0; t < walk.workers; t++) {
+    struct walk_worker* w = &walk.worker[t];
+    w->index = t;
+    pthread_mutex_init(&w->lock, NULL);
+    w->task = NULL;
+    w->size = w->head = w->tail = 0;
+  }
+
+  // The workers look inodes up in the descriptor table, load it first
+  Get_Group_Desc_Table(parIndex, NULL);
+
+  walk_claim(ROOT_INODE);
+  walk_push(&walk.worker[0], ROOT_INODE, ROOT_INODE);
+  for(t = 0; t < walk.workers; t++) {
+    if(pthread_create(&walk.worker[t].thread, NULL, walk_main, &walk.worker[t]) != 0) {
+      printf("Could not start a worker thread\n");
+      exit(-1);
+    }
+  }
+  for(t = 0; t < walk.workers; t++)
+    pthread_join(walk.worker[t].thread, NULL);
+  // Only now, idle workers steal until they see the walk end
+  for(t = 0; t < walk.workers; t++) {
+    pthread_mutex_destroy(&walk.worker[t].lock);
+    free(walk.worker[t].task);
+  }
+  sparse_free(walk.visited, sizeof(__u64) * (walk.inodes / 64 + 1));
+  walk.visited = NULL;
+}
+
+
+/* Check and fix the '.' and '..' entries at the start of a directory. */
+static void check_dot_entries(struct dir_stream* stream, const __u16* offsets, int curInode, int preInode,
+                              int parIndex) {
+  // The first entry should be '.'
+  struct ext2_dir_entry_2* dir = (struct ext2_dir_entry_2*) (stream->data + offsets[0]);
+  if(dir->inode != curInode || strcmp(dir->name, self_reference)) {
+    if(report(REPORT_SELF_REFERENCE, curInode, dir->inode, curInode))
+      printf("partition: %d, inode: %d, wrong self_reference: %d%s\n",parIndex, curInode, dir->inode,
+             path_note(curInode));
+    dir->inode = curInode;
+    dir_stream_write(stream);
+  }
+
+  // The second entry should be '..'
+  dir = (struct ext2_dir_entry_2*) (stream->data + offsets[1]);
+  if(dir->inode != preInode || strcmp(dir->name, parent_reference)) {
+    if(report(REPORT_PARENT_REFERENCE, curInode, dir->inode, preInode))
+      printf("partition: %d, inode: %d, prev inode: %d, wrong parent_reference: %d%s\n",parIndex, curInode, preInode,
+             dir->inode, path_note(curInode));
+    dir->inode = preInode;
+    dir_stream_write(stream);
+  }
+}
+
+void read_directory_recursive(__u32 i_block[], int curInode, int preInode, int parIndex, int* mark) {
+
+  struct        ext2_dir_entry_2* dir;
+  struct        dir_stream stream;
+  __u16         offsets[DIR_MAX_ENTRIES];
+
+  // Set this inode to be 1
+  mark[curInode] = 1;
+
+  htree_check(curInode, parIndex);
+
+  dir_stream_open(&stream, i_block, parIndex);
+  unsigned char* buf_dir = stream.data;
+
+  while(dir_stream_next(&stream)) {
+    int n = kernels->dir_parse(buf_dir, offsets);
+    int e = 0;
+    
+    if(stream.index == 0 && n >= 2) {
+      check_dot_entries(&stream, offsets, curInode, preInode, parIndex);
+      e = 2;
+    }     
+
+    while(e < n) {        
+      dir = (struct ext2_dir_entry_2*) (buf_dir+offsets[e++]);
+      path_record(dir->inode, curInode, dir->name, dir->name_len);
+      if(dir->inode != 0 && mark[dir->inode] != 1 && dir->file_type == 2) {
+        struct ext2_inode nextInode = Get_Inode(dir->inode, parIndex);      
+        read_directory_recursive(nextInode.i_block, dir->inode, curInode, parIndex, mark);
+      }
+    }
+  }
+  dir_stream_close(&stream);
+
+
+}
+
+/* read_directory_recursive as a walker task. */
+static void check_directory_visit(struct walk_worker* w, struct walk_task task) {
+  struct ext2_dir_entry_2* dir;
+  struct dir_stream stream;
+  __u16 offsets[DIR_MAX_ENTRIES];
+
+  htree_check(task.inode, walk.parIndex);
+
+  struct ext2_inode inode = Get_Inode(task.inode, walk.parIndex);
+  dir_stream_open(&stream, inode.i_block, walk.parIndex);
+
+  while(dir_stream_next(&stream)) {
+    int n = kernels->dir_parse(stream.data, offsets);
+    int e = 0;
+
+    if(stream.index == 0 && n >= 2) {
+      check_dot_entries(&stream, offsets, task.inode, task.parent, walk.parIndex);
+      e = 2;
+    }
+
+    while(e < n) {
+      dir = (struct ext2_dir_entry_2*) (stream.data + offsets[e++]);
+      path_record(dir->inode, task.inode, dir->name, dir->name_len);
+      if(dir->file_type == 2 && walk_claim(dir->inode))
+        walk_push(w, dir->inode, task.inode);
+    }
+  }
+  dir_stream_close(&stream);
+}
+
+void read_inode_recursive(__u32 i_block[], int curInode, int parIndex, int* mark) {
+  
+  struct        ext2_dir_entry_2* dir;
+  struct        dir_stream stream;
+  __u16         offsets[DIR_MAX_ENTRIES];
+  // mark increament one  
+  
+  dir_stream_open(&stream, i_block, parIndex);
+  unsigned char* buf_dir = stream.data;
+
+  while(dir_stream_next(&stream)) {
+    int n = kernels->dir_parse(buf_dir, offsets);
+    int e = 0;
+    
+    if(stream.index == 0 && n >= 2) {
+      // The first entry should be '.'
+      dir = (struct ext2_dir_entry_2*) (buf_dir+offsets[e++]);
+      mark[dir->inode]++;
+
+      // The second entry should be '..'
+      dir = (struct ext2_dir_entry_2*) (buf_dir+offsets[e++]);
+      mark[dir->inode]++;
+    }     
+
+    while(e < n) {        
+      dir = (struct ext2_dir_entry_2*) (buf_dir+offsets[e++]);
+      path_record(dir->inode, curInode, dir->name, dir->name_len);
+      if(dir->file_type == 2) {
+        if(mark[dir->inode] == 0) {            
+          // Recursion
+          mark[dir->inode]++;        
+          struct ext2_inode nextInode = Get_Inode(dir->inode, parIndex);      
+          read_inode_recursive(nextInode.i_block, dir->inode, parIndex, mark);
+        } else
+          mark[dir->inode]++;
+      } else {
+        mark[dir->inode]++;
+      }
+
+    }
+  }
+  dir_stream_close(&stream);
+
+}
+
+
+/*
+ * Parallel link counting
+ *
+ * With --threads above 1 passes 2 and 3 count the entries naming each
+ * inode with the tree walker.  Each worker counts into a counter array of
+ * its own.  After the walk the arrays are added into the mark array, each
+ * worker a range of pages, vectors at a time, skipping pages no worker
+ * touched.
+ *
+ * The counts match read_inode_recursive except on trees where an entry
+ * that is not a directory names a directory inode; the serial walk then
+ * skips the directory, here it is reached by its directory entry.
+ */
+
+#define LINK_PAGE_INODES      (4096 / sizeof(int))
+
+typedef int link_vec __attribute__((vector_size(32)));
+
+struct link_counter {
+  pthread_t thread;
+  int*   count;                 // sparse, one counter per inode
+  unsigned char* touched;       // per LINK_PAGE_INODES counters
+};
+
+static struct {
+  size_t inodes;                // counters per array, inodes + 1
+  size_t pages;
+  int*   mark;
+  size_t mark_count;
+  int    counters;
+  struct link_counter counter[WALK_MAX_THREADS];
+} link_count;
+
+static void link_count_add(struct link_counter* c, __u32 inodeIndex) {
+  if(inodeIndex >= link_count.inodes)
+    return;
+  c->count[inodeIndex]++;
+  c->touched[inodeIndex / LINK_PAGE_INODES] = 1;
+}
+
+/* read_inode_recursive as a walker task. */
+static void link_count_visit(struct walk_worker* w, struct walk_task task) {
+  struct link_counter* c = &link_count.counter[w->index];
+  struct ext2_dir_entry_2* dir;
+  struct dir_stream stream;
+  __u16 offsets[DIR_MAX_ENTRIES];
+  struct ext2_inode inode = Get_Inode(task.inode, walk.parIndex);
+
+  dir_stream_open(&stream, inode.i_block, walk.parIndex);
+  unsigned char* buf_dir = stream.data;
+
+  while(dir_stream_next(&stream)) {
+    int n = kernels->dir_parse(buf_dir, offsets);
+    int e = 0;
+
+    // '.' and '..'
+    if(stream.index == 0 && n >= 2) {
+      link_count_add(c, ((struct ext2_dir_entry_2*) (buf_dir + offsets[e++]))->inode);
+      link_count_add(c, ((struct ext2_dir_entry_2*) (buf_dir + offsets[e++]))->inode);
+    }
+
+    while(e < n) {
+      dir = (struct ext2_dir_entry_2*) (buf_dir + offsets[e++]);
+      path_record(dir->inode, task.inode, dir->name, dir->name_len);
+      link_count_add(c, dir->inode);
+      if(dir->file_type == 2 && walk_claim(dir->inode))
+        walk_push(w, dir->inode, task.inode);
+    }
+  }
+  dir_stream_close(&stream);
+}
+
+/* Add the counter arrays into the mark array, pages [first, last). */
+static void link_count_merge_pages(size_t first, size_t last) {
+  size_t page = first;
+  for(; page < last; page++) {
+    size_t base = page * LINK_PAGE_INODES;
+    size_t n = link_count.mark_count - base < LINK_PAGE_INODES ? link_count.mark_count - base : LINK_PAGE_INODES;
+    int t = 0;
+    for(; t < link_count.counters; t++) {
+      struct link_counter* c = &link_count.counter[t];
+      if(!c->touched[page])
+        continue;
+      int* dst = link_count.mark + base;
+      const int* src = c->count + base;
+      size_t i = 0;
+      for(; i + sizeof(link_vec) / sizeof(int) <= n; i += sizeof(link_vec) / sizeof(int)) {
+        link_vec a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a += b;
+        memcpy(dst + i, &a, sizeof(a));
+      }
+      for(; i < n; i++)
+        dst[i] += src[i];
+    }
+  }
+}
+
+static void* link_count_merge(void* arg) {
+  size_t t = (struct link_counter*) arg - link_count.counter;
+  size_t per = (link_count.pages + link_count.counters - 1) / link_count.counters;
+  size_t first = t * per;
+  size_t last = first + per < link_count.pages ? first + per : link_count.pages;
+  if(first < last)
+    link_count_merge_pages(first, last);
+  return NULL;
+}
+
+static void link_count_parallel(int parIndex, int* mark, int count) {
+  int t;
+
+  link_count.inodes = (size_t) count + 1;
+  link_count.mark = mark;
+  link_count.mark_count = count;
+  link_count.pages = (count + LINK_PAGE_INODES - 1) / LINK_PAGE_INODES;
+  link_count.counters = worker_threads < WALK_MAX_THREADS ? worker_threads : WALK_MAX_THREADS;
+  for(t = 0; t < link_count.counters; t++) {
+    struct link_counter* c = &link_count.counter[t];
+    c->count = (int*) sparse_alloc(sizeof(int) * link_count.inodes);
+    c->touched = (unsigned char*) calloc(link_count.pages + 1, 1);
+  }
+
+  walk_tree(parIndex, count, link_count_visit, NULL);
+
+  for(t = 0; t < link_count.counters; t++) {
+    if(pthread_create(&link_count.counter[t].thread, NULL, link_count_merge, &link_count.counter[t]) != 0) {
+      printf("Could not start a worker thread\n");
+      exit(-1);
+    }
+  }
+  // Every merge range reads every array, free them after the last one
+  for(t = 0; t < link_count.counters; t++)
+    pthread_join(link_count.counter[t].thread, NULL);
+  for(t = 0; t < link_count.counters; t++) {
+    sparse_free(link_count.counter[t].count, sizeof(int) * link_count.inodes);
+    free(link_count.counter[t].touched);
+  }
+}
+
+/*
+ * Asynchronous tree walks
+ *
+ * With --async N the link counting of passes 2 and 3 and the block
+ * marking of pass 4 keep up to N inode walks going at once on the main
+ * thread.  An async_walk is the loop of read_inode_recursive or
+ * Traverse_i_block turned inside out: its state and its place in the
+ * block map live in the struct.  Where the loop would read a block, the
+ * walk submits the read to an io_queue and returns; async_walk_tree
+ * resumes it from the same state once the read completes, the block then
+ * being in the cache.  A block the cache holds is read without returning.
+ * Inodes are claimed in the walker's bitset as with --threads, and wait on
+ * a stack, newest first, until a walk is free.
+ */
+
+#define ASYNC_MAX_WALKS       65536
+
+/* async_walk.state */
+#define ASYNC_INODE           0           /* reading the inode */
+#define ASYNC_MAP             1           /* finding the next block, reading pointer blocks */
+#define ASYNC_DATA            2           /* reading a directory block */
+#define ASYNC_DONE            3
+
+struct async_walk {
+  struct io_request io;         // io.owner is the walk
+  int64_t fetched;              // sector io completed, read it without submitting
+  int    state;
+  struct walk_task task;
+  int    directory;             // read the data blocks, not only map them
+  __u32  i_block[EXT2_N_BLOCKS];
+  __u64  next;                  // logical block to visit next
+  __u32  block;                 // its physical block in ASYNC_DATA
+  __u32  ptr_block[3];          // pointer blocks held by depth, 0 if none
+  unsigned char* ptr[3];
+  unsigned char* data;
+  struct frag_track frag;       // the walk's extents with --frag-report
+};
+
+static struct {
+  struct io_queue queue;
+  struct async_walk* walks;
+  struct async_walk** idle;
+  int    idle_count;
+  struct walk_task* waiting;    // claimed, without a walk yet
+  int*   waiting_directory;
+  size_t waiting_count;
+  size_t waiting_size;
+  void   (*block)(struct async_walk* a, __u32 block);  // every block of a walked inode
+  void   (*entries)(struct async_walk* a, int index);  // every directory block
+} async;
+
+static void async_push(__u32 inodeIndex, __u32 parent, int directory) {
+  if(async.waiting_count == async.waiting_size) {
+    async.waiting_size = async.waiting_size ? async.waiting_size * 2 : WALK_DEQUE_START;
+    async.waiting = (struct walk_task*) realloc(async.waiting, sizeof(struct walk_task) * async.waiting_size);
+    async.waiting_directory = (int*) realloc(async.waiting_directory, sizeof(int) * async.waiting_size);
+    if(async.waiting == NULL || async.waiting_directory == NULL) {
+      perror("Could not grow the async walk stack");
+      exit(-1);
+    }
+  }
+  async.waiting[async.waiting_count].inode = inodeIndex;
+  async.waiting[async.waiting_count].parent = parent;
+  async.waiting_directory[async.waiting_count++] = directory;
+}
+
+/*
+ * Whether the walk can read sectors now.  If not the read is submitted and
+ * the walk has to return; it is resumed when the read completes and may
+ * then read them whether they are still cached or not.
+ */
+static int async_ready(struct async_walk* a, int64_t sector, unsigned int sectors) {
+  if(a->fetched == sector) {
+    a->fetched = -1;
+    return 1;
+  }
+  a->io.start = sector;
+  a->io.sectors = sectors;
+  return !io_submit(&async.queue, &a->io);
+}
+
+/* Physical block of logical block a->next, 0 past the end, -1 while a pointer block is read. */
+static int64_t async_map(struct async_walk* a) {
+  uint64_t per_block = BLOCKSIZE / sizeof(__u32);
+  uint64_t index = a->next;
+  uint64_t span = 1;
+  __u32 block;
+  int depth;
+
+  if(index < EXT2_NDIR_BLOCKS)
+    return a->i_block[index];
+
+  index -= EXT2_NDIR_BLOCKS;
+  for(depth = 1; depth <= 3; depth++) {
+    span *= per_block;
+    if(index < span)
+      break;
+    index -= span;
+  }
+  if(depth > 3)
+    return 0;
+
+  block = a->i_block[EXT2_IND_BLOCK + depth - 1];
+  int level = 0;
+  for(; level < depth && block != 0; level++) {
+    span /= per_block;
+    if(a->ptr_block[level] != block) {
+      if(!async_ready(a, block_sector(walk.parIndex, block), BLOCK_SECTOR_RATIO))
+        return -1;
+      if(a->ptr[level] == NULL)
+        a->ptr[level] = get_block_buf();
+      read_sectors(block_sector(walk.parIndex, block), BLOCK_SECTOR_RATIO, a->ptr[level]);
+      a->ptr_block[level] = block;
+      if(async.block != NULL)
+        async.block(a, block);
+    }
+    block = ((__u32*) a->ptr[level])[index / span % per_block];
+  }
+  return block;
+}
+
+/* Run the walk until it has to wait for a read or is done. */
+static void async_step(struct async_walk* a) {
+  while(1) {
+    switch(a->state) {
+    case ASYNC_INODE: {
+      struct inode_location location = Get_Inode_Location(a->task.inode, walk.parIndex);
+      if(!async_ready(a, location.sect_num, 1))
+        return;
+      struct ext2_inode inode = Get_Inode(a->task.inode, walk.parIndex);
+      memcpy(a->i_block, inode.i_block, sizeof(a->i_block));
+      a->state = ASYNC_MAP;
+      break;
+    }
+
+    case ASYNC_MAP: {
+      int64_t block = async_map(a);
+      if(block < 0)
+        return;
+      if(block == 0) {
+        a->state = ASYNC_DONE;
+        return;
+      }
+      if(async.block != NULL)
+        async.block(a, block);
+      if(a->directory) {
+        a->block = block;
+        a->state = ASYNC_DATA;
+      } else {
+        a->next++;
+      }
+      break;
+    }
+
+    case ASYNC_DATA:
+      if(!async_ready(a, block_sector(walk.parIndex, a->block), BLOCK_SECTOR_RATIO))
+        return;
+      if(a->data == NULL)
+        a->data = get_block_buf();
+      read_sectors(block_sector(walk.parIndex, a->block), BLOCK_SECTOR_RATIO, a->data);
+      async.entries(a, a->next++);
+      a->state = ASYNC_MAP;
+      break;
+
+    default:
+      return;
+    }
+  }
+}
+
+/* Give the walk's buffers back and make it idle. */
+static void async_finish(struct async_walk* a) {
+  int level = 0;
+  for(; level < 3; level++) {
+    if(a->ptr[level] != NULL)
+      put_block_buf(a->ptr[level]);
+  }
+  if(a->data != NULL)
+    put_block_buf(a->data);
+  if(async.block != NULL)
+    frag_file_done(&a->frag, a->task.inode);
+  async.idle[async.idle_count++] = a;
+}
+
+/*
+ * Walk the tree under the root directory with the async walks.  entries
+ * gets every directory block and pushes what it finds, block (if not NULL)
+ * every block of every walked inode.  arg is left in walk.arg for them.
+ */
+static void async_walk_tree(int parIndex, int inodes_count, void (*entries)(struct async_walk*, int),
+                            void (*block)(struct async_walk*, __u32), void* arg) {
+  int limit = async_walks < ASYNC_MAX_WALKS ? async_walks : ASYNC_MAX_WALKS;
+
+  walk.parIndex = parIndex;
+  walk.inodes = (size_t) inodes_count + 1;
+  walk.visited = (__u64*) sparse_alloc(sizeof(__u64) * (walk.inodes / 64 + 1));
+  async.entries = entries;
+  async.block = block;
+  walk.arg = arg;
+  async.walks = (struct async_walk*) malloc(sizeof(struct async_walk) * limit);
+  async.idle = (struct async_walk**) malloc(sizeof(struct async_walk*) * limit);
+  if(async.walks == NULL || async.idle == NULL) {
+    perror("Could not allocate the async walks");
+    exit(-1);
+  }
+  for(async.idle_count = 0; async.idle_count < limit; async.idle_count++)
+    async.idle[async.idle_count] = &async.walks[limit - 1 - async.idle_count];
+
+  Get_Group_Desc_Table(parIndex, NULL);
+  io_queue_open(&async.queue, IO_QUEUE_THREADS);
+
+  walk_claim(ROOT_INODE);
+  async_push(ROOT_INODE, ROOT_INODE, 1);
+  while(1) {
+    // An idle walk for every waiting inode, as far as they go
+    while(async.idle_count > 0 && async.waiting_count > 0) {
+      struct async_walk* a = async.idle[--async.idle_count];
+      async.waiting_count--;
+      memset(a, 0, sizeof(*a));
+      a->io.owner = a;
+      a->fetched = -1;
+      a->task = async.waiting[async.waiting_count];
+      a->directory = async.waiting_directory[async.waiting_count];
+      async_step(a);
+      if(a->state == ASYNC_DONE)
+        async_finish(a);
+    }
+
+    // No read outstanding means every walk is idle and none is waiting
+    struct io_request* r = io_wait(&async.queue);
+    if(r == NULL)
+      break;
+    struct async_walk* a = (struct async_walk*) r->owner;
+    a->fetched = r->start;
+    async_step(a);
+    if(a->state == ASYNC_DONE)
+      async_finish(a);
+  }
+
+  io_queue_close(&async.queue);
+  if(show_stats)
+    printf("partition: %d, async walks: %ld reads submitted, %ld cached, %ld in flight at most\n", parIndex,
+           async.queue.requests, async.queue.cached, async.queue.most);
+
+  free(async.walks);
+  free(async.idle);
+  free(async.waiting);
+  free(async.waiting_directory);
+  async.waiting = NULL;
+  async.waiting_directory = NULL;
+  async.waiting_count = async.waiting_size = 0;
+  sparse_free(walk.visited, sizeof(__u64) * (walk.inodes / 64 + 1));
+  walk.visited = NULL;
+}
+
+/* link_count_visit for an async walk, walk.arg is the mark taking the counts. */
+static void async_count_links(struct async_walk* a, int index) {
+  struct ext2_dir_entry_2* dir;
+  __u16 offsets[DIR_MAX_ENTRIES];
+  int n = kernels->dir_parse(a->data, offsets);
+  int e = 0;
+
+  for(; e < n; e++) {
+    dir = (struct ext2_dir_entry_2*) (a->data + offsets[e]);
+    // The mark has an entry per inode but the last, as in passes 2 and 3
+    if(dir->inode < walk.inodes - 1)
+      ((int*) walk.arg)[dir->inode]++;
+    // '.' and '..' name nothing new
+    if(index == 0 && n >= 2 && e < 2)
+      continue;
+    path_record(dir->inode, a->task.inode, dir->name, dir->name_len);
+    if(dir->file_type == 2 && walk_claim(dir->inode))
+      async_push(dir->inode, a->task.inode, 1);
+  }
+}
+
+/* mark_blocks_visit for an async walk, files are walked for their blocks. */
+static void async_mark_entries(struct async_walk* a, int index) {
+  struct ext2_dir_entry_2* dir;
+  __u16 offsets[DIR_MAX_ENTRIES];
+  int n = kernels->dir_parse(a->data, offsets);
+  int e = index == 0 && n >= 2 ? 2 : 0;
+
+  for(; e < n; e++) {
+    dir = (struct ext2_dir_entry_2*) (a->data + offsets[e]);
+    if(dir->file_type == 2) {
+      if(walk_claim(dir->inode))
+        async_push(dir->inode, a->task.inode, 1);
+    } else if(dir->inode != 0 && dir->file_type != 7 && walk_claim(dir->inode)) {
+      async_push(dir->inode, a->task.inode, 0);
+    }
+  }
+}
+
+static void async_mark_block(struct async_walk* a, __u32 block) {
+  bmap_set_range((struct block_map*) walk.arg, block, 1);
+  if(frag.file != NULL)
+    frag_note(&a->frag, block, 1);
+}
+
+/* Count the directory entries naming each inode into the zeroed mark. */
+void link_count_tree(int parIndex, int* mark, int count) {
+  if(async_walks > 0) {
+    async_walk_tree(parIndex, count, async_count_links, NULL, mark);
+    return;
+  }
+  if(worker_threads > 1) {
+    link_count_parallel(parIndex, mark, count);
+    return;
+  }
+  struct ext2_inode root_inode = Get_Root_Inode(parIndex);
+  read_inode_recursive(root_inode.i_block, ROOT_INODE, parIndex, mark);
+}
+
+// int Traverse_i_block_indirect(int blockIndex, int parIndex, int* mark, int block_count) {
+int Traverse_i_block_indirect(__u32 blockIndex, int parIndex, struct block_map* map) {
+  // block_count--;
+  file_claim(map, blockIndex, 1);
+  unsigned char* buf_dir = get_block_buf();
+  read_sectors(block_sector(parIndex, blockIndex), BLOCK_SECTOR_RATIO, buf_dir);
+  int ret = kernels->ind_mark((__u32*) buf_dir, map);
+
+  put_block_buf(buf_dir);
+  return ret;
+}
+// int Traverse_i_block_doubly_indirect(int blockIndex, int parIndex, int* mark, int block_count) {
+int Traverse_i_block_doubly_indirect(__u32 blockIndex, int parIndex, struct block_map* map) {  
+  file_claim(map, blockIndex, 1);
+  unsigned char* buf_dir = get_block_buf();
+  read_sectors(block_sector(parIndex, blockIndex), BLOCK_SECTOR_RATIO, buf_dir);
+  __u32* ptr = (__u32*) buf_dir;
+  int i = 0;
+  int total = BLOCKSIZE / sizeof(__u32);
+  int ret = 0;
+  while(i != total) {
+    if(ptr[i] == 0 || Traverse_i_block_indirect(ptr[i], parIndex, map)) {
+      ret = 1;
+      break;
+    }
+    i++;
+  }
+  put_block_buf(buf_dir);
+  return ret;  
+
+}
+
+int Traverse_i_block_triply_indirect(__u32 blockIndex, int parIndex, struct block_map* map) {
+// int Traverse_i_block_triply_indirect(int blockIndex, int parIndex, int* mark, int block_count) {
+  
+  file_claim(map, blockIndex, 1);
+  unsigned char* buf_dir = get_block_buf();
+  read_sectors(block_sector(parIndex, blockIndex), BLOCK_SECTOR_RATIO, buf_dir);
+  __u32* ptr = (__u32*) buf_dir;
+  int i = 0;
+  int total = BLOCKSIZE / sizeof(__u32);
+  int ret = 0;
+  while(i != total) {
+    if(ptr[i] == 0 || Traverse_i_block_doubly_indirect(ptr[i], parIndex, map)) {
+      ret = 1;
+      break;
+    }
+    i++;
+  }
+  put_block_buf(buf_dir);
+  return ret; 
+
+}
+
+// void Traverse_i_block(__u32 i_block[], int parIndex, int* mark, int block_count) {
+void Traverse_i_block(__u32 i_block[], int parIndex, struct block_map* map) {
+
+  // The direct blocks, a run of consecutive ones at a time
+  int i = 0;
+  while(i < EXT2_N_BLOCKS-3) {
+    if(i_block[i] == 0)
+      return;
+    int run = 1;
+    while(i + run < EXT2_N_BLOCKS-3 && i_block[i + run] == i_block[i] + run)
+      run++;
+    file_claim(map, i_block[i], run);
+    i += run;
+  }
+
+
+
+  // The 12th Block
+  if(i_block[12] != 0) {  
+    // printf("first:%d\n",i_block[12]);      
+    if(Traverse_i_block_indirect(i_block[12], parIndex, map))
+      return;    
   } else
     return;
 
   // The 13th Block
   if(i_block[13] != 0) { 
     // printf("second:%d\n",i_block[13]);        
-    if(Traverse_i_block_doubly_indirect(i_block[13], parIndex, mark))
+    if(Traverse_i_block_doubly_indirect(i_block[13], parIndex, map))
       return;
   } else
     return;
@@ -534,66 +2142,64 @@ void Traverse_i_block(__u32 i_block[], int parIndex, int* mark) {
   // The 14th Block
   if(i_block[14] != 0) {    
     // printf("third:%d\n",i_block[14]);      
-    if(Traverse_i_block_triply_indirect(i_block[14], parIndex, mark))
+    if(Traverse_i_block_triply_indirect(i_block[14], parIndex, map))
       return;    
   } else
     return;        
 
 }
 
-void read_block_recursive(__u32 i_block[], int parIndex, int* mark, int* visited) {
+void read_block_recursive(__u32 i_block[], int curInode, int parIndex, struct block_map* map, int* visited) {
   
   struct        ext2_dir_entry_2* dir;
-  unsigned char buf_dir[BLOCKSIZE];
-  
-  int i = 0;
-  for(; i < EXT2_N_BLOCKS-3; i++) {
-    if(i_block[i] != 0) {
+  struct        dir_stream stream;
+  __u16         offsets[DIR_MAX_ENTRIES];
+
+  // Mark the blocks of this directory, pointer blocks included, as allocated
+  Traverse_i_block(i_block, parIndex, map);
+  frag_file_done(&frag_local, curInode);
 
-      // Mark this block as allocated
-      mark[i_block[i]] = 1;
+  dir_stream_open(&stream, i_block, parIndex);
+  unsigned char* buf_dir = stream.data;
 
-      read_sectors(parArray[parIndex-1].start_sect + i_block[i]* BLOCK_SECTOR_RATIO, BLOCK_SECTOR_RATIO, buf_dir);
-      int len = 0;
+  while(dir_stream_next(&stream)) {
+    int n = kernels->dir_parse(buf_dir, offsets);
+    int e = 0;
+    
+    if(stream.index == 0 && n >= 2) {
+      // The first entry should be '.'
+      dir = (struct ext2_dir_entry_2*) (buf_dir+offsets[e++]);
       
-      if(i == 0) {
-        // The first entry should be '.'
-        dir = (struct ext2_dir_entry_2*) (buf_dir+len);
-        
-        len += dir->rec_len;
-
-        // The second entry should be '..'
-        dir = (struct ext2_dir_entry_2*) (buf_dir+len);
-        
-        len += dir->rec_len; 
-      }     
-
-      while(len < BLOCKSIZE) {        
-        dir = (struct ext2_dir_entry_2*) (buf_dir+len);
-        if(dir->file_type == 2) {
-          if(visited[dir->inode] != 1) {                    
-            // Set this directory visited
-            visited[dir->inode] = 1;        
-            // Recursion
-            struct ext2_inode nextInode = Get_Inode(dir->inode, parIndex);      
-            read_block_recursive(nextInode.i_block, parIndex, mark, visited);
-          } 
-        } else {
-          if(dir->file_type != 7) {
-            // Traverse the i_block of this non-directory file  
-            struct ext2_inode nextInode = Get_Inode(dir->inode, parIndex);   
-            // int block_count = (nextInode.i_size + BLOCKSIZE - 1) / BLOCKSIZE;
-            // Traverse_i_block(nextInode.i_block, parIndex, mark, block_count);
-            Traverse_i_block(nextInode.i_block, parIndex, mark);
-          }
-        }
 
-        len += dir->rec_len;        
+      // The second entry should be '..'
+      dir = (struct ext2_dir_entry_2*) (buf_dir+offsets[e++]);
+      
+    }     
+
+    while(e < n) {        
+      dir = (struct ext2_dir_entry_2*) (buf_dir+offsets[e++]);
+      if(dir->file_type == 2) {
+        if(visited[dir->inode] != 1) {                    
+          // Set this directory visited
+          visited[dir->inode] = 1;        
+          // Recursion
+          struct ext2_inode nextInode = Get_Inode(dir->inode, parIndex);      
+          read_block_recursive(nextInode.i_block, dir->inode, parIndex, map, visited);
+        } 
+      } else {
+        if(dir->inode != 0 && dir->file_type != 7) {
+          // Traverse the i_block of this non-directory file  
+          struct ext2_inode nextInode = Get_Inode(dir->inode, parIndex);   
+          // int block_count = (nextInode.i_size + BLOCKSIZE - 1) / BLOCKSIZE;
+          // Traverse_i_block(nextInode.i_block, parIndex, mark, block_count);
+          Traverse_i_block(nextInode.i_block, parIndex, map);
+          frag_file_done(&frag_local, dir->inode);
+        }
       }
-    } else {      
-      return;            
+
     }
   }
+  dir_stream_close(&stream);
   // printf("!!!!!!!!!!!!!!\n");
   // printf("%d\n",i_block[11]);
   // printf("%d\n",i_block[12]);
@@ -609,38 +2215,95 @@ void read_block_recursive(__u32 i_block[], int parIndex, int* mark, int* visited
 
 }
 
+/*
+ * read_block_recursive as a walker task, walk.arg is the block map.
+ * Files are claimed like directories, a file with several links is
+ * traversed once.
+ */
+static void mark_blocks_visit(struct walk_worker* w, struct walk_task task) {
+  struct block_map* map = (struct block_map*) walk.arg;
+  struct ext2_dir_entry_2* dir;
+  struct dir_stream stream;
+  __u16 offsets[DIR_MAX_ENTRIES];
+  struct ext2_inode inode = Get_Inode(task.inode, walk.parIndex);
+
+  Traverse_i_block(inode.i_block, walk.parIndex, map);
+  frag_file_done(&frag_local, task.inode);
+
+  dir_stream_open(&stream, inode.i_block, walk.parIndex);
+  while(dir_stream_next(&stream)) {
+    int n = kernels->dir_parse(stream.data, offsets);
+    int e = stream.index == 0 && n >= 2 ? 2 : 0;
+
+    while(e < n) {
+      dir = (struct ext2_dir_entry_2*) (stream.data + offsets[e++]);
+      if(dir->file_type == 2) {
+        if(walk_claim(dir->inode))
+          walk_push(w, dir->inode, task.inode);
+      } else if(dir->inode != 0 && dir->file_type != 7 && walk_claim(dir->inode)) {
+        struct ext2_inode file = Get_Inode(dir->inode, walk.parIndex);
+        Traverse_i_block(file.i_block, walk.parIndex, map);
+        frag_file_done(&frag_local, dir->inode);
+      }
+    }
+  }
+  dir_stream_close(&stream);
+}
+
 
 
 
 struct ext2_inode Get_Lost_Found_Inode(int parIndex) {
   struct ext2_inode root_inode = Get_Root_Inode(parIndex);
-  struct ext2_dir_entry_2* dir;
-  unsigned char buf_dir[BLOCKSIZE];
+  struct ext2_inode lostfound_inode;
   // unsigned char lost_dir[BLOCKSIZE];
-  int i = 0;
-  for(; i < EXT2_N_BLOCKS-3; i++) {
-    if(root_inode.i_block[i] != 0) {
-      read_sectors(parArray[parIndex-1].start_sect + root_inode.i_block[i]* BLOCK_SECTOR_RATIO, BLOCK_SECTOR_RATIO,buf_dir);
-      int len = 0;
-      while(len < BLOCKSIZE) {
-        dir = (struct ext2_dir_entry_2*) (buf_dir+len);          
-        // Find lost+found dir
-        if(!strcmp(dir->name, lost_found)) {          
-          return Get_Inode(dir->inode, parIndex);         
-        }
-        len += dir->rec_len;  
-      }
-    } else
-      return;
-      
-  }
+  memset(&lostfound_inode, 0, sizeof(lostfound_inode));
+
+  // Find lost+found dir
+  lost_found_index = dir_lookup(&root_inode, lost_found, parIndex);
+  if(lost_found_index != 0)
+    lostfound_inode = Get_Inode(lost_found_index, parIndex);
+  return lostfound_inode;
 }
 
+/*
+ * Put the entry into the first empty entry of a lost+found block with room
+ * for it.  Returns 1 if it fit.
+ */
+static int lost_found_insert(unsigned char* buf_dir, const char* c, int str_len, int type, int inodeIndex) {
+    struct ext2_dir_entry_2* dir;
+
+    // Align to 4 bytes    
+    int rec_length = (8 + str_len + 4 - 1) / 4 * 4;
 
+    int len = 0;
+    while(len < BLOCKSIZE) {
+      dir = (struct ext2_dir_entry_2*) (buf_dir+len);    
+      if(dir->inode == 0 && dir->rec_len >= rec_length + 8) {
+          int temp_len = dir->rec_len;
+          dir->inode = inodeIndex;
+          dir->rec_len = rec_length;
+          dir->name_len = str_len;              
+          dir->file_type = type;            
+          memcpy(dir->name, c, str_len*sizeof(char));
+
+          // Create the split for the rest unused space
+          len += dir->rec_len;
+          dir = (struct ext2_dir_entry_2*) (buf_dir+len);    
+          dir->inode = 0;
+          dir->rec_len = temp_len - rec_length;
+          dir->name_len = 0;
+          return 1;
+      }
+      if(dir->rec_len == 0)
+        break;
+      len += dir->rec_len;
+    }
+    return 0;
+}
 
 int Write_To_Lost_Found(struct ext2_inode lostfound, int type, int inodeIndex, int parIndex) {
-    struct ext2_dir_entry_2* dir;
-    unsigned char buf_dir[BLOCKSIZE];
+    struct dir_stream stream;
 
     // Change 4017 to "4017" and store in array c
     int str_len = 0;
@@ -649,189 +2312,904 @@ int Write_To_Lost_Found(struct ext2_inode lostfound, int type, int inodeIndex, i
     sprintf(c, "%d", inodeIndex);
     str_len = strlen(c);
 
-    // Align to 4 bytes    
-    int rec_length = (8 + str_len + 4 - 1) / 4 * 4;
+    dir_stream_open(&stream, lostfound.i_block, parIndex);
+
+    // A hashed lost+found takes the entry in the leaf of its hash.  When that
+    // leaf is full the index is dropped and the directory filled linearly.
+    if(dir_is_indexed(&lostfound, parIndex)) {
+      struct ext2_super_block super = get_superblock(parIndex);
+      int leaf = -1;
+      __u32 hash, next_hash;
+
+      if(dir_stream_read(&stream, 0) && dx_root_hash(stream.data, &super, c, str_len, &hash))
+        leaf = dx_find_leaf(&stream, hash, &next_hash);
+      if(leaf != -1 && dir_stream_read(&stream, leaf)
+         && lost_found_insert(stream.data, c, str_len, type, inodeIndex)) {
+        dir_stream_write(&stream);
+        dir_stream_close(&stream);
+        pass1(parIndex);
+        return 1;
+      }
 
+      if(report(REPORT_LOST_FOUND_INDEX, lost_found_index, lostfound.i_flags, lostfound.i_flags & ~EXT2_INDEX_FL))
+        printf("partition: %d, inode: %d, lost+found index full, cleared\n", parIndex, lost_found_index);
+      lostfound.i_flags &= ~EXT2_INDEX_FL;
+      Put_Inode(lost_found_index, parIndex, &lostfound);
+      stream.next = 0;
+    }
 
-    int j = 0;
-    for(; j < EXT2_N_BLOCKS-3; j++) {
-      if(lostfound.i_block[j] != 0) {
-        read_sectors(parArray[parIndex-1].start_sect + lostfound.i_block[j]* BLOCK_SECTOR_RATIO, BLOCK_SECTOR_RATIO, buf_dir);
-        int len = 0;
-        while(len < BLOCKSIZE) {
-          dir = (struct ext2_dir_entry_2*) (buf_dir+len);    
-          if(dir->inode == 0) {
-              int temp_len = dir->rec_len;
-              dir->inode = inodeIndex;
-              dir->rec_len = rec_length;
-              dir->name_len = str_len;              
-              dir->file_type = type;            
-              memcpy(dir->name, c, str_len*sizeof(char));
-
-              // Create the split for the rest unused space
-              len += dir->rec_len;
-              dir = (struct ext2_dir_entry_2*) (buf_dir+len);    
-              dir->rec_len = temp_len - rec_length;
-
-              // Write to the disk
-              write_sectors(parArray[parIndex-1].start_sect + lostfound.i_block[j]* BLOCK_SECTOR_RATIO, BLOCK_SECTOR_RATIO, buf_dir);
-              pass1(parIndex);
-
-              // Return 1 to indicate successful write
-              return 1;
-          }
-          len += dir->rec_len;
+    while(dir_stream_next(&stream)) {
+      if(lost_found_insert(stream.data, c, str_len, type, inodeIndex)) {
+        // Write to the disk
+        dir_stream_write(&stream);
+        dir_stream_close(&stream);
+        pass1(parIndex);
+
+        // Return 1 to indicate successful write
+        return 1;
+      }
+    }
+    dir_stream_close(&stream);
+    return 0;
+}
+
+
+int Check_Inode_linkcount_pass2(int inodeIndex, int parIndex, int m) {
+
+  struct inode_location location = Get_Inode_Location(inodeIndex, parIndex);
+
+  // Read the whole target sector
+  unsigned char inode_buf[SECTOR_SIZE_BYTES];
+
+  read_sectors(location.sect_num, 1, inode_buf);
+
+  struct ext2_inode* inode = (struct ext2_inode*)(inode_buf + location.offset_within_sect);
+
+  if(inode->i_links_count != 0) {
+      if(m == 0) {
+        // create a directory or file in lost+found
+        int type = Get_Inode_Type(inode->i_mode);
+        struct ext2_inode lostfound = Get_Lost_Found_Inode(parIndex);
+        if(report(REPORT_UNREFERENCED, inodeIndex, inode->i_links_count, inode->i_links_count))
+          printf("partition: %d, lost_found inode: %d, link_count: %d\n", parIndex, inodeIndex, inode->i_links_count);        
+        if(Write_To_Lost_Found(lostfound, type, inodeIndex, parIndex)) {
+          if(report(REPORT_RECONNECTED, inodeIndex, 0, lost_found_index))
+            printf("partition: %d, lost_found inode: %d write to lost+found successfully!%s\n",parIndex, inodeIndex,
+                   path_note(inodeIndex));
+          // Return 1 to represent that some line count is inconsistent.
+          return 1;
         }
-      } else
+        if(report(REPORT_RECONNECT_FAILED, inodeIndex, 0, 0))
+          printf("partition: %d, lost_found inode: %d fail to write to lost+found \n",parIndex, inodeIndex);
+        // Nothing changed, counting the links again would find it again
         return 0;
+      }
+  }
+  return 0;
+
+}
+
+
+int Check_Inode_linkcount_pass3(int inodeIndex, int parIndex, int m) {
+
+  struct inode_location location = Get_Inode_Location(inodeIndex, parIndex);
+
+  // Read the whole target sector
+  unsigned char inode_buf[SECTOR_SIZE_BYTES];
+
+  read_sectors(location.sect_num, 1, inode_buf);
+
+  struct ext2_inode* inode = (struct ext2_inode*)(inode_buf + location.offset_within_sect);
+
+  if(inode->i_links_count != 0) {
+    if(m != 0 && m != inode->i_links_count) {
+      if(report(REPORT_LINK_COUNT, inodeIndex, inode->i_links_count, m))
+        printf("partition: %d, inode: %d, link_count: %d, actually_link_count: %d%s\n", parIndex, inodeIndex,
+               inode->i_links_count, m, path_note(inodeIndex));
+      inode->i_links_count = m;
+      write_sectors(location.sect_num, 1, inode_buf);
+    }
+  }
+  return 0;
+
+}
+
+
+/*
+ * Checkpoint / resume
+ *
+ * With --checkpoint FILE the checker keeps a sidecar file describing how far
+ * it got: the partition and pass in progress, the next inode (pass 2/3) or
+ * block group (pass 4) to check, and the mark/visited arrays produced by the
+ * traversal of the current pass.  The arrays are written once per pass; the
+ * periodic progress updates only rewrite the small header, so checkpointing
+ * stays cheap.  The header is always written last and fsync'ed, which makes
+ * it the commit record: whatever it describes is on disk.
+ *
+ * All repairs done by the passes are idempotent, so resuming at the last
+ * committed position and redoing the work after it is safe.
+ *
+ * File layout:
+ *   [0, CHECKPOINT_HEADER_SIZE)            struct checkpoint_header
+ *   [CHECKPOINT_HEADER_SIZE, ...)          mark array, then visited array
+ */
+
+#define CHECKPOINT_MAGIC        0x54504b43  /* "CKPT" */
+#define CHECKPOINT_VERSION      2
+#define CHECKPOINT_HEADER_SIZE  512
+#define CHECKPOINT_INTERVAL     4096        /* inodes between header updates */
+#define CHECKPOINT_GROUP_INTERVAL 16        /* groups between header updates */
+
+#define STAGE_TRAVERSE          0           /* traversal not saved yet */
+#define STAGE_CHECK             1           /* mark state saved, checking */
+#define PASS_DONE               5           /* all passes of the partition done */
+
+struct checkpoint_header {
+  __u32 magic;
+  __u32 version;
+  __u32 partition;        // partition in progress
+  __u32 pass;             // pass in progress, PASS_DONE when finished
+  __u32 stage;            // STAGE_TRAVERSE or STAGE_CHECK
+  __u32 next_index;       // next inode / group to check
+  __u32 mark_count;       // ints of mark state saved after the header
+  __u32 visited_count;    // ints of visited state saved after the mark
+  __u32 inodes_count;     // geometry of the checked file system
+  __u32 blocks_count;
+  __u8  uuid[16];
+  __u32 target;           // partition given to -f, 0 for all
+  __u32 checksum;         // over all the fields above
+};
+
+static int    checkpoint_fd = -1;
+
+static int    resume_requested = 0;
+
+static struct checkpoint_header checkpoint;
+
+static int checkpoint_target = 0;
+
+static __u32  checkpoint_last_index = 0;
+
+static __u32 checkpoint_checksum(struct checkpoint_header* hdr) {
+  unsigned char* p = (unsigned char*) hdr;
+  __u32 sum = 0;
+  int i = 0;
+  for(; i < offsetof(struct checkpoint_header, checksum); i++)
+    sum = sum * 31 + p[i];
+  return sum;
+}
+
+static void checkpoint_pwrite(const void* buf, size_t len, off_t offset) {
+  if(pwrite(checkpoint_fd, buf, len, offset) != (ssize_t) len) {
+    perror("Could not write checkpoint file");
+    exit(-1);
+  }
+}
+
+/*
+ * Mark arrays are mostly zero pages, in memory and in the checkpoint and
+ * state files.  Only the runs of nonzero pages are written, the file is
+ * extended over the rest so it reads back as holes.  Returns 0 on success.
+ */
+#define SPARSE_FILE_PAGE        4096
+
+static int page_is_zero(const unsigned char* p, size_t len) {
+  static const unsigned char zero[SPARSE_FILE_PAGE];
+  return !memcmp(p, zero, len);
+}
+
+static int sparse_pwrite(int fd, const void* buf, size_t len, off_t offset) {
+  const unsigned char* p = (const unsigned char*) buf;
+  size_t off = 0;
+  while(off < len) {
+    size_t run = 0;
+    while(off + run < len) {
+      size_t page = len - off - run < SPARSE_FILE_PAGE ? len - off - run : SPARSE_FILE_PAGE;
+      if(page_is_zero(p + off + run, page))
+        break;
+      run += page;
     }
+    if(run > 0 && pwrite(fd, p + off, run, offset + off) != (ssize_t) run)
+      return -1;
+    off += run;
+    if(off < len)
+      off += len - off < SPARSE_FILE_PAGE ? len - off : SPARSE_FILE_PAGE;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) != 0)
+    return -1;
+  if(st.st_size < offset + (off_t) len && ftruncate(fd, offset + len) != 0)
+    return -1;
+  return 0;
+}
+
+/* Read what sparse_pwrite wrote into zeroed sparse memory. */
+static int sparse_pread(int fd, void* buf, size_t len, off_t offset) {
+  unsigned char page[SPARSE_FILE_PAGE];
+  unsigned char* p = (unsigned char*) buf;
+  size_t off = 0;
+  for(; off < len; off += SPARSE_FILE_PAGE) {
+    size_t n = len - off < SPARSE_FILE_PAGE ? len - off : SPARSE_FILE_PAGE;
+    if(pread(fd, page, n, offset + off) != (ssize_t) n)
+      return -1;
+    if(!page_is_zero(page, n))
+      memcpy(p + off, page, n);
+  }
+  return 0;
+}
+
+/*
+ * Commit the in-memory header.  Anything it refers to must already be on
+ * disk, hence the fsync before and after.
+ */
+static void checkpoint_commit(void) {
+  unsigned char buf[CHECKPOINT_HEADER_SIZE];
+
+  // The header must not get ahead of the repairs it covers
+  txn_flush();
+
+  checkpoint.checksum = checkpoint_checksum(&checkpoint);
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, &checkpoint, sizeof(checkpoint));
+  fsync(checkpoint_fd);
+  checkpoint_pwrite(buf, sizeof(buf), 0);
+  fsync(checkpoint_fd);
+  checkpoint_last_index = checkpoint.next_index;
+}
+
+/*
+ * 1 if the partition the checkpoint was taken on is still there and holds
+ * the same file system.  The superblock is read as is, get_superblock
+ * would switch the block size to that partition's.
+ */
+static int checkpoint_identity_matches(void) {
+  unsigned char buf[SUPERBLOCK_SIZE];
+
+  if(checkpoint.partition < 1 || checkpoint.partition > (__u32) parArrayCounter
+     || parArray[checkpoint.partition - 1].sys_ind != LINUX_EXT2_PARTITION)
+    return 0;
+  read_sectors(part_start(checkpoint.partition) + SUPERBLOCK_OFFSET / SECTOR_SIZE_BYTES, 2, buf);
+  struct ext2_super_block* super_block = (struct ext2_super_block*) buf;
+  return !memcmp(checkpoint.uuid, super_block->s_uuid, sizeof(checkpoint.uuid))
+         && checkpoint.inodes_count == super_block->s_inodes_count
+         && checkpoint.blocks_count == super_block->s_blocks_count;
+}
+
+/*
+ * target is the partition given to -f.  A checkpoint of another -f run or
+ * of another image is not resumed from, everything is checked.
+ */
+void checkpoint_open(const char* path, int target) {
+  int flags = O_RDWR | O_CREAT;
+  if(!resume_requested)
+    flags |= O_TRUNC;
+  if ((checkpoint_fd = open(path, flags, 0644)) == -1) {
+    perror("Could not open checkpoint file");
+    exit(-1);
+  }
+
+  checkpoint_target = target;
+  memset(&checkpoint, 0, sizeof(checkpoint));
+  if(!resume_requested)
+    return;
+
+  if(pread(checkpoint_fd, &checkpoint, sizeof(checkpoint), 0) != sizeof(checkpoint)
+     || checkpoint.magic != CHECKPOINT_MAGIC
+     || checkpoint.version != CHECKPOINT_VERSION
+     || checkpoint.checksum != checkpoint_checksum(&checkpoint)) {
+    printf("No consistent checkpoint in %s, starting from pass 1\n", path);
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    return;
+  }
+  if(checkpoint.target != (__u32) target || !checkpoint_identity_matches()) {
+    printf("Checkpoint in %s is of another check, starting from pass 1\n", path);
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    return;
+  }
+  printf("Resuming partition %d at pass %d\n", checkpoint.partition, checkpoint.pass);
 }
 
-int Get_Inode_Type(__u16 i_mode) {
-  __u16 mask = 0xF000;
-  i_mode = mask & i_mode;
-  if(i_mode == 0xC000)
-    return 6;
-  if(i_mode == 0xA000)
-    return 7;
-  if(i_mode == 0x8000)
+/*
+ * Decide whether a pass still has to run.  Returns 0 when the checkpoint
+ * says it has completed already.  checkpoint_open has made sure the
+ * checkpoint is of this -f run on this image, so the partitions before
+ * its own are done.
+ */
+int checkpoint_need_pass(int parIndex, int pass) {
+  if(checkpoint_fd == -1 || checkpoint.magic != CHECKPOINT_MAGIC)
+    return 1;
+
+  if(parIndex < checkpoint.partition)
+    return 0;
+
+  if(parIndex > checkpoint.partition)
     return 1;
-  if(i_mode == 0x6000)
-    return 4;
-  if(i_mode == 0x4000)
-    return 2;
-  if(i_mode == 0x2000)
-    return 3;
-  if(i_mode == 0x1000)
-    return 5;
+
+  return pass >= checkpoint.pass;
 }
 
-int Check_Inode_linkcount_pass2(int inodeIndex, int parIndex, int m) {
+/*
+ * Record that parIndex has entered pass, with its traversal still to do.
+ */
+void checkpoint_begin_pass(int parIndex, int pass) {
+  if(checkpoint_fd == -1)
+    return;
 
-   struct ext2_super_block super_block = get_superblock(parIndex);
-  
-  int inodes_per_group = super_block.s_inodes_per_group;
+  // Resuming inside this very pass, keep the state saved for it
+  if(checkpoint.magic == CHECKPOINT_MAGIC && checkpoint.partition == parIndex
+     && checkpoint.pass == pass)
+    return;
 
-  // Get which block group this inode belongs to
-  int block_group = (inodeIndex - 1) / inodes_per_group;
-  int local_inode_index = (inodeIndex - 1) % inodes_per_group;
+  struct ext2_super_block super_block = get_superblock(parIndex);
 
-  int64_t blockgroup_offset;
+  checkpoint.magic = CHECKPOINT_MAGIC;
+  checkpoint.version = CHECKPOINT_VERSION;
+  checkpoint.partition = parIndex;
+  checkpoint.pass = pass;
+  checkpoint.stage = STAGE_TRAVERSE;
+  checkpoint.next_index = 0;
+  checkpoint.mark_count = 0;
+  checkpoint.visited_count = 0;
+  checkpoint.inodes_count = super_block.s_inodes_count;
+  checkpoint.blocks_count = super_block.s_blocks_count;
+  memcpy(checkpoint.uuid, super_block.s_uuid, sizeof(checkpoint.uuid));
+  checkpoint.target = checkpoint_target;
+  checkpoint_commit();
+}
 
-  if(BLOCKSIZE == 1024)
-    blockgroup_offset = SUPERBLOCK_OFFSET + SUPERBLOCK_SIZE;
-  else
-    // The first group descriptor locates in the next block following superblock
-    blockgroup_offset = BLOCKSIZE;
+/*
+ * Save the traversal result of the current pass.  visited may be NULL.
+ */
+void checkpoint_save_marks(int* mark, size_t mark_count, int* visited, size_t visited_count) {
+  if(checkpoint_fd == -1)
+    return;
+
+  if(sparse_pwrite(checkpoint_fd, mark, sizeof(int) * mark_count, CHECKPOINT_HEADER_SIZE) != 0
+     || (visited != NULL
+         && sparse_pwrite(checkpoint_fd, visited, sizeof(int) * visited_count,
+                          CHECKPOINT_HEADER_SIZE + sizeof(int) * (off_t) mark_count) != 0)) {
+    perror("Could not write checkpoint file");
+    exit(-1);
+  }
+
+  checkpoint.stage = STAGE_CHECK;
+  checkpoint.next_index = 0;
+  checkpoint.mark_count = mark_count;
+  checkpoint.visited_count = visited != NULL ? visited_count : 0;
+  checkpoint_commit();
+}
+
+/*
+ * Reload the traversal result of the current pass when resuming in the
+ * middle of it.  Returns the index to continue the check from, or -1 when
+ * the traversal has to be redone.
+ */
+int checkpoint_load_marks(int parIndex, int pass, int* mark, size_t mark_count, int* visited, size_t visited_count) {
+  if(checkpoint_fd == -1 || checkpoint.magic != CHECKPOINT_MAGIC
+     || checkpoint.partition != parIndex || checkpoint.pass != pass
+     || checkpoint.stage != STAGE_CHECK
+     || checkpoint.mark_count != mark_count
+     || checkpoint.visited_count != (visited != NULL ? visited_count : 0))
+    return -1;
+
+  if(sparse_pread(checkpoint_fd, mark, sizeof(int) * mark_count, CHECKPOINT_HEADER_SIZE) != 0
+     || (visited != NULL
+         && sparse_pread(checkpoint_fd, visited, sizeof(int) * visited_count,
+                         CHECKPOINT_HEADER_SIZE + sizeof(int) * (off_t) mark_count) != 0)) {
+    // The callers count on zeroed arrays when the traversal is redone
+    sparse_zero(mark, sizeof(int) * mark_count);
+    if(visited != NULL)
+      sparse_zero(visited, sizeof(int) * visited_count);
+    return -1;
+  }
+
+  printf("partition: %d, pass %d resumed at index %d\n", parIndex, pass, checkpoint.next_index);
+  return checkpoint.next_index;
+}
+
+/*
+ * Periodic progress update: only the header is rewritten, and only once
+ * every interval items.
+ */
+void checkpoint_progress(int next_index, int interval) {
+  if(checkpoint_fd == -1 || checkpoint.stage != STAGE_CHECK)
+    return;
+
+  if(next_index - checkpoint_last_index < interval)
+    return;
+
+  checkpoint.next_index = next_index;
+  checkpoint_commit();
+}
+
+/*
+ * A repair invalidated the saved traversal (pass 2 restarts after writing to
+ * lost+found), fall back to the traversal stage.
+ */
+void checkpoint_discard_marks(void) {
+  if(checkpoint_fd == -1)
+    return;
+
+  checkpoint.stage = STAGE_TRAVERSE;
+  checkpoint.next_index = 0;
+  checkpoint_commit();
+}
+
+void checkpoint_close(void) {
+  if(checkpoint_fd == -1)
+    return;
+  close(checkpoint_fd);
+  checkpoint_fd = -1;
+}
+
+
+/*
+ * CRC32C
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it, a table otherwise.
+ */
+
+static __u32 crc32c_table[256];
+
+static void crc32c_init_table(void) {
+  __u32 i = 0;
+  for(; i < 256; i++) {
+    __u32 crc = i;
+    int k = 0;
+    for(; k < 8; k++)
+      crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+    crc32c_table[i] = crc;
+  }
+}
+
+static __u32 crc32c_sw(__u32 crc, const unsigned char* p, size_t len) {
+  while(len--)
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static __u32 crc32c_hw(__u32 crc, const unsigned char* p, size_t len) {
+  unsigned long long c = crc;
+  while(len >= 8) {
+    unsigned long long v;
+    memcpy(&v, p, 8);
+    c = __builtin_ia32_crc32di(c, v);
+    p += 8;
+    len -= 8;
+  }
+  crc = (__u32) c;
+  while(len--)
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+  return crc;
+}
+#endif
+
+__u32 crc32c(__u32 crc, const void* buf, size_t len) {
+  static int hw = -1;
+
+  if(hw == -1) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    hw = __builtin_cpu_supports("sse4.2");
+#else
+    hw = 0;
+#endif
+    if(!hw)
+      crc32c_init_table();
+  }
+
+#if defined(__x86_64__)
+  if(hw)
+    return crc32c_hw(crc, (const unsigned char*) buf, len);
+#endif
+  return crc32c_sw(crc, (const unsigned char*) buf, len);
+}
+
+
+/*
+ * Incremental re-check
+ *
+ * With --state PREFIX every checked partition keeps a state file
+ * PREFIX.<partition>.  It stores three CRC32C fingerprints per block group:
+ *
+ *   bitmaps: the block and inode bitmap
+ *   itable:  the inode table and the indirect blocks of the group's inodes,
+ *            i.e. everything block ownership (pass 4) is derived from
+ *   dirs:    the i_block arrays and directory blocks of the group's
+ *            directories, i.e. everything the tree walks of pass 1-3 read
+ *
+ * together with the link counts of pass 3 and the block ownership of pass 4.
+ * The next run hashes the groups first and reuses whatever still holds:
+ *
+ *   STATE_FULL             some directory changed, check everything
+ *   STATE_REUSE_LINKS      directories unchanged: pass 1 is skipped, pass 2/3
+ *                          use the cached link counts and only look at the
+ *                          inodes of groups whose inode table changed
+ *   STATE_REUSE_OWNERSHIP  inode tables unchanged too: only pass 4 runs, on
+ *                          the groups whose bitmaps changed
+ *   STATE_UNCHANGED        nothing changed, the partition is skipped
+ *
+ * A missing or foreign state file, or a repair that changes the tree while
+ * results are being reused, falls back to STATE_FULL.
+ */
+
+#define STATE_MAGIC             0x54415453  /* "STAT" */
+#define STATE_VERSION           1
+
+#define STATE_FULL              0
+#define STATE_REUSE_LINKS       1
+#define STATE_REUSE_OWNERSHIP   2
+#define STATE_UNCHANGED         3
+
+struct state_header {
+  __u32 magic;
+  __u32 version;
+  __u8  uuid[16];
+  __u32 inodes_count;
+  __u32 blocks_count;
+  __u32 group_num;
+  __u32 mark_blocks;      // entries of the pass 4 block mark
+};
+
+struct group_fingerprint {
+  __u32 bitmaps;
+  __u32 itable;
+  __u32 dirs;
+};
+
+static char*  state_prefix = NULL;
+
+static struct {
+  int    level;
+  int    inodes_per_group;
+  struct state_header hdr;
+  struct group_fingerprint* fp;     // current fingerprints
+  unsigned char* itable_changed;    // per group
+  unsigned char* bitmaps_changed;   // per group
+  int*   links;                     // link counts, hdr.inodes_count entries
+  int*   owned;                     // block mark, hdr.mark_blocks entries
+  long   writes;                    // txn_write_count when fp was computed
+} state;
+
+static __u32 state_crc_indirect(__u32 crc, __u32 block, int level, __u32 blocks_count,
+                                int parIndex, unsigned char* buf) {
+  if(block == 0 || block >= blocks_count)
+    return crc;
+
+  read_sectors(block_sector(parIndex, block), BLOCK_SECTOR_RATIO, buf);
+  crc = crc32c(crc, buf, BLOCKSIZE);
+  if(level == 1)
+    return crc;
+
+  int total = BLOCKSIZE / sizeof(int);
+  __u32* ptr = (__u32*) get_block_buf();
+  memcpy(ptr, buf, BLOCKSIZE);
+  int i = 0;
+  for(; i < total && ptr[i] != 0; i++)
+    crc = state_crc_indirect(crc, ptr[i], level - 1, blocks_count, parIndex, buf);
+  put_block_buf((unsigned char*) ptr);
+  return crc;
+}
+
+/*
+ * Compute the fingerprints of every group of parIndex into state.fp.
+ */
+static void state_fingerprint(int parIndex) {
+  struct ext2_super_block super = get_superblock(parIndex);
+  int group_num = super.s_inodes_count / super.s_inodes_per_group;
+  int itable_blocks = (INODE_SIZE * super.s_inodes_per_group + BLOCKSIZE - 1) / BLOCKSIZE;
+  __u32 groups;
+  const struct ext2_group_desc* gdt = Get_Group_Desc_Table(parIndex, &groups);
+
+  unsigned char* buf = get_block_buf();
+  unsigned char* itable = (unsigned char*) malloc(itable_blocks * BLOCKSIZE);
+  if(groups < group_num)
+    group_num = groups;
+
+  // Both bitmaps and the inode table of every group, read ahead in order
+  struct block_pipe pipe;
+  struct pipe_extent* extent = (struct pipe_extent*) malloc(sizeof(struct pipe_extent) * (3 * group_num + 1));
+  int g = 0;
+  for(; g < group_num; g++) {
+    extent[3 * g].start = block_sector(parIndex, gdt[g].bg_block_bitmap);
+    extent[3 * g].sectors = BLOCK_SECTOR_RATIO;
+    extent[3 * g + 1].start = block_sector(parIndex, gdt[g].bg_inode_bitmap);
+    extent[3 * g + 1].sectors = BLOCK_SECTOR_RATIO;
+    extent[3 * g + 2].start = block_sector(parIndex, gdt[g].bg_inode_table);
+    extent[3 * g + 2].sectors = (int64_t) itable_blocks * BLOCK_SECTOR_RATIO;
+  }
+  pipe_open(&pipe, extent, 3 * group_num, pipe_depth);
+
+  io_hint(parIndex, POSIX_FADV_SEQUENTIAL);
+  for(g = 0; g < group_num; g++) {
+    const struct ext2_group_desc* desc = &gdt[g];
+    struct group_fingerprint* fp = &state.fp[g];
+
+    pipe_read(&pipe, block_sector(parIndex, desc->bg_block_bitmap), BLOCK_SECTOR_RATIO, buf);
+    fp->bitmaps = crc32c(0, buf, BLOCKSIZE);
+    pipe_read(&pipe, block_sector(parIndex, desc->bg_inode_bitmap), BLOCK_SECTOR_RATIO, buf);
+    fp->bitmaps = crc32c(fp->bitmaps, buf, BLOCKSIZE);
+
+    pipe_read(&pipe, block_sector(parIndex, desc->bg_inode_table), itable_blocks * BLOCK_SECTOR_RATIO, itable);
+    fp->itable = crc32c(0, itable, itable_blocks * BLOCKSIZE);
+    fp->dirs = 0;
+
+    int i = 0;
+    for(; i < super.s_inodes_per_group; i++) {
+      struct ext2_inode* inode = (struct ext2_inode*)(itable + i * INODE_SIZE);
+      __u32 ino = g * super.s_inodes_per_group + i + 1;
+
+      if(inode->i_links_count == 0 || inode->i_mode == 0)
+        continue;
+
+      if((inode->i_mode & 0xF000) == EXT2_S_IFDIR) {
+        struct dir_stream stream;
+        fp->dirs = crc32c(fp->dirs, &ino, sizeof(ino));
+        // Clearing the htree index changes only the flags
+        fp->dirs = crc32c(fp->dirs, &inode->i_flags, sizeof(inode->i_flags));
+        fp->dirs = crc32c(fp->dirs, inode->i_block, sizeof(inode->i_block));
+        // Every directory block, the ones behind indirect blocks too
+        dir_stream_open(&stream, inode->i_block, parIndex);
+        while(dir_stream_next(&stream))
+          fp->dirs = crc32c(fp->dirs, stream.data, BLOCKSIZE);
+        dir_stream_close(&stream);
+      }
 
-  unsigned char blockgroup_buf[BLOCKSIZE];
+      if((inode->i_mode & 0xF000) != EXT2_S_IFLNK) {
+        int level = 1;
+        for(; level <= 3; level++)
+          fp->itable = state_crc_indirect(fp->itable, inode->i_block[EXT2_NDIR_BLOCKS + level - 1],
+                                          level, super.s_blocks_count, parIndex, buf);
+      }
+    }
+  }
+  pipe_close(&pipe);
+  pipe_stats(parIndex, "state fingerprints", &pipe);
+  free(extent);
 
-  // find the start sector for first block group descriptor
-  int blockgroup_start_sector = parArray[parIndex-1].start_sect + blockgroup_offset/SECTOR_SIZE_BYTES;
-                              
-  // Read one block to get all the block group descriptor                            
-  read_sectors(blockgroup_start_sector, BLOCK_SECTOR_RATIO, blockgroup_buf);  
+  free(itable);
+  put_block_buf(buf);
+  state.writes = txn_write_count;
+}
 
-  // Find the corresponding group descriptor according to the block_group
-  struct ext2_group_desc* group_desc = (struct ext2_group_desc*)(blockgroup_buf + block_group * BLOCK_GROUP_DESC);
+/* File offsets of the link counts and the block mark, after the fingerprints. */
+static off_t state_links_offset(void) {
+  return sizeof(struct state_header) + sizeof(struct group_fingerprint) * (off_t) state.hdr.group_num;
+}
 
-  // Find the start sector of inode table
-  int inodetable_start_sector = parArray[parIndex-1].start_sect + group_desc->bg_inode_table * BLOCK_SECTOR_RATIO;
+static off_t state_owned_offset(void) {
+  return state_links_offset() + sizeof(int) * (off_t) state.hdr.inodes_count;
+}
 
-  // Find the sector of the target inode based on inode table start sector
-  int sect_num = inodetable_start_sector + local_inode_index*INODE_SIZE / SECTOR_SIZE_BYTES;
+static char* state_path(int parIndex) {
+  static char path[4096];
+  snprintf(path, sizeof(path), "%s.%d", state_prefix, parIndex);
+  return path;
+}
 
-  // Calculate the offset within the sector
-  int offset_within_sect = local_inode_index*INODE_SIZE % SECTOR_SIZE_BYTES;
+/*
+ * Load the previous state of parIndex, fingerprint the partition and decide
+ * how much of the previous results can be reused.  Returns the STATE_ level.
+ */
+int state_begin(int parIndex) {
+  if(state_prefix == NULL)
+    return STATE_FULL;
 
-  // Read the whole target sector
-  unsigned char inode_buf[SECTOR_SIZE_BYTES];
+  struct ext2_super_block super = get_superblock(parIndex);
+  int block_count_per_group = super.s_blocks_per_group;
 
-  read_sectors(sect_num, 1, inode_buf);
+  memset(&state, 0, sizeof(state));
+  state.inodes_per_group = super.s_inodes_per_group;
+  state.hdr.magic = STATE_MAGIC;
+  state.hdr.version = STATE_VERSION;
+  memcpy(state.hdr.uuid, super.s_uuid, sizeof(state.hdr.uuid));
+  state.hdr.inodes_count = super.s_inodes_count;
+  state.hdr.blocks_count = super.s_blocks_count;
+  state.hdr.group_num = super.s_inodes_count / super.s_inodes_per_group;
+  state.hdr.mark_blocks = (__u32) block_count_per_group * state.hdr.group_num;
+
+  int group_num = state.hdr.group_num;
+  state.fp = (struct group_fingerprint*) calloc(group_num, sizeof(struct group_fingerprint));
+  state.itable_changed = (unsigned char*) calloc(group_num, 1);
+  state.bitmaps_changed = (unsigned char*) calloc(group_num, 1);
+  state.links = (int*) sparse_alloc(sizeof(int) * (size_t) state.hdr.inodes_count);
+  state.owned = (int*) sparse_alloc(sizeof(int) * (size_t) state.hdr.mark_blocks);
+
+  state_fingerprint(parIndex);
+
+  struct state_header old;
+  struct group_fingerprint* old_fp = (struct group_fingerprint*) calloc(group_num, sizeof(struct group_fingerprint));
+  int fd = open(state_path(parIndex), O_RDONLY);
+  int ok = fd != -1
+    && read(fd, &old, sizeof(old)) == sizeof(old)
+    && !memcmp(&old, &state.hdr, sizeof(old))
+    && read(fd, old_fp, sizeof(struct group_fingerprint) * group_num)
+       == sizeof(struct group_fingerprint) * group_num
+    && sparse_pread(fd, state.links, sizeof(int) * (size_t) state.hdr.inodes_count, state_links_offset()) == 0
+    && sparse_pread(fd, state.owned, sizeof(int) * (size_t) state.hdr.mark_blocks, state_owned_offset()) == 0;
+  if(fd != -1)
+    close(fd);
+
+  state.level = STATE_FULL;
+  if(ok) {
+    int dirs_changed = 0, itables_changed = 0, bitmaps_changed = 0;
+    int g = 0;
+    for(; g < group_num; g++) {
+      dirs_changed += old_fp[g].dirs != state.fp[g].dirs;
+      state.itable_changed[g] = old_fp[g].itable != state.fp[g].itable;
+      state.bitmaps_changed[g] = old_fp[g].bitmaps != state.fp[g].bitmaps;
+      itables_changed += state.itable_changed[g];
+      bitmaps_changed += state.bitmaps_changed[g];
+    }
 
-  struct ext2_inode* inode = (struct ext2_inode*)(inode_buf + offset_within_sect);
+    if(dirs_changed)
+      state.level = STATE_FULL;
+    else if(itables_changed)
+      state.level = STATE_REUSE_LINKS;
+    else if(bitmaps_changed)
+      state.level = STATE_REUSE_OWNERSHIP;
+    else
+      state.level = STATE_UNCHANGED;
 
-  if(inode->i_links_count != 0) {
-      if(m == 0) {
-        // create a directory or file in lost+found
-        int type = Get_Inode_Type(inode->i_mode);
-        struct ext2_inode lostfound = Get_Lost_Found_Inode(parIndex);
-        printf("partition: %d, lost_found inode: %d, link_count: %d\n", parIndex, inodeIndex, inode->i_links_count);        
-        if(Write_To_Lost_Found(lostfound, type, inodeIndex, parIndex))
-          printf("partition: %d, lost_found inode: %d write to lost+found successfully!\n",parIndex, inodeIndex);
-        else
-          printf("partition: %d, lost_found inode: %d fail to write to lost+found \n",parIndex, inodeIndex);
-        // Return 1 to represent that some line count is inconsistent.
-        return 1;
-      }
+    printf("partition: %d, changed groups: %d directories, %d inode tables, %d bitmaps of %d\n",
+           parIndex, dirs_changed, itables_changed, bitmaps_changed, group_num);
   }
-  return 0;
+  free(old_fp);
 
+  return state.level;
 }
 
+/*
+ * A repair changed the directory tree, nothing cached can be trusted now.
+ */
+void state_invalidate(void) {
+  state.level = STATE_FULL;
+}
 
-int Check_Inode_linkcount_pass3(int inodeIndex, int parIndex, int m) {
+/* Cached link counts, or NULL when pass 2/3 have to walk the tree. */
+int* state_cached_links(void) {
+  return state_prefix != NULL && state.level >= STATE_REUSE_LINKS ? state.links : NULL;
+}
 
-   struct ext2_super_block super_block = get_superblock(parIndex);
-  
-  int inodes_per_group = super_block.s_inodes_per_group;
+/* Cached pass 4 block mark, or NULL when pass 4 has to walk the tree. */
+int* state_cached_ownership(void) {
+  return state_prefix != NULL && state.level >= STATE_REUSE_OWNERSHIP ? state.owned : NULL;
+}
 
-  // Get which block group this inode belongs to
-  int block_group = (inodeIndex - 1) / inodes_per_group;
-  int local_inode_index = (inodeIndex - 1) % inodes_per_group;
+/* Whether the inode's link count was already verified in the last run. */
+int state_skip_inode(int inodeIndex) {
+  if(state_cached_links() == NULL || inodeIndex < 1)
+    return 0;
+  return !state.itable_changed[(inodeIndex - 1) / state.inodes_per_group];
+}
 
-  int64_t blockgroup_offset;
+/* Whether the group's bitmap was already verified in the last run. */
+int state_skip_group(int group) {
+  if(state_cached_ownership() == NULL)
+    return 0;
+  return !state.bitmaps_changed[group];
+}
 
-  if(BLOCKSIZE == 1024)
-    blockgroup_offset = SUPERBLOCK_OFFSET + SUPERBLOCK_SIZE;
-  else
-    // The first group descriptor locates in the next block following superblock
-    blockgroup_offset = BLOCKSIZE;
+void state_keep_links(int* mark, size_t count) {
+  if(state_prefix != NULL && mark != state.links) {
+    sparse_zero(state.links, sizeof(int) * count);
+    sparse_copy(state.links, mark, sizeof(int) * count);
+  }
+}
 
-  unsigned char blockgroup_buf[BLOCKSIZE];
+void state_keep_ownership(struct block_map* map, size_t count) {
+  if(state_prefix != NULL) {
+    sparse_zero(state.owned, sizeof(int) * count);
+    bmap_store(map, state.owned, count);
+  }
+}
 
-  // find the start sector for first block group descriptor
-  int blockgroup_start_sector = parArray[parIndex-1].start_sect + blockgroup_offset/SECTOR_SIZE_BYTES;
-                              
-  // Read one block to get all the block group descriptor                            
-  read_sectors(blockgroup_start_sector, BLOCK_SECTOR_RATIO, blockgroup_buf);  
+/*
+ * Save the state of parIndex after its check.  Repairs made the
+ * fingerprints stale, so they are recomputed first.
+ */
+void state_finish(int parIndex) {
+  if(state_prefix == NULL)
+    return;
 
-  // Find the corresponding group descriptor according to the block_group
-  struct ext2_group_desc* group_desc = (struct ext2_group_desc*)(blockgroup_buf + block_group * BLOCK_GROUP_DESC);
+  if(txn_write_count != state.writes)
+    state_fingerprint(parIndex);
+
+  char tmp[4096 + 8];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", state_path(parIndex));
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1
+     || write(fd, &state.hdr, sizeof(state.hdr)) != sizeof(state.hdr)
+     || write(fd, state.fp, sizeof(struct group_fingerprint) * state.hdr.group_num)
+        != sizeof(struct group_fingerprint) * state.hdr.group_num
+     || sparse_pwrite(fd, state.links, sizeof(int) * (size_t) state.hdr.inodes_count, state_links_offset()) != 0
+     || sparse_pwrite(fd, state.owned, sizeof(int) * (size_t) state.hdr.mark_blocks, state_owned_offset()) != 0
+     || fsync(fd) != 0) {
+    perror("Could not write state file");
+    exit(-1);
+  }
+  close(fd);
+  if(rename(tmp, state_path(parIndex)) != 0) {
+    perror("Could not write state file");
+    exit(-1);
+  }
 
-  // Find the start sector of inode table
-  int inodetable_start_sector = parArray[parIndex-1].start_sect + group_desc->bg_inode_table * BLOCK_SECTOR_RATIO;
+  free(state.fp);
+  free(state.itable_changed);
+  free(state.bitmaps_changed);
+  sparse_free(state.links, sizeof(int) * (size_t) state.hdr.inodes_count);
+  sparse_free(state.owned, sizeof(int) * (size_t) state.hdr.mark_blocks);
+  memset(&state, 0, sizeof(state));
+}
 
-  // Find the sector of the target inode based on inode table start sector
-  int sect_num = inodetable_start_sector + local_inode_index*INODE_SIZE / SECTOR_SIZE_BYTES;
 
-  // Calculate the offset within the sector
-  int offset_within_sect = local_inode_index*INODE_SIZE % SECTOR_SIZE_BYTES;
+/* With --max-memory the pass 2 and 3 loops hand back their marks this many inodes at a time */
+#define MARK_DONE_WINDOW      (1 << 16)
 
-  // Read the whole target sector
-  unsigned char inode_buf[SECTOR_SIZE_BYTES];
+/*
+ * Inode table blocks for the pass 2 and 3 loops: when the loop enters a
+ * block it is read whole and compared against the link marks in one
+ * link_scan, only the inodes it flags are looked at one by one.  The
+ * tables come from a pipeline that reads them ahead while the loop scans.
+ */
+struct link_scan {
+  unsigned char* table;
+  struct block_pipe* pipe;        // NULL to read the blocks directly
+  int first;                      // inode in table[0], 0 if none scanned
+  int n;
+  unsigned char flags[EXT2_MAX_BLOCK_SIZE / INODE_SIZE];
+};
 
-  read_sectors(sect_num, 1, inode_buf);
+/*
+ * Start a pipeline over the inode tables from group first_group on, the
+ * groups the state file lets the loop skip left out.  Returns the extents
+ * to free after pipe_close.
+ */
+static struct pipe_extent* itable_pipe_open(struct block_pipe* pipe, int parIndex, int first_group) {
+  struct ext2_super_block super = get_superblock(parIndex);
+  __u32 groups;
+  const struct ext2_group_desc* gdt = Get_Group_Desc_Table(parIndex, &groups);
+  struct pipe_extent* extent = (struct pipe_extent*) malloc(sizeof(struct pipe_extent) * (groups + 1));
+  int n = 0;
+  __u32 g = first_group > 0 ? first_group : 0;
+
+  for(; g < groups; g++) {
+    if(state_skip_inode(g * super.s_inodes_per_group + 1))
+      continue;
+    extent[n].start = block_sector(parIndex, gdt[g].bg_inode_table);
+    extent[n].sectors = (int64_t) super.s_inodes_per_group * INODE_SIZE / SECTOR_SIZE_BYTES;
+    n++;
+  }
+  pipe_open(pipe, extent, n, pipe_depth);
+  return extent;
+}
 
-  struct ext2_inode* inode = (struct ext2_inode*)(inode_buf + offset_within_sect);
+static int link_flags(struct link_scan* scan, int inodeIndex, int parIndex, int* mark, int count) {
+  if(scan->first == 0 || inodeIndex < scan->first || inodeIndex >= scan->first + scan->n) {
+    int inodes_per_block = BLOCKSIZE / INODE_SIZE;
+    int inodes_per_group = get_superblock(parIndex).s_inodes_per_group;
 
-  if(inode->i_links_count != 0) {
-    if(m != 0 && m != inode->i_links_count) {
-      printf("partition: %d, inode: %d, link_count: %d, actually_link_count: %d\n", parIndex, inodeIndex, inode->i_links_count, m);        
-      inode->i_links_count = m;
-      write_sectors(sect_num, 1, inode_buf);
-    }
-  }
-  return 0;
+    scan->first = inodeIndex - (inodeIndex - 1) % inodes_per_group % inodes_per_block;
+    scan->n = scan->first + inodes_per_block > count ? count - scan->first : inodes_per_block;
 
+    struct inode_location location = Get_Inode_Location(scan->first, parIndex);
+    if(scan->pipe != NULL)
+      pipe_read(scan->pipe, location.sect_num, BLOCK_SECTOR_RATIO, scan->table);
+    else
+      read_sectors(location.sect_num, BLOCK_SECTOR_RATIO, scan->table);
+    kernels->link_scan(scan->table, mark + scan->first, scan->n, scan->flags);
+  }
+  return scan->flags[inodeIndex - scan->first];
 }
 
-
 void pass1(int parIndex) {
 
   int count = Get_Inode_Counts(parIndex);
-  int* mark = (int*)malloc(sizeof(int) * count);
-  memset(mark, 0, sizeof(int) * count);
+  size_t arena = arena_mark();
+  int* mark = (int*)arena_alloc(sizeof(int) * count);
   //Start from the root inode (inode 2)
   struct ext2_inode root_inode = Get_Root_Inode(parIndex);
 
@@ -839,67 +3217,154 @@ void pass1(int parIndex) {
       printf("root inode is not a directory!");
       exit(-1);
   } else {
-    read_directory_recursive(root_inode.i_block, ROOT_INODE, ROOT_INODE, parIndex, mark);
+    io_hint(parIndex, POSIX_FADV_RANDOM);
+    if(worker_threads > 1)
+      walk_tree(parIndex, count, check_directory_visit, NULL);
+    else
+      read_directory_recursive(root_inode.i_block, ROOT_INODE, ROOT_INODE, parIndex, mark);
   }
 
   printf("Finish pass 1 for partition %d\n", parIndex);
-  free(mark);
+  arena_release(arena);
 
 }
 
 void pass2(int parIndex) {
-  int count = Get_Inode_Counts(parIndex);
-  int* mark = (int*)malloc(sizeof(int) * count);
+  struct ext2_super_block super = get_superblock(parIndex);
+  int count = super.s_inodes_count;
+  int inodes_per_group = super.s_inodes_per_group;
+  int first_ino = EXT2_FIRST_INO(&super);
+  size_t arena = arena_mark();
+  int* mark = (int*)arena_alloc(sizeof(int) * count);
   int flag;
+  int start = checkpoint_load_marks(parIndex, 2, mark, count, NULL, 0);
+  struct link_scan scan;
+  struct block_pipe pipe;
+
+  scan.table = get_block_buf();
+  scan.pipe = &pipe;
+
+  if(start < 0 && state_cached_links() != NULL) {
+    sparse_copy(mark, state_cached_links(), sizeof(int) * count);
+    start = 0;
+  }
 
   while(1) {
     flag = 0;
-    memset(mark, 0, sizeof(int) * count);
-    //Start from the root inode (inode 2)
-    struct ext2_inode root_inode = Get_Root_Inode(parIndex);    
-    // mark[ROOT_INODE] = 1;
-    read_inode_recursive(root_inode.i_block, parIndex, mark);        
-    int i = 2;
+    if(start < 0) {
+      sparse_zero(mark, sizeof(int) * count);
+      //Start from the root inode (inode 2)
+      io_hint(parIndex, POSIX_FADV_RANDOM);
+      link_count_tree(parIndex, mark, count);
+      checkpoint_save_marks(mark, count, NULL, 0);
+    }
+    io_hint(parIndex, POSIX_FADV_SEQUENTIAL);
+    scan.first = 0;
+    int i = start > 2 ? start : 2;
+    struct pipe_extent* extent = itable_pipe_open(&pipe, parIndex, (i - 1) / inodes_per_group);
     for (; i < count; i++) {
-      if(Check_Inode_linkcount_pass2(i, parIndex, mark[i])) {
+      checkpoint_progress(i, CHECKPOINT_INTERVAL);
+      if(i % MARK_DONE_WINDOW == 0)
+        sparse_done(mark + i - MARK_DONE_WINDOW, sizeof(int) * MARK_DONE_WINDOW);
+      if(state_skip_inode(i))
+        continue;
+      // Reserved inodes such as the resize inode have no directory entry
+      if(i < first_ino && i != ROOT_INODE)
+        continue;
+      if((link_flags(&scan, i, parIndex, mark, count) & LINK_UNREFERENCED)
+         && Check_Inode_linkcount_pass2(i, parIndex, mark[i])) {
         flag = 1;
         break;
       }
     }    
-    if(flag)
+    pipe_close(&pipe);
+    pipe_stats(parIndex, "pass 2 inode tables", &pipe);
+    free(extent);
+    if(flag) {
+      // The lost+found repair changed the tree, count the links again
+      checkpoint_discard_marks();
+      state_invalidate();
+      start = -1;
       continue;
+    }
     else
       break;
   }
   printf("Finish pass 2 for partition %d\n", parIndex);
-  free(mark);  
+  put_block_buf(scan.table);
+  arena_release(arena);
 }
 
 void pass3(int parIndex) {
    int count = Get_Inode_Counts(parIndex);
-  int* mark = (int*)malloc(sizeof(int) * count);
-  memset(mark, 0, sizeof(int) * count);
-  //Start from the root inode (inode 2)
-  struct ext2_inode root_inode = Get_Root_Inode(parIndex);
-
+  int inodes_per_group = get_superblock(parIndex).s_inodes_per_group;
+  size_t arena = arena_mark();
+  int* mark = (int*)arena_alloc(sizeof(int) * count);
+  int start = checkpoint_load_marks(parIndex, 3, mark, count, NULL, 0);
+  struct link_scan scan;
+  struct block_pipe pipe;
+
+  scan.table = get_block_buf();
+  scan.pipe = &pipe;
+  scan.first = 0;
+
+  if(start < 0 && state_cached_links() != NULL) {
+    sparse_copy(mark, state_cached_links(), sizeof(int) * count);
+    start = 0;
+  }
 
-  // mark[ROOT_INODE] = 1;
-  read_inode_recursive(root_inode.i_block, parIndex, mark);
+  if(start < 0) {
+    sparse_zero(mark, sizeof(int) * count);
+    //Start from the root inode (inode 2)
+    io_hint(parIndex, POSIX_FADV_RANDOM);
+    link_count_tree(parIndex, mark, count);
+    checkpoint_save_marks(mark, count, NULL, 0);
+    start = 0;
+  }
 
-  int i = 0;
+  // There is no inode 0, its mark only counts deleted entries
+  io_hint(parIndex, POSIX_FADV_SEQUENTIAL);
+  int i = start > 1 ? start : 1;
+  struct pipe_extent* extent = itable_pipe_open(&pipe, parIndex, (i - 1) / inodes_per_group);
   for (; i < count; i++) {
-    Check_Inode_linkcount_pass3(i, parIndex, mark[i]);
+    checkpoint_progress(i, CHECKPOINT_INTERVAL);
+    if(i % MARK_DONE_WINDOW == 0)
+      sparse_done(mark + i - MARK_DONE_WINDOW, sizeof(int) * MARK_DONE_WINDOW);
+    if(state_skip_inode(i))
+      continue;
+    if(link_flags(&scan, i, parIndex, mark, count) & LINK_COUNT_OFF)
+      Check_Inode_linkcount_pass3(i, parIndex, mark[i]);
   }
+  pipe_close(&pipe);
+  pipe_stats(parIndex, "pass 3 inode tables", &pipe);
+  free(extent);
+  state_keep_links(mark, count);
   printf("Finish pass 3 for partition %d\n", parIndex);
-  free(mark);   
+  put_block_buf(scan.table);
+  arena_release(arena);
+
+}
+
+/*
+ * The resize inode has no directory entry.  Its doubly indirect block
+ * lists the reserved descriptor blocks, which group_meta_blocks covers,
+ * but the block itself is only known from the inode.
+ */
+static void mark_resize_inode(int parIndex, struct ext2_super_block* super, struct block_map* map) {
+  if(!(super->s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INO))
+    return;
 
+  struct ext2_inode inode = Get_Inode(RESIZE_INODE, parIndex);
+  __u32 dind = inode.i_block[EXT2_DIND_BLOCK];
+  if(dind != 0 && dind < super->s_blocks_count)
+    bmap_set_range(map, dind, 1);
 }
 
 void pass4(int parIndex) {
 
   struct ext2_super_block super = get_superblock(parIndex);
 
-  int block_count = super.s_blocks_count;
+  __u32 block_count = super.s_blocks_count;
   int inode_count = super.s_inodes_count;
   int inode_count_per_group = super.s_inodes_per_group;
   int block_count_per_group = super.s_blocks_per_group;
@@ -908,106 +3373,522 @@ void pass4(int parIndex) {
   int group_num = inode_count / inode_count_per_group;
   int inode_table_occupied_blocks = (sizeof(struct ext2_inode) * inode_count_per_group + BLOCKSIZE - 1)/ BLOCKSIZE;
 
-  int* mark = (int*) malloc(sizeof(int) * block_count_per_group * group_num);
-  int* visited = (int*) malloc(sizeof(int) * inode_count);
+  size_t arena = arena_mark();
+  size_t mark_count = (size_t) block_count_per_group * group_num;
+  struct block_map map;
+  int* visited = (int*) arena_alloc(sizeof(int) * inode_count);
 
-  memset(mark, 0, sizeof(int) * block_count_per_group * group_num);
-  memset(visited, 0, sizeof(int) * inode_count);
+  // A checkpoint keeps the block mark as an int per block
+  int* mark = checkpoint_fd != -1 ? (int*) sparse_alloc(sizeof(int) * mark_count) : NULL;
 
-  struct ext2_inode root_inode = Get_Root_Inode(parIndex);
+  bmap_open(&map, mark_count);
+  if(frag.out != NULL)
+    frag_begin(inode_count, group_num);
+  int start = checkpoint_load_marks(parIndex, 4, mark, mark_count, visited, inode_count);
+  if(start >= 0)
+    bmap_load(&map, mark, mark_count);
 
-  visited[ROOT_INODE] = 1;
+  if(start < 0 && state_cached_ownership() != NULL && frag.out == NULL) {
+    bmap_load(&map, state_cached_ownership(), mark_count);
+    start = 0;
+  }
 
-  read_block_recursive(root_inode.i_block, parIndex, mark, visited);
+  if(start < 0) {
+    sparse_zero(visited, sizeof(int) * inode_count);
 
+    struct ext2_inode root_inode = Get_Root_Inode(parIndex);
 
-  // Set the block of metadata
+    visited[ROOT_INODE] = 1;
 
-  // get all the group descriptors
-  int64_t blockgroup_offset;
+    io_hint(parIndex, POSIX_FADV_RANDOM);
+    if(async_walks > 0)
+      async_walk_tree(parIndex, inode_count, async_mark_entries, async_mark_block, &map);
+    else if(worker_threads > 1)
+      walk_tree(parIndex, inode_count, mark_blocks_visit, &map);
+    else
+      read_block_recursive(root_inode.i_block, ROOT_INODE, parIndex, &map, visited);
+    frag.walked = 1;
+    if(mark != NULL) {
+      bmap_store(&map, mark, mark_count);
+      checkpoint_save_marks(mark, mark_count, visited, inode_count);
+    }
+    start = 0;
+  }
+  if(mark != NULL)
+    sparse_free(mark, sizeof(int) * mark_count);
 
-  if(BLOCKSIZE == 1024)
-    blockgroup_offset = SUPERBLOCK_OFFSET + SUPERBLOCK_SIZE;
-  else // The first group descriptor locates in the next block following superblock    
-    blockgroup_offset = BLOCKSIZE;
 
-  unsigned char blockgroup_buf[BLOCKSIZE];
-  unsigned char block_bitmap[BLOCKSIZE];
+  // Set the block of metadata
 
-  // find the start sector for first block group descriptor
-  int blockgroup_start_sector = parArray[parIndex-1].start_sect + blockgroup_offset/SECTOR_SIZE_BYTES;
-                              
-  // Read one block to get all the block group descriptor                            
-  read_sectors(blockgroup_start_sector, BLOCK_SECTOR_RATIO, blockgroup_buf);  
-    
-  int count = 0;
+  mark_resize_inode(parIndex, &super, &map);
+
+  // get all the group descriptors
+  __u32 groups;
+  const struct ext2_group_desc* gdt = Get_Group_Desc_Table(parIndex, &groups);
+  unsigned char* block_bitmap = get_block_buf();
+
+  if(groups < group_num)
+    group_num = groups;
+
+  // The bitmaps of the groups the loop visits are read ahead by a pipeline
+  struct block_pipe pipe;
+  struct pipe_extent* extent = (struct pipe_extent*) malloc(sizeof(struct pipe_extent) * (group_num + 1));
+  int extents = 0;
+  int count = start;
+  for(; count < group_num; count++) {
+    if(frag.out == NULL && state_skip_group(count))
+      continue;
+    extent[extents].start = block_sector(parIndex, gdt[count].bg_block_bitmap);
+    extent[extents++].sectors = BLOCK_SECTOR_RATIO;
+  }
+  pipe_open(&pipe, extent, extents, pipe_depth);
+
+  io_hint(parIndex, POSIX_FADV_SEQUENTIAL);
+  count = start;
   for(; count < group_num; count++) {
+    checkpoint_progress(count, CHECKPOINT_GROUP_INTERVAL);
+    if(frag.out == NULL && state_skip_group(count))
+      continue;
      // Find the corresponding group descriptor according to the block_group
-    struct ext2_group_desc* group_desc = (struct ext2_group_desc*)(blockgroup_buf + count * BLOCK_GROUP_DESC);  
+    const struct ext2_group_desc* group_desc = &gdt[count];
     
     // set the block bitmap
-    mark[group_desc->bg_block_bitmap] = 1;
+    bmap_set_range(&map, group_desc->bg_block_bitmap, 1);
 
     // set the inode bitmap
-    mark[group_desc->bg_inode_bitmap] = 1;
+    bmap_set_range(&map, group_desc->bg_inode_bitmap, 1);
 
 
     // set the inode table
-    int table_start = 0;
-    for(; table_start < inode_table_occupied_blocks; table_start++) {
-      mark[group_desc->bg_inode_table + table_start] = 1;
+    bmap_set_range(&map, group_desc->bg_inode_table, inode_table_occupied_blocks);
+
+    // set the super block, group descriptors and reserved descriptors
+    __u32 meta_first = group_first_block(&super, count);
+    __u32 meta_blocks = group_meta_blocks(&super, count);
+    if(meta_first < block_count)
+      bmap_set_range(&map, meta_first, meta_blocks < block_count - meta_first ? meta_blocks : block_count - meta_first);
+
+    // Compare and Set the bitmap
+    int64_t block_bitmap_start_block = block_sector(parIndex, group_desc->bg_block_bitmap);
+
+    pipe_read(&pipe, block_bitmap_start_block, BLOCK_SECTOR_RATIO, block_bitmap);
+
+    // For each block in the current block group, compare with the bitmap, and do the fix if needed
+    __u32 first_index = (__u32) count * block_count_per_group + (BLOCKSIZE == 1024 ? 1 : 0);
+    int nbits = first_index >= block_count ? 0
+              : block_count - first_index < block_count_per_group ? block_count - first_index : block_count_per_group;
+    int changed = kernels->bitmap_diff(block_bitmap, &map, nbits, first_index);
+    if(frag.out != NULL)
+      frag_free_group(count, block_bitmap, nbits);
+    if(changed)
+      write_sectors(block_bitmap_start_block, BLOCK_SECTOR_RATIO, block_bitmap);     
+    else
+      io_dontneed(block_bitmap_start_block, BLOCK_SECTOR_RATIO);
+  }
+  pipe_close(&pipe);
+  pipe_stats(parIndex, "pass 4 block bitmaps", &pipe);
+  bmap_stats(parIndex, &map);
+  free(extent);
+  if(frag.out != NULL)
+    frag_end(parIndex);
+
+
+  state_keep_ownership(&map, mark_count);
+
+  bmap_close(&map);
+  put_block_buf(block_bitmap);
+  arena_release(arena);
+}
+
+
+/*
+ * Superblock and descriptor backups
+ *
+ * Before the passes the primary superblock is sanity checked.  When it is
+ * unusable the backups are probed where mke2fs puts them for each block
+ * size, one group of 8 * block size blocks after another, and the nearest
+ * usable one is copied over the primary; the whole device is never
+ * scanned.  Then every backup of the superblock and the descriptor table is
+ * compared with the primary, all of them read ahead in one batch first,
+ * and a backup that disagrees is rewritten from the primary.
+ */
+
+#define SUPER_PROBE_GROUPS      64          /* groups probed for a backup */
+
+static int superblock_usable(const struct ext2_super_block* sb, int64_t sectors) {
+  if(sb->s_magic != EXT2_SUPER_MAGIC || (1024 << sb->s_log_block_size) > EXT2_MAX_BLOCK_SIZE)
+    return 0;
+
+  __u32 block_size = 1024 << sb->s_log_block_size;
+  return sb->s_blocks_per_group != 0 && sb->s_blocks_per_group <= 8 * block_size
+    && sb->s_inodes_per_group != 0 && sb->s_first_data_block == (block_size == 1024)
+    && sb->s_blocks_count != 0
+    && (int64_t) sb->s_blocks_count * (block_size / SECTOR_SIZE_BYTES) <= sectors
+    && sb->s_inodes_count == group_count(sb) * sb->s_inodes_per_group;
+}
+
+/* The fields every copy of the superblock has to agree on. */
+static int superblock_same_geometry(const struct ext2_super_block* a, const struct ext2_super_block* b) {
+  return a->s_magic == b->s_magic
+    && a->s_inodes_count == b->s_inodes_count
+    && a->s_blocks_count == b->s_blocks_count
+    && a->s_first_data_block == b->s_first_data_block
+    && a->s_log_block_size == b->s_log_block_size
+    && a->s_blocks_per_group == b->s_blocks_per_group
+    && a->s_inodes_per_group == b->s_inodes_per_group
+    && a->s_rev_level == b->s_rev_level
+    && a->s_feature_compat == b->s_feature_compat
+    && a->s_feature_incompat == b->s_feature_incompat
+    && a->s_feature_ro_compat == b->s_feature_ro_compat
+    && !memcmp(a->s_uuid, b->s_uuid, sizeof(a->s_uuid));
+}
+
+/*
+ * Make sure the primary superblock is usable, restoring it from the nearest
+ * backup if not.  Returns 0 when there is no usable copy at all.
+ */
+int superblock_recover(int parIndex) {
+  unsigned char buf[SUPERBLOCK_SIZE];
+  struct ext2_super_block* sb = (struct ext2_super_block*) buf;
+  int64_t sectors = part_sectors(parIndex);
+
+  read_sectors(part_start(parIndex) + SUPERBLOCK_OFFSET / SECTOR_SIZE_BYTES, 2, buf);
+  if(superblock_usable(sb, sectors))
+    return 1;
 
+  __u32 group = 1;
+  for(; group < SUPER_PROBE_GROUPS; group++) {
+    int log = 0;
+    for(; (1024 << log) <= EXT2_MAX_BLOCK_SIZE; log++) {
+      int block_size = 1024 << log;
+      int64_t sector = ((block_size == 1024) + (int64_t) group * 8 * block_size) * (block_size / SECTOR_SIZE_BYTES);
+      if(sector + 2 > sectors)
+        continue;
+
+      read_sectors(part_start(parIndex) + sector, 2, buf);
+      if(!superblock_usable(sb, sectors) || sb->s_log_block_size != log
+         || sb->s_blocks_per_group != 8 * block_size || sb->s_block_group_nr != group)
+        continue;
+
+      if(report(REPORT_SUPER_RESTORED, group, 0, 0))
+        printf("partition: %d, bad primary superblock, restored from the backup in group %u\n", parIndex, group);
+      sb->s_block_group_nr = 0;
+      write_sectors(part_start(parIndex) + SUPERBLOCK_OFFSET / SECTOR_SIZE_BYTES, 2, buf);
+      return 1;
     }
+  }
 
-    // set the super block and group descriptor
-    if(count == 0 || count == 1 || count == 9 || count == 25 || count == 49) {
-      // the group descriptor is the block ahead of block bitmap
-      mark[group_desc->bg_block_bitmap - 1] = 1;
+  if(report(REPORT_NO_SUPERBLOCK, 0, 0, 0))
+    printf("partition: %d, no usable superblock, not checked\n", parIndex);
+  return 0;
+}
 
-      // the super group is the block ahead of block bitmap
-      mark[group_desc->bg_block_bitmap - 2] = 1;
+/*
+ * Compare every backup of the superblock and the descriptor table with the
+ * primary and rewrite the ones that differ.  Only what has to be the same
+ * everywhere is compared: free counts and times are only kept current in
+ * the primary.
+ */
+void check_backups(int parIndex) {
+  struct ext2_super_block super = get_superblock(parIndex);
+  __u32 groups;
+  const struct ext2_group_desc* gdt = Get_Group_Desc_Table(parIndex, &groups);
+  __u32 gdt_blocks = group_gdt_blocks(&super);
+  size_t gdt_bytes = (size_t) groups * BLOCK_GROUP_DESC;
+  struct ext2_group_desc* primary = (struct ext2_group_desc*) malloc(gdt_bytes + 1);
+  unsigned char* backup = (unsigned char*) malloc((size_t) gdt_blocks * BLOCKSIZE + 1);
+  unsigned char buf[SUPERBLOCK_SIZE];
+  struct ext2_super_block* sb = (struct ext2_super_block*) buf;
+
+  // The cached table may be reloaded under us, keep a copy of the primary
+  memcpy(primary, gdt, gdt_bytes);
+
+  __u32 g = 1;
+  for(; g < groups; g++) {
+    if(group_has_super(&super, g))
+      io_willneed(block_sector(parIndex, group_first_block(&super, g)),
+                  (int64_t) (1 + gdt_blocks) * BLOCK_SECTOR_RATIO);
+  }
 
+  for(g = 1; g < groups; g++) {
+    if(!group_has_super(&super, g))
+      continue;
+    __u32 first = group_first_block(&super, g);
+
+    // Backups start their block, only the primary is 1024 bytes in
+    read_sectors(block_sector(parIndex, first), 2, buf);
+    if(!superblock_same_geometry(sb, &super) || sb->s_block_group_nr != g) {
+      if(report(REPORT_BACKUP_SUPER, g, 0, 0))
+        printf("partition: %d, group: %u, backup superblock differs from the primary, rewritten\n", parIndex, g);
+      memcpy(buf, &super, SUPERBLOCK_SIZE);
+      sb->s_block_group_nr = g;
+      write_sectors(block_sector(parIndex, first), 2, buf);
     }
 
-    // Compare and Set the bitmap
-    int block_bitmap_start_block = parArray[parIndex-1].start_sect + group_desc->bg_block_bitmap * BLOCK_SECTOR_RATIO;
+    read_sectors(block_sector(parIndex, first + 1), gdt_blocks * BLOCK_SECTOR_RATIO, backup);
+    __u32 i = 0;
+    for(; i < groups; i++) {
+      struct ext2_group_desc* desc = (struct ext2_group_desc*) (backup + i * BLOCK_GROUP_DESC);
+      if(desc->bg_block_bitmap != primary[i].bg_block_bitmap
+         || desc->bg_inode_bitmap != primary[i].bg_inode_bitmap
+         || desc->bg_inode_table != primary[i].bg_inode_table)
+        break;
+    }
+    if(i < groups) {
+      if(report(REPORT_BACKUP_GDT, g, 0, 0))
+        printf("partition: %d, group: %u, backup group descriptors differ from the primary, rewritten\n", parIndex, g);
+      memcpy(backup, primary, gdt_bytes);
+      write_sectors(block_sector(parIndex, first + 1), gdt_blocks * BLOCK_SECTOR_RATIO, backup);
+    }
+  }
 
-    read_sectors(block_bitmap_start_block, BLOCK_SECTOR_RATIO, block_bitmap); 
+  free(backup);
+  free(primary);
+}
 
-    // For each block in the current block group, compare with the bitmap, and do the fix if needed
-    int base = count * block_count_per_group;
-    int blk_idx = 0;
-    for(; blk_idx < block_count_per_group; blk_idx++) {
-      //set this bit
-      int tmp = blk_idx / 8;
-      int off = blk_idx % 8;
-      int mark_index;
-      if(BLOCKSIZE == 1024)
-        mark_index = base + blk_idx + 1;
-      else
-        mark_index = base + blk_idx ;
-      if(mark_index < block_count && (mark[mark_index] << off) != (block_bitmap[tmp] & (1 << off))) {
-        printf("the orginal:%d, index: %d, mark: %d \n",block_bitmap[tmp] & (1 << off), mark_index, mark[mark_index]);
 
-        if(mark_index < block_count) {
-          if(mark[mark_index])
-            block_bitmap[tmp] = block_bitmap[tmp] | (1 << off);
-          else
-            block_bitmap[tmp] = block_bitmap[tmp] & (!(1 << off));
-        }
-      }
-    
-        
-          // printf("the orginal:%d, index: %d, mark: %d \n",block_bitmap[tmp] & (1 << off), mark_index, mark[mark_index]);
-      // }
-      
-    } 
-    write_sectors(block_bitmap_start_block, BLOCK_SECTOR_RATIO, block_bitmap);     
+/*
+ * Superblock scan (--scan)
+ *
+ * For images whose partition table or primary superblocks are damaged.
+ * The device is streamed in SCAN_CHUNK pieces, and every sector is a
+ * candidate superblock start: partitions are sector aligned and backups
+ * start their block.  The magic sits at the same offset in every sector,
+ * so the magics of SCAN_LANES consecutive sectors are gathered into one
+ * vector (GCC vector extensions) and compared at once.  Only sectors that
+ * match are looked at further.
+ *
+ * A candidate with a plausible geometry tells where its file system
+ * starts, from its group number and block size.  Candidates are grouped by
+ * that start and the UUID into layouts.  Each layout is then confirmed by
+ * reading the copies its geometry predicts in other groups.
+ */
+
+#define SCAN_CHUNK              (8 << 20)
+#define SCAN_LANES              16
+#define SCAN_MAX_LAYOUTS        256
+#define SCAN_CONFIRM_COPIES     8           /* predicted copies read per layout */
+
+typedef __u16 scan_vec __attribute__((vector_size(SCAN_LANES * sizeof(__u16))));
+
+struct scan_layout {
+  int64_t start;                // byte offset of the file system on the device
+  struct ext2_super_block super;
+  int     found;                // copies the scan came across
+  int     checked;              // predicted copies read
+  int     confirmed;            // predicted copies that matched
+  int     primary;              // group 0 copy confirmed
+};
+
+static struct scan_layout* scan_layouts;
+
+static int scan_layout_count;
+
+/*
+ * Where the file system of the superblock copy at offset starts, -1 if the
+ * copy does not make sense there.
+ */
+static int64_t scan_fs_start(const struct ext2_super_block* sb, int64_t offset) {
+  if(sb->s_magic != EXT2_SUPER_MAGIC || (1024 << sb->s_log_block_size) > EXT2_MAX_BLOCK_SIZE
+     || sb->s_blocks_per_group == 0)
+    return -1;
+
+  int64_t block_size = 1024 << sb->s_log_block_size;
+  __u32 group = sb->s_block_group_nr;
+  int64_t start = group == 0 ? offset - SUPERBLOCK_OFFSET
+                             : offset - (int64_t) group_first_block(sb, group) * block_size;
+
+  if(start < 0 || start % SECTOR_SIZE_BYTES || group >= group_count(sb) || !group_has_super(sb, group)
+     || !superblock_usable(sb, (device_bytes() - start) / SECTOR_SIZE_BYTES))
+    return -1;
+  return start;
+}
+
+static void scan_candidate(int64_t offset) {
+  unsigned char buf[SUPERBLOCK_SIZE];
+  struct ext2_super_block* sb = (struct ext2_super_block*) buf;
+
+  if(offset + SUPERBLOCK_SIZE > device_bytes())
+    return;
+  read_sectors(offset / SECTOR_SIZE_BYTES, 2, buf);
+
+  int64_t start = scan_fs_start(sb, offset);
+  if(start < 0)
+    return;
+
+  int i = 0;
+  for(; i < scan_layout_count; i++) {
+    if(scan_layouts[i].start == start && !memcmp(scan_layouts[i].super.s_uuid, sb->s_uuid, sizeof(sb->s_uuid)))
+      break;
+  }
+  if(i == scan_layout_count) {
+    if(scan_layout_count == SCAN_MAX_LAYOUTS)
+      return;
+    memset(&scan_layouts[i], 0, sizeof(scan_layouts[i]));
+    scan_layouts[i].start = start;
+    scan_layouts[i].super = *sb;
+    scan_layout_count++;
+  }
+  scan_layouts[i].found++;
+}
+
+/* Sectors [0, n) of a chunk that hold the superblock magic. */
+static void scan_chunk(const unsigned char* chunk, int n, int64_t offset) {
+  const int magic = offsetof(struct ext2_super_block, s_magic);
+  scan_vec want = (scan_vec) {0} + EXT2_SUPER_MAGIC;
+  int s = 0;
+
+  for(; s + SCAN_LANES <= n; s += SCAN_LANES) {
+    scan_vec v;
+    int lane = 0;
+    for(; lane < SCAN_LANES; lane++)
+      v[lane] = *(const __u16*) (chunk + (int64_t) (s + lane) * SECTOR_SIZE_BYTES + magic);
+
+    union { scan_vec v; __u64 q[sizeof(scan_vec) / sizeof(__u64)]; } hit;
+    hit.v = (scan_vec) (v == want);
+    __u64 any = 0;
+    int q = 0;
+    for(; q < (int) (sizeof(hit.q) / sizeof(__u64)); q++)
+      any |= hit.q[q];
+    if(!any)
+      continue;
+
+    for(lane = 0; lane < SCAN_LANES; lane++) {
+      if(hit.v[lane])
+        scan_candidate(offset + (int64_t) (s + lane) * SECTOR_SIZE_BYTES);
+    }
+  }
+  for(; s < n; s++) {
+    if(*(const __u16*) (chunk + (int64_t) s * SECTOR_SIZE_BYTES + magic) == EXT2_SUPER_MAGIC)
+      scan_candidate(offset + (int64_t) s * SECTOR_SIZE_BYTES);
+  }
+}
+
+/* Read the copies the layout's geometry predicts and count the ones that agree. */
+static void scan_confirm(struct scan_layout* layout) {
+  unsigned char buf[SUPERBLOCK_SIZE];
+  struct ext2_super_block* sb = (struct ext2_super_block*) buf;
+  __u32 groups = group_count(&layout->super);
+  int64_t block_size = 1024 << layout->super.s_log_block_size;
+  __u32 g = 0;
+
+  for(; g < groups && layout->checked < SCAN_CONFIRM_COPIES; g++) {
+    if(!group_has_super(&layout->super, g))
+      continue;
+    int64_t offset = g == 0 ? layout->start + SUPERBLOCK_OFFSET
+                            : layout->start + (int64_t) group_first_block(&layout->super, g) * block_size;
+    if(offset + SUPERBLOCK_SIZE > device_bytes())
+      break;
+
+    read_sectors(offset / SECTOR_SIZE_BYTES, 2, buf);
+    layout->checked++;
+    if(sb->s_magic == EXT2_SUPER_MAGIC && sb->s_block_group_nr == g
+       && superblock_same_geometry(sb, &layout->super)) {
+      layout->confirmed++;
+      if(g == 0)
+        layout->primary = 1;
+    }
+  }
+}
+
+static int scan_layout_cmp(const void* a, const void* b) {
+  const struct scan_layout* x = (const struct scan_layout*) a;
+  const struct scan_layout* y = (const struct scan_layout*) b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+void scan_superblocks(void) {
+  unsigned char* chunk;
+  int64_t offset = 0;
+  size_t got;
+
+  if(posix_memalign((void**) &chunk, 4096, SCAN_CHUNK) != 0) {
+    perror("Could not allocate the scan buffer");
+    exit(-1);
   }
+  scan_layouts = (struct scan_layout*) malloc(sizeof(struct scan_layout) * SCAN_MAX_LAYOUTS);
+  scan_layout_count = 0;
+
+  while((got = device_stream(offset, chunk, SCAN_CHUNK)) > 0) {
+    scan_chunk(chunk, got / SECTOR_SIZE_BYTES, offset);
+    offset += got;
+  }
+
+  qsort(scan_layouts, scan_layout_count, sizeof(struct scan_layout), scan_layout_cmp);
+  int i = 0;
+  for(; i < scan_layout_count; i++) {
+    struct scan_layout* layout = &scan_layouts[i];
+    int64_t block_size = 1024 << layout->super.s_log_block_size;
+    int64_t length = (int64_t) layout->super.s_blocks_count * block_size;
+
+    scan_confirm(layout);
+    printf("layout: %d, start sector: %"PRId64", sectors: %"PRId64", block size: %"PRId64", groups: %u, "
+           "copies found: %d, confirmed: %d/%d%s\n", i + 1, layout->start / SECTOR_SIZE_BYTES,
+           length / SECTOR_SIZE_BYTES, block_size, group_count(&layout->super), layout->found,
+           layout->confirmed, layout->checked, layout->primary ? "" : ", primary superblock bad");
+    printf("  check with --offset %"PRId64" --length %"PRId64"\n", layout->start, length);
+  }
+  if(scan_layout_count == 0)
+    printf("no ext2 superblock found\n");
+
+  free(scan_layouts);
+  free(chunk);
+}
+
 
+/*
+ * Run all the passes on one partition, skipping the ones a resumed
+ * checkpoint has already completed.
+ */
+void check_partition(int parIndex) {
+  report_begin_pass(parIndex, 0);
+  if(!superblock_recover(parIndex)) {
+    report_summary(parIndex);
+    return;
+  }
 
-  free(mark);
-  free(visited);
+  struct ext2_super_block super = get_superblock(parIndex);
+  select_kernels(BLOCKSIZE);
+  check_backups(parIndex);
+  path_index_open(super.s_inodes_count);
+  size_t inode_mark = sizeof(int) * super.s_inodes_count + ARENA_ALIGN;
+
+  // pass 2 may run pass 1 on top of its own mark, pass 4 keeps its block
+  // mark in a block map of its own
+  arena_prepare(2 * inode_mark);
+
+  if(state_begin(parIndex) == STATE_UNCHANGED)
+    printf("partition: %d, unchanged since the last check\n", parIndex);
+
+  if(state.level < STATE_REUSE_LINKS && checkpoint_need_pass(parIndex, 1)) {
+    checkpoint_begin_pass(parIndex, 1);
+    report_begin_pass(parIndex, 1);
+    pass1(parIndex);
+    txn_flush();
+  }
+  if(state.level < STATE_REUSE_OWNERSHIP && checkpoint_need_pass(parIndex, 2)) {
+    checkpoint_begin_pass(parIndex, 2);
+    report_begin_pass(parIndex, 2);
+    pass2(parIndex);
+    txn_flush();
+  }
+  if(state.level < STATE_REUSE_OWNERSHIP && checkpoint_need_pass(parIndex, 3)) {
+    checkpoint_begin_pass(parIndex, 3);
+    report_begin_pass(parIndex, 3);
+    pass3(parIndex);
+    txn_flush();
+  }
+  if((state.level < STATE_UNCHANGED || frag.out != NULL) && checkpoint_need_pass(parIndex, 4)) {
+    checkpoint_begin_pass(parIndex, 4);
+    report_begin_pass(parIndex, 4);
+    pass4(parIndex);
+    txn_flush();
+  }
+  state_finish(parIndex);
+  path_index_close();
+  report_summary(parIndex);
+  checkpoint_begin_pass(parIndex, PASS_DONE);
+  io_hint(parIndex, POSIX_FADV_NORMAL);
 }
 
 
@@ -1023,6 +3904,34 @@ void usage(const char* progname) {
   printf("Program Options:\n");
   printf("  -p --print <partition number> -i /path/to/disk/image\n");
   printf("  -f --fix   <partition number> -i /path/to/disk/image\n");
+  printf("     --checkpoint <file>  save progress of -f to <file>\n");
+  printf("     --resume             continue -f from the last --checkpoint\n");
+  printf("     --undo-file <file>   save the original contents of repaired sectors\n");
+  printf("     --state <prefix>     keep per-group fingerprints in <prefix>.<partition>\n");
+  printf("                          and only re-check what changed since the last run\n");
+  printf("     --direct             bypass the page cache (O_DIRECT)\n");
+  printf("     --cache-mb <n>       size of the block cache, default %d\n", CACHE_DEFAULT_MB);
+  printf("     --max-memory <n>     keep to about <n> MB, large pass arrays go to a scratch\n");
+  printf("                          file and the block cache gets a quarter at most\n");
+  printf("     --scratch-dir <dir>  where the scratch file goes, default $TMPDIR or /var/tmp\n");
+  printf("     --threads <n>        worker threads for the directory walks, 0 for one per CPU\n");
+  printf("     --queue-depth <n>    batches the inode table and bitmap readers keep ahead, default %d\n",
+         PIPE_DEFAULT_DEPTH);
+  printf("     --async <n>          walk up to <n> inodes at once, reading their blocks\n");
+  printf("                          asynchronously, for the link counts and the block mark\n");
+  printf("     --stats              print reader pipeline and cache statistics\n");
+  printf("     --raw                the image is a bare partition, check it as partition 1\n");
+  printf("     --offset <bytes> [--length <bytes>]\n");
+  printf("                          check this byte range of the image as partition 1\n");
+  printf("     --export <file>      with -p, clone or sparse-copy that partition to <file>\n");
+  printf("     --overlay <file>     leave the image read-only, stage all writes in <file>\n");
+  printf("     --commit-overlay <file> -i /path/to/disk/image  merge <file> into the image\n");
+  printf("     --undo <file> -i /path/to/disk/image  roll back the repairs saved in <file>\n");
+  printf("     --report <file>      with -f, write the problems found to <file> instead of stdout\n");
+  printf("     --report-format ndjson|binary  format of the --report file, default ndjson\n");
+  printf("     --frag-report <file> with -f, measure file and free space fragmentation in pass 4,\n");
+  printf("                          a summary on stdout, every file and group in <file>\n");
+  printf("     --scan -i /path/to/disk/image  find ext2 file systems by their superblocks\n");
   exit(-1);
 }
 
@@ -1033,8 +3942,45 @@ void main(int argc, char** argv) {
       {"print", required_argument, 0, 'p'},
       {"fix",   required_argument, 0, 'f'},
       {"input", required_argument, 0, 'i'},
+      {"checkpoint", required_argument, 0, OPT_CHECKPOINT},
+      {"resume", no_argument,           0, OPT_RESUME},
+      {"undo-file", required_argument,  0, OPT_UNDO_FILE},
+      {"undo", required_argument,       0, OPT_UNDO},
+      {"state", required_argument,      0, OPT_STATE},
+      {"direct", no_argument,           0, OPT_DIRECT},
+      {"cache-mb", required_argument,   0, OPT_CACHE_MB},
+      {"raw", no_argument,              0, OPT_RAW},
+      {"offset", required_argument,     0, OPT_OFFSET},
+      {"length", required_argument,     0, OPT_LENGTH},
+      {"export", required_argument,     0, OPT_EXPORT},
+      {"overlay", required_argument,    0, OPT_OVERLAY},
+      {"commit-overlay", required_argument, 0, OPT_COMMIT_OVERLAY},
+      {"scan", no_argument,             0, OPT_SCAN},
+      {"report", required_argument,     0, OPT_REPORT},
+      {"report-format", required_argument, 0, OPT_REPORT_FORMAT},
+      {"threads", required_argument,    0, OPT_THREADS},
+      {"queue-depth", required_argument, 0, OPT_QUEUE_DEPTH},
+      {"stats", no_argument,            0, OPT_STATS},
+      {"async", required_argument,      0, OPT_ASYNC},
+      {"max-memory", required_argument, 0, OPT_MAX_MEMORY},
+      {"scratch-dir", required_argument, 0, OPT_SCRATCH_DIR},
+      {"frag-report", required_argument, 0, OPT_FRAG_REPORT},
       {0, 0, 0, 0}
     };
+    char* disk_image = NULL;
+    char* export_path = NULL;
+    char* commit_overlay_path = NULL;
+    int64_t raw_offset = -1;
+    int64_t raw_length = 0;
+    char* checkpoint_path = NULL;
+    char* undo_file_path = NULL;
+    char* undo_path = NULL;
+    int scan = 0;
+    char* report_path = NULL;
+    char* frag_path = NULL;
+    int report_format = REPORT_NDJSON;
+
+    txn_init();
 
     int print_partition_num = 0;
     int fix_partition_num = -1;
@@ -1052,7 +3998,89 @@ void main(int argc, char** argv) {
           break;
         case 'i':
           // printf("disk image: '%s'\n", optarg);
-          GetAllPartitons(optarg);
+          disk_image = optarg;
+          break;
+        case OPT_CHECKPOINT:
+          checkpoint_path = optarg;
+          break;
+        case OPT_RESUME:
+          resume_requested = 1;
+          break;
+        case OPT_UNDO_FILE:
+          undo_file_path = optarg;
+          break;
+        case OPT_UNDO:
+          undo_path = optarg;
+          break;
+        case OPT_STATE:
+          state_prefix = optarg;
+          break;
+        case OPT_DIRECT:
+          direct_io = 1;
+          break;
+        case OPT_CACHE_MB:
+          cache_mb = atoi(optarg);
+          break;
+        case OPT_RAW:
+          raw_offset = 0;
+          break;
+        case OPT_OFFSET:
+          raw_offset = strtoll(optarg, NULL, 0);
+          break;
+        case OPT_LENGTH:
+          raw_length = strtoll(optarg, NULL, 0);
+          break;
+        case OPT_EXPORT:
+          export_path = optarg;
+          break;
+        case OPT_OVERLAY:
+          overlay_path = optarg;
+          break;
+        case OPT_COMMIT_OVERLAY:
+          commit_overlay_path = optarg;
+          break;
+        case OPT_SCAN:
+          scan = 1;
+          break;
+        case OPT_REPORT:
+          report_path = optarg;
+          break;
+        case OPT_THREADS:
+          worker_threads = atoi(optarg);
+          if(worker_threads <= 0)
+            worker_threads = sysconf(_SC_NPROCESSORS_ONLN);
+          break;
+        case OPT_QUEUE_DEPTH:
+          pipe_depth = atoi(optarg);
+          if(pipe_depth < 1)
+            usage(argv[0]);
+          break;
+        case OPT_STATS:
+          show_stats = 1;
+          break;
+        case OPT_ASYNC:
+          async_walks = atoi(optarg);
+          if(async_walks < 1)
+            usage(argv[0]);
+          break;
+        case OPT_MAX_MEMORY:
+          max_memory_mb = atoi(optarg);
+          if(max_memory_mb < 1)
+            usage(argv[0]);
+          break;
+        case OPT_SCRATCH_DIR:
+          scratch_dir = optarg;
+          break;
+        case OPT_FRAG_REPORT:
+          frag_path = optarg;
+          break;
+        case OPT_REPORT_FORMAT:
+          if(!strcmp(optarg, "ndjson"))
+            report_format = REPORT_NDJSON;
+          else if(!strcmp(optarg, "binary"))
+            report_format = REPORT_BINARY;
+          else
+            usage(argv[0]);
           break;
         default:
           usage(argv[0]);          
@@ -1061,39 +4089,93 @@ void main(int argc, char** argv) {
     }
 
 
+  if(commit_overlay_path != NULL && (overlay_path != NULL || disk_image == NULL))
+    usage(argv[0]);
+
+  if(scan && disk_image == NULL)
+    usage(argv[0]);
+
+  // The block cache is the one big allocation that is not sparse
+  if(max_memory_mb > 0 && cache_mb > max_memory_mb / 4)
+    cache_mb = max_memory_mb / 4 > 0 ? max_memory_mb / 4 : 1;
+
+  // Open the image only now, --direct may come after -i
+  if(disk_image != NULL) {
+    // The scan does not trust the partition table
+    if(scan)
+      GetRawPartition(disk_image, 0, 0);
+    else if(raw_offset >= 0)
+      GetRawPartition(disk_image, raw_offset, raw_length);
+    else
+      GetAllPartitons(disk_image);
+  }
+
   if(print_partition_num != 0){
       if (print_partition_num > parArrayCounter || print_partition_num < 0)
         printf("%d\n", -1);
       else {
-        printf("0x%02X %d %d\n", parArray[print_partition_num-1].sys_ind, parArray[print_partition_num-1].start_sect,
-        parArray[print_partition_num-1].nr_sects);      
+        printf("0x%02X %"PRId64" %"PRId64"\n", parArray[print_partition_num-1].sys_ind, part_start(print_partition_num),
+        part_sectors(print_partition_num));      
+        if(export_path != NULL)
+          ExportPartition(print_partition_num, export_path);
       }
   } 
 
+  if(resume_requested && checkpoint_path == NULL)
+    usage(argv[0]);
+
+  if(undo_path != NULL) {
+    if(parArray == NULL)
+      usage(argv[0]);
+    undo_restore(undo_path);
+  }
+
+  if(commit_overlay_path != NULL)
+    overlay_commit(commit_overlay_path);
+
+  if(scan)
+    scan_superblocks();
+
   if(fix_partition_num != -1) {
+    if(checkpoint_path != NULL)
+      checkpoint_open(checkpoint_path, fix_partition_num);
+    if(undo_file_path != NULL)
+      undo_open(undo_file_path, resume_requested);
+    if(report_path != NULL)
+      report_open(report_path, report_format);
+    if(frag_path != NULL)
+      frag_open(frag_path);
+
     if(fix_partition_num == 0) {
       int idx = 1;
       for(; idx <= parArrayCounter; idx++) {
         if(parArray[idx-1].sys_ind == LINUX_EXT2_PARTITION) {
-          pass1(idx);
-          pass2(idx);
-          pass3(idx);
-          pass4(idx);
+          check_partition(idx);
         }
       }
     } else {
       if(fix_partition_num <= parArrayCounter &&  fix_partition_num>0) {
-          pass1(fix_partition_num);
-          pass2(fix_partition_num);
-          pass3(fix_partition_num);
-          pass4(fix_partition_num);
+          check_partition(fix_partition_num);
       }
     }
+
+    txn_flush();
+    checkpoint_close();
+    undo_close();
+    report_close();
+    frag_close();
+
+    if(show_stats) {
+      long hits, misses;
+      io_stats(&hits, &misses);
+      printf("cache: %ld hits, %ld misses\n", hits, misses);
+    }
   }
 
 
 
 
+  arena_destroy();
   free(parArray);
 
 
@@ -0,0 +1,581 @@
+/*
+ * myinject.c
+ *
+ * Seeded corruption injector for myfsck regression runs.  It reads the
+ * partition with the same code as the checker and writes the damage
+ * straight into the image, or into copy-on-write overlays of it, so a
+ * single run can stamp out thousands of corrupted variants of one base
+ * image:
+ *
+ *   dot       the '.' entry of a directory points at another inode
+ *   dotdot    the '..' entry of a directory points at another inode
+ *   links     the link count of an inode is off
+ *   orphan    a file is unlinked from its directory but stays allocated
+ *   bitmap    a bit of a block bitmap is flipped
+ *   dup       a file block pointer is redirected to a block of another file
+ *   indirect  the tail of an indirect block chain is cut off
+ *
+ * Every variant has its own random stream derived from --seed and the
+ * variant number, so a failing variant can be reproduced on its own.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ext2_disk.h"
+
+/* getopt codes of the long-only options */
+#define OPT_VARIANTS          256
+#define OPT_OVERLAY           257
+#define OPT_RAW               258
+#define OPT_OFFSET            259
+#define OPT_LENGTH            260
+#define OPT_DIRECT            261
+#define OPT_CACHE_MB          262
+
+#define CORRUPT_DOT           0
+#define CORRUPT_DOTDOT        1
+#define CORRUPT_LINKS         2
+#define CORRUPT_ORPHAN        3
+#define CORRUPT_BITMAP        4
+#define CORRUPT_DUP           5
+#define CORRUPT_INDIRECT      6
+#define CORRUPT_TYPES         7
+
+#define CORRUPT_ATTEMPTS      16          /* tries before a corruption is given up */
+
+static const char* corrupt_names[CORRUPT_TYPES] = {
+  "dot", "dotdot", "links", "orphan", "bitmap", "dup", "indirect"
+};
+
+static int    enabled_types[CORRUPT_TYPES];
+
+static int    enabled_count = 0;
+
+static int    variant = 0;
+
+static uint64_t rng_state;
+
+/*
+ * In-use inodes of the partition by kind, collected once from the base
+ * image.  Every variant starts from the base again, so they stay valid.
+ */
+static int*   dirs = NULL;
+
+static int    dir_count = 0;
+
+static int*   files = NULL;
+
+static int    file_count = 0;
+
+static int*   indirect_files = NULL;
+
+static int    indirect_count = 0;
+
+
+/* splitmix64 */
+static uint64_t rng_next(void) {
+  uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static __u32 rng_below(__u32 n) {
+  return (__u32) (rng_next() % n);
+}
+
+static void rng_seed(uint64_t seed, int var) {
+  rng_state = seed;
+  rng_state = rng_next() ^ (uint64_t) var;
+}
+
+/*
+ * Scan the inode tables once and sort the in-use inodes into directories,
+ * regular files with data, and files with an indirect block.
+ */
+void build_inventory(int parIndex) {
+  struct ext2_super_block super = get_superblock(parIndex);
+  int first_ino = super.s_rev_level == EXT2_GOOD_OLD_REV ? EXT2_GOOD_OLD_FIRST_INO : super.s_first_ino;
+  int group_num = super.s_inodes_count / super.s_inodes_per_group;
+  int inodes_per_block = BLOCKSIZE / INODE_SIZE;
+  int table_blocks = (super.s_inodes_per_group + inodes_per_block - 1) / inodes_per_block;
+  unsigned char* buf = get_block_buf();
+
+  dirs = (int*) malloc(sizeof(int) * super.s_inodes_count);
+  files = (int*) malloc(sizeof(int) * super.s_inodes_count);
+  indirect_files = (int*) malloc(sizeof(int) * super.s_inodes_count);
+
+  int group = 0;
+  for(; group < group_num; group++) {
+    struct ext2_group_desc group_desc = Get_Group_Desc(group, parIndex);
+    io_willneed(block_sector(parIndex, group_desc.bg_inode_table), (int64_t) table_blocks * BLOCK_SECTOR_RATIO);
+
+    int blk = 0;
+    for(; blk < table_blocks; blk++) {
+      read_sectors(block_sector(parIndex, group_desc.bg_inode_table + blk), BLOCK_SECTOR_RATIO, buf);
+
+      int i = 0;
+      for(; i < inodes_per_block; i++) {
+        int local = blk * inodes_per_block + i;
+        int inodeIndex = group * super.s_inodes_per_group + local + 1;
+        struct ext2_inode* inode = (struct ext2_inode*) (buf + i * INODE_SIZE);
+
+        if(local >= super.s_inodes_per_group)
+          break;
+        if(inodeIndex < first_ino && inodeIndex != ROOT_INODE)
+          continue;
+        if(inode->i_links_count == 0 || inode->i_mode == 0 || inode->i_block[0] == 0)
+          continue;
+
+        int type = Get_Inode_Type(inode->i_mode);
+        if(type == 2)
+          dirs[dir_count++] = inodeIndex;
+        if(type == 1) {
+          files[file_count++] = inodeIndex;
+          if(inode->i_block[EXT2_IND_BLOCK] != 0)
+            indirect_files[indirect_count++] = inodeIndex;
+        }
+      }
+    }
+  }
+  put_block_buf(buf);
+}
+
+/*
+ * Point the '.' (entry 0) or '..' (entry 1) of a random directory at some
+ * other inode.
+ */
+int corrupt_reference(int parIndex, int entry) {
+  struct ext2_super_block super = get_superblock(parIndex);
+
+  if(dir_count == 0)
+    return 0;
+
+  int inodeIndex = dirs[rng_below(dir_count)];
+  struct ext2_inode inode = Get_Inode(inodeIndex, parIndex);
+  unsigned char* buf = get_block_buf();
+  read_sectors(block_sector(parIndex, inode.i_block[0]), BLOCK_SECTOR_RATIO, buf);
+
+  struct ext2_dir_entry_2* dir = (struct ext2_dir_entry_2*) buf;
+  if(entry == 1)
+    dir = (struct ext2_dir_entry_2*) (buf + dir->rec_len);
+
+  __u32 old = dir->inode;
+  __u32 wrong;
+  do {
+    wrong = rng_below(super.s_inodes_count) + 1;
+  } while(wrong == old);
+
+  dir->inode = wrong;
+  write_sectors(block_sector(parIndex, inode.i_block[0]), BLOCK_SECTOR_RATIO, buf);
+  put_block_buf(buf);
+
+  printf("variant: %d, partition: %d, %s, inode: %d, was: %u, now: %u\n", variant, parIndex,
+         corrupt_names[entry == 0 ? CORRUPT_DOT : CORRUPT_DOTDOT], inodeIndex, old, wrong);
+  return 1;
+}
+
+int corrupt_links(int parIndex) {
+  int total = dir_count + file_count;
+
+  if(total == 0)
+    return 0;
+
+  __u32 pick = rng_below(total);
+  int inodeIndex = pick < dir_count ? dirs[pick] : files[pick - dir_count];
+  struct ext2_inode inode = Get_Inode(inodeIndex, parIndex);
+  int old = inode.i_links_count;
+
+  // never 0, the checker takes that for a free inode
+  if(old > 1 && rng_below(2))
+    inode.i_links_count = old - 1 - rng_below(old - 1);
+  else
+    inode.i_links_count = old + 1 + rng_below(3);
+
+  Put_Inode(inodeIndex, parIndex, &inode);
+  printf("variant: %d, partition: %d, links, inode: %d, was: %d, now: %d\n", variant, parIndex,
+         inodeIndex, old, inode.i_links_count);
+  return 1;
+}
+
+/*
+ * Remove the entry of a random regular file from a random directory,
+ * leaving the inode and its blocks allocated.
+ */
+int corrupt_orphan(int parIndex) {
+  if(dir_count == 0)
+    return 0;
+
+  int inodeIndex = dirs[rng_below(dir_count)];
+  struct ext2_inode inode = Get_Inode(inodeIndex, parIndex);
+  struct dir_stream stream;
+  int seen = 0;
+  __u32 victim_block = 0;
+  int victim_offset = 0;
+
+  // reservoir sample one regular file entry over the directory blocks
+  dir_stream_open(&stream, inode.i_block, parIndex);
+  while(dir_stream_next(&stream)) {
+    int len = 0;
+    while(len < BLOCKSIZE) {
+      struct ext2_dir_entry_2* dir = (struct ext2_dir_entry_2*) (stream.data + len);
+      if(dir->rec_len == 0)
+        break;
+      if(dir->inode != 0 && dir->file_type == 1 && rng_below(++seen) == 0) {
+        victim_block = stream.block;
+        victim_offset = len;
+      }
+      len += dir->rec_len;
+    }
+  }
+  dir_stream_close(&stream);
+
+  if(victim_block == 0)
+    return 0;
+
+  unsigned char* buf = get_block_buf();
+  read_sectors(block_sector(parIndex, victim_block), BLOCK_SECTOR_RATIO, buf);
+  struct ext2_dir_entry_2* victim = (struct ext2_dir_entry_2*) (buf + victim_offset);
+  int child = victim->inode;
+
+  if(victim_offset == 0) {
+    victim->inode = 0;
+  } else {
+    // the previous entry swallows the victim
+    int len = 0;
+    struct ext2_dir_entry_2* prev = (struct ext2_dir_entry_2*) buf;
+    while(len + prev->rec_len < victim_offset) {
+      len += prev->rec_len;
+      prev = (struct ext2_dir_entry_2*) (buf + len);
+    }
+    prev->rec_len += victim->rec_len;
+  }
+  write_sectors(block_sector(parIndex, victim_block), BLOCK_SECTOR_RATIO, buf);
+  put_block_buf(buf);
+
+  printf("variant: %d, partition: %d, orphan, inode: %d, directory: %d\n", variant, parIndex,
+         child, inodeIndex);
+  return 1;
+}
+
+int corrupt_bitmap(int parIndex) {
+  struct ext2_super_block super = get_superblock(parIndex);
+  int group_num = super.s_inodes_count / super.s_inodes_per_group;
+  int group = rng_below(group_num);
+  int blocks = super.s_blocks_count - super.s_first_data_block - group * super.s_blocks_per_group;
+
+  if(blocks > (int) super.s_blocks_per_group)
+    blocks = super.s_blocks_per_group;
+  if(blocks <= 0)
+    return 0;
+
+  struct ext2_group_desc group_desc = Get_Group_Desc(group, parIndex);
+  unsigned char* buf = get_block_buf();
+  int bit = rng_below(blocks);
+
+  read_sectors(block_sector(parIndex, group_desc.bg_block_bitmap), BLOCK_SECTOR_RATIO, buf);
+  buf[bit / 8] ^= 1 << (bit % 8);
+  write_sectors(block_sector(parIndex, group_desc.bg_block_bitmap), BLOCK_SECTOR_RATIO, buf);
+
+  printf("variant: %d, partition: %d, bitmap, group: %d, block: %d, now: %d\n", variant, parIndex,
+         group, super.s_first_data_block + group * super.s_blocks_per_group + bit,
+         (buf[bit / 8] >> (bit % 8)) & 1);
+  put_block_buf(buf);
+  return 1;
+}
+
+/* Pick a random used direct block slot of an inode, -1 if it has none. */
+static int pick_direct_slot(struct ext2_inode* inode) {
+  int used = 0;
+  while(used < EXT2_NDIR_BLOCKS && inode->i_block[used] != 0)
+    used++;
+  return used ? (int) rng_below(used) : -1;
+}
+
+/*
+ * Make a direct block pointer of one file refer to a block another file
+ * already owns.
+ */
+int corrupt_dup(int parIndex) {
+  if(file_count < 2)
+    return 0;
+
+  int inodeIndex = files[rng_below(file_count)];
+  int owner = files[rng_below(file_count)];
+  if(owner == inodeIndex)
+    return 0;
+
+  struct ext2_inode inode = Get_Inode(inodeIndex, parIndex);
+  struct ext2_inode owner_inode = Get_Inode(owner, parIndex);
+  int slot = pick_direct_slot(&inode);
+  int owner_slot = pick_direct_slot(&owner_inode);
+  if(slot == -1 || owner_slot == -1 || inode.i_block[slot] == owner_inode.i_block[owner_slot])
+    return 0;
+
+  __u32 old = inode.i_block[slot];
+  inode.i_block[slot] = owner_inode.i_block[owner_slot];
+  Put_Inode(inodeIndex, parIndex, &inode);
+
+  printf("variant: %d, partition: %d, dup, inode: %d, slot: %d, was: %u, now: %u, owner: %d\n",
+         variant, parIndex, inodeIndex, slot, old, inode.i_block[slot], owner);
+  return 1;
+}
+
+/*
+ * Cut a single indirect block short: every pointer from a random used one
+ * on is cleared, the blocks they referred to stay marked in the bitmap.
+ */
+int corrupt_indirect(int parIndex) {
+  if(indirect_count == 0)
+    return 0;
+
+  int inodeIndex = indirect_files[rng_below(indirect_count)];
+  struct ext2_inode inode = Get_Inode(inodeIndex, parIndex);
+  __u32 indirect = inode.i_block[EXT2_IND_BLOCK];
+  unsigned char* buf = get_block_buf();
+  __u32* pointers = (__u32*) buf;
+  int per_block = BLOCKSIZE / sizeof(__u32);
+
+  read_sectors(block_sector(parIndex, indirect), BLOCK_SECTOR_RATIO, buf);
+
+  int used = 0;
+  while(used < per_block && pointers[used] != 0)
+    used++;
+  if(used == 0) {
+    put_block_buf(buf);
+    return 0;
+  }
+
+  int cut = rng_below(used);
+  memset(pointers + cut, 0, sizeof(__u32) * (used - cut));
+  write_sectors(block_sector(parIndex, indirect), BLOCK_SECTOR_RATIO, buf);
+  put_block_buf(buf);
+
+  printf("variant: %d, partition: %d, indirect, inode: %d, block: %u, cut: %d, dropped: %d\n",
+         variant, parIndex, inodeIndex, indirect, cut, used - cut);
+  return 1;
+}
+
+int corrupt(int parIndex, int type) {
+  switch(type) {
+    case CORRUPT_DOT:
+      return corrupt_reference(parIndex, 0);
+    case CORRUPT_DOTDOT:
+      return corrupt_reference(parIndex, 1);
+    case CORRUPT_LINKS:
+      return corrupt_links(parIndex);
+    case CORRUPT_ORPHAN:
+      return corrupt_orphan(parIndex);
+    case CORRUPT_BITMAP:
+      return corrupt_bitmap(parIndex);
+    case CORRUPT_DUP:
+      return corrupt_dup(parIndex);
+    case CORRUPT_INDIRECT:
+      return corrupt_indirect(parIndex);
+  }
+  return 0;
+}
+
+/*
+ * Apply count corruptions of randomly chosen enabled types, returns how
+ * many could be applied.
+ */
+int inject_variant(int parIndex, int count) {
+  int applied = 0;
+  int n = 0;
+  for(; n < count; n++) {
+    int attempt = 0;
+    for(; attempt < CORRUPT_ATTEMPTS; attempt++) {
+      int pick = rng_below(enabled_count);
+      int type = 0;
+      for(; type < CORRUPT_TYPES; type++) {
+        if(enabled_types[type] && pick-- == 0)
+          break;
+      }
+      if(corrupt(parIndex, type)) {
+        applied++;
+        break;
+      }
+    }
+  }
+  return applied;
+}
+
+/* Parse a comma separated list of corruption names into enabled_types. */
+void parse_types(char* list) {
+  char* name;
+  memset(enabled_types, 0, sizeof(enabled_types));
+  enabled_count = 0;
+
+  for(name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+    int type = 0;
+    for(; type < CORRUPT_TYPES; type++) {
+      if(strcmp(name, corrupt_names[type]) == 0)
+        break;
+    }
+    if(type == CORRUPT_TYPES) {
+      fprintf(stderr, "Unknown corruption type %s\n", name);
+      exit(-1);
+    }
+    if(!enabled_types[type]) {
+      enabled_types[type] = 1;
+      enabled_count++;
+    }
+  }
+}
+
+void usage(const char* progname) {
+  printf("Usage: %s [options] -i /path/to/disk/image\n", progname);
+  printf("Program Options:\n");
+  printf("  -p --partition <n>       partition to corrupt, default 1\n");
+  printf("  -n --count <n>           corruptions per variant, default 1\n");
+  printf("  -s --seed <n>            seed of the random stream, default 1\n");
+  printf("  -t --types <list>        comma separated subset of\n");
+  printf("                           dot,dotdot,links,orphan,bitmap,dup,indirect\n");
+  printf("     --overlay <file>      leave the image untouched, write into <file>\n");
+  printf("     --variants <n>        with --overlay, write <n> variants to <file>.0 ...\n");
+  printf("     --raw                 the image is a bare partition\n");
+  printf("     --offset <bytes> [--length <bytes>]\n");
+  printf("                           use this byte range of the image as partition 1\n");
+  printf("     --direct              bypass the page cache (O_DIRECT)\n");
+  printf("     --cache-mb <n>        size of the block cache, default %d\n", CACHE_DEFAULT_MB);
+  exit(-1);
+}
+
+
+int main(int argc, char** argv) {
+    int opt;
+    static struct option long_options[] = {
+      {"input", required_argument,     0, 'i'},
+      {"partition", required_argument, 0, 'p'},
+      {"count", required_argument,     0, 'n'},
+      {"seed", required_argument,      0, 's'},
+      {"types", required_argument,     0, 't'},
+      {"variants", required_argument,  0, OPT_VARIANTS},
+      {"overlay", required_argument,   0, OPT_OVERLAY},
+      {"raw", no_argument,             0, OPT_RAW},
+      {"offset", required_argument,    0, OPT_OFFSET},
+      {"length", required_argument,    0, OPT_LENGTH},
+      {"direct", no_argument,          0, OPT_DIRECT},
+      {"cache-mb", required_argument,  0, OPT_CACHE_MB},
+      {0, 0, 0, 0}
+    };
+    char  default_types[] = "dot,dotdot,links,orphan,bitmap,dup,indirect";
+    char* disk_image = NULL;
+    char* overlay_base = NULL;
+    char* types = default_types;
+    int64_t raw_offset = -1;
+    int64_t raw_length = 0;
+    uint64_t seed = 1;
+    int parIndex = 1;
+    int count = 1;
+    int variants = 1;
+
+    while((opt = getopt_long(argc, argv, "i:p:n:s:t:", long_options, NULL)) != EOF) {
+      switch (opt) {
+        case 'i':
+          disk_image = optarg;
+          break;
+        case 'p':
+          parIndex = atoi(optarg);
+          break;
+        case 'n':
+          count = atoi(optarg);
+          break;
+        case 's':
+          seed = strtoull(optarg, NULL, 0);
+          break;
+        case 't':
+          types = optarg;
+          break;
+        case OPT_VARIANTS:
+          variants = atoi(optarg);
+          break;
+        case OPT_OVERLAY:
+          overlay_base = optarg;
+          break;
+        case OPT_RAW:
+          raw_offset = 0;
+          break;
+        case OPT_OFFSET:
+          raw_offset = strtoll(optarg, NULL, 0);
+          break;
+        case OPT_LENGTH:
+          raw_length = strtoll(optarg, NULL, 0);
+          break;
+        case OPT_DIRECT:
+          direct_io = 1;
+          break;
+        case OPT_CACHE_MB:
+          cache_mb = atoi(optarg);
+          break;
+        default:
+          usage(argv[0]);
+          break;
+      }
+    }
+
+  if(disk_image == NULL || count < 1 || variants < 1 || (variants > 1 && overlay_base == NULL))
+    usage(argv[0]);
+  parse_types(types);
+
+  // One overlay file per variant, each one starts from the base image
+  char* overlay_file = NULL;
+  if(overlay_base != NULL) {
+    overlay_file = (char*) malloc(strlen(overlay_base) + 16);
+    if(variants > 1)
+      sprintf(overlay_file, "%s.%d", overlay_base, 0);
+    else
+      strcpy(overlay_file, overlay_base);
+    unlink(overlay_file);
+    overlay_path = overlay_file;
+  }
+
+  txn_init();
+  if(raw_offset >= 0)
+    GetRawPartition(disk_image, raw_offset, raw_length);
+  else
+    GetAllPartitons(disk_image);
+
+  if(parIndex < 1 || parIndex > parArrayCounter || parArray[parIndex-1].sys_ind != LINUX_EXT2_PARTITION) {
+    fprintf(stderr, "Partition %d is not an ext2 partition\n", parIndex);
+    exit(-1);
+  }
+  if(get_superblock(parIndex).s_magic != EXT2_SUPER_MAGIC) {
+    fprintf(stderr, "Partition %d has no ext2 superblock\n", parIndex);
+    exit(-1);
+  }
+
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  build_inventory(parIndex);
+
+  int applied = 0;
+  for(variant = 0; variant < variants; variant++) {
+    if(variant > 0) {
+      char* next = (char*) malloc(strlen(overlay_base) + 16);
+      sprintf(next, "%s.%d", overlay_base, variant);
+      unlink(next);
+      overlay_switch(next);
+      free(overlay_file);
+      overlay_file = next;
+    }
+    rng_seed(seed, variant);
+    applied += inject_variant(parIndex, count);
+    txn_flush();
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  fprintf(stderr, "%d corruptions in %d variants, %.3f s\n", applied, variants,
+          (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9);
+  return 0;
+}
@@ -35,7 +35,7 @@ my $g_tmp_dir;
 sub print_usage {
     print "./run_fsck.pl --partition --tmp_dir --image\n";
     print "\tpartition: The partition number on which to run system fsck\n";
-    print "\ttmp_dir: Directory in which to place extracted partition\n";
+    print "\ttmp_dir: Directory for interim files (partitions are no longer extracted)\n";
     print "\timage: The disk image file\n";
 }
 
@@ -67,22 +67,17 @@ sub run_system_fsck {
 	}
 
 	# Get informaton about relevant partition
-	my $p_data_file = "$g_tmp_dir/partition_" . "$_";;
 	my $p_start = $g_partition_table{$_}->[0];
 	my $p_length = $g_partition_table{$_}->[1];
-	print "Extracted partition name is: $p_data_file\n";
 	print "Partition start sector: $p_start.  Length: $p_length\n";
 	
-	# Extract partition and place it in $g_tmp_dir
-	my $cmd = "dd if=$g_image_file of=$p_data_file bs=512 ".
-	    "skip=$p_start count=$p_length";
-	if (system($cmd) != 0) {
-	    print "Could not extract partition $_";
-	    exit(-1);
-	}
+	# Point fsck at the partition inside the image instead of
+	# extracting it; the unix I/O manager takes an offset= option
+	my $p_data_file = "$g_image_file?offset=" . ($p_start * 512);
 
-	#Execute fsck on the extracted partition
-	$cmd = "$g_fsck_exec -y -f $p_data_file";
+	#Execute fsck on the partition, read-only: this is the user's
+	#original image, not a copy, so fsck must answer no to every fix
+	my $cmd = "$g_fsck_exec -n -f '$p_data_file'";
 
 	my $output = `$cmd`;
 	print "$output";
@@ -95,7 +90,7 @@ sub run_system_fsck {
 	    my @lines = split(/\n/, $output);
 	    my $count = 0;
 	    foreach (@lines) {
-		if ($_ =~ m/yes$/ == 1) {
+		if ($_ =~ m/no$/ == 1) {
 		    $count++;
 		}
 	    }	